@@ -0,0 +1,322 @@
+// masptracer-bench: renders a set of scenes repeatedly and reports their
+// wall times, throughput and memory, optionally compared to a saved baseline.
+// Every scene runs in a child process of its own, so the peak memory of one
+// doesn't hide that of the next and a crash only fails that scene.
+
+#include "views.h"
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Scenes rendered when none are given, relative to the working directory
+static const char *const default_dirs[] = {"1b", "1c", "1d"};
+
+#define BENCH_PATH 256
+#define BENCH_MAX_REPS 1000
+
+static int warmup = 1;
+static int reps = 5;
+static int threads;
+static float threshold = 5; // percent
+static const char *json_file_name;
+static const char *baseline_file_name;
+
+typedef struct BenchResult {
+  char scene[BENCH_PATH];
+  int ok; // 1 if rendered, 0 if it failed, -1 if the scene is invalid
+  double load_seconds; // median of parsing, texture loading and light tree
+  double median_seconds, p90_seconds, min_seconds; // of rendering
+  uint64_t rays; // per repetition
+  long peak_memory_kb;
+} BenchResult;
+
+static void print_usage(const char *program_name) {
+  fprintf(stderr,
+          "usage: %s [-C dir] [--warmup n] [--reps n] [--threads n] [--json file]\n"
+          "                        [--baseline file] [--threshold percent] [scene ...]\n"
+          "Renders the *.scene files of 1b, 1c and 1d if no scene is given\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted values
+static double percentile(const double *sorted, int len, double p) {
+  int rank = (int) ceil(p / 100 * len);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Renders the scene warmup + reps times, runs in the child process
+static void bench_scene(BenchResult *result) {
+  double load[BENCH_MAX_REPS], render[BENCH_MAX_REPS];
+  for (int i = 0; i < warmup + reps; i++) {
+    double begin = stats_clock();
+    Scene *scene = tracer_scene_load(result->scene);
+    if (!scene) {
+      result->ok = -1;
+      return;
+    }
+    double loaded = stats_clock();
+    View *views;
+    size_t len;
+    RenderStats stats = {0};
+    if (views_create(scene, NULL, &views, &len) != 0 ||
+        tracer_render_views(scene, views, len, NULL, threads, &stats) != 0)
+      return;
+    double rendered = stats_clock();
+    views_destroy(views, len);
+    tracer_scene_destroy(scene);
+    if (i < warmup)
+      continue;
+    load[i - warmup] = loaded - begin;
+    render[i - warmup] = rendered - loaded;
+    result->rays = render_stats_rays(&stats);
+  }
+  qsort(load, reps, sizeof(double), compare_double);
+  qsort(render, reps, sizeof(double), compare_double);
+  result->load_seconds = percentile(load, reps, 50);
+  result->median_seconds = percentile(render, reps, 50);
+  result->p90_seconds = percentile(render, reps, 90);
+  result->min_seconds = render[0];
+  result->ok = 1;
+}
+
+// Runs bench_scene in a child process, which reports back through a pipe
+static void run_scene(BenchResult *result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    return;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    bench_scene(result);
+    ssize_t written = write(fds[1], result, sizeof(BenchResult));
+    _exit(written == sizeof(BenchResult) ? 0 : 1);
+  }
+  close(fds[1]);
+  BenchResult child;
+  if (read(fds[0], &child, sizeof(child)) == sizeof(child))
+    *result = child;
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) == pid) {
+    result->peak_memory_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      result->ok = 0;
+  }
+}
+
+static int compare_string(const void *a, const void *b) {
+  return strcmp((const char *) a, (const char *) b);
+}
+
+// Appends the scene name, in dir if not NULL, to results. Paths that don't
+// fit in BENCH_PATH are skipped, cut short they could name another scene's
+// baseline. Returns 0 if successful or skipped, ENOMEM if out of memory.
+static int add_scene(const char *dir, const char *name, BenchResult **results, size_t *len) {
+  char path[BENCH_PATH];
+  int path_len = dir ? snprintf(path, sizeof(path), "%s/%s", dir, name)
+                     : snprintf(path, sizeof(path), "%s", name);
+  if (path_len < 0 || path_len >= BENCH_PATH) {
+    fprintf(stderr, "skipping %s%s%s: path longer than %d characters\n", dir ? dir : "",
+            dir ? "/" : "", name, BENCH_PATH - 1);
+    return 0;
+  }
+  BenchResult *grown = realloc(*results, sizeof(BenchResult) * (*len + 1));
+  if (!grown)
+    return ENOMEM;
+  *results = grown;
+  memset(&grown[*len], 0, sizeof(BenchResult));
+  memcpy(grown[*len].scene, path, (size_t) path_len + 1);
+  (*len)++;
+  return 0;
+}
+
+// Appends the *.scene files of dir, sorted by name, to results. Returns 0
+// if successful or dir can't be read, ENOMEM if out of memory.
+static int add_scene_dir(const char *dir, BenchResult **results, size_t *len) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "failed to open %s: %s\n", dir, strerror(errno));
+    return 0;
+  }
+  size_t first = *len;
+  struct dirent *entry;
+  int rc = 0;
+  while (rc == 0 && (entry = readdir(d))) {
+    size_t name_len = strlen(entry->d_name);
+    if (name_len >= 6 && strcmp(entry->d_name + name_len - 6, ".scene") == 0)
+      rc = add_scene(dir, entry->d_name, results, len);
+  }
+  closedir(d);
+  // scene is the first member, so the names sort the results
+  qsort(*results + first, *len - first, sizeof(BenchResult), compare_string);
+  return rc;
+}
+
+// Reads the median render time of scene from a file written by write_json,
+// returns 0 if the scene isn't in it
+static double baseline_seconds(const char *path, const char *scene) {
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return 0;
+  char line[1024], name[BENCH_PATH];
+  double seconds = 0, median;
+  // One scene per line, see write_json
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, " {\"scene\": \"%255[^\"]\", \"ok\": 1, \"load_seconds\": %*f, "
+                     "\"median_seconds\": %lf", name, &median) == 2 &&
+        strcmp(name, scene) == 0)
+      seconds = median;
+  }
+  fclose(in);
+  return seconds;
+}
+
+static int write_json(const char *path, const BenchResult *results, size_t len) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return errno;
+  fprintf(out, "{\n  \"warmup\": %d, \"reps\": %d, \"threads\": %d,\n  \"scenes\": [\n",
+          warmup, reps, threads);
+  for (size_t i = 0; i < len; i++) {
+    const BenchResult *r = &results[i];
+    double mrays = r->median_seconds > 0 ? r->rays / r->median_seconds / 1e6 : 0;
+    fprintf(out, "    {\"scene\": \"%s\", \"ok\": %d, \"load_seconds\": %.6lf, "
+                 "\"median_seconds\": %.6lf, \"p90_seconds\": %.6lf, \"min_seconds\": %.6lf, "
+                 "\"rays\": %llu, \"mrays_per_second\": %.3lf, \"peak_memory_kb\": %ld}%s\n",
+            r->scene, r->ok, r->load_seconds, r->median_seconds, r->p90_seconds,
+            r->min_seconds, (unsigned long long) r->rays, mrays, r->peak_memory_kb,
+            i + 1 < len ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  if (fclose(out) != 0)
+    return errno;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  BenchResult *results = NULL;
+  size_t len = 0;
+  int named = 0; // scenes were given, even if all of them were skipped
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-C") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      if (chdir(argv[i]) != 0) {
+        fprintf(stderr, "failed to change to %s: %s\n", argv[i], strerror(errno));
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--warmup") == 0) {
+      if (++i >= argc || (warmup = atoi(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--reps") == 0) {
+      if (++i >= argc || (reps = atoi(argv[i])) <= 0 || reps > BENCH_MAX_REPS)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      if (++i >= argc || (threads = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      json_file_name = argv[i];
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      baseline_file_name = argv[i];
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      if (++i >= argc || (threshold = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (argv[i][0] == '-') {
+      print_usage(argv[0]);
+    } else {
+      named = 1;
+      if (add_scene(NULL, argv[i], &results, &len) != 0) {
+        fprintf(stderr, "failed to list the scenes: %s\n", strerror(ENOMEM));
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (!len && !named) {
+    for (size_t i = 0; i < sizeof(default_dirs) / sizeof(default_dirs[0]); i++) {
+      if (add_scene_dir(default_dirs[i], &results, &len) != 0) {
+        fprintf(stderr, "failed to list the scenes: %s\n", strerror(ENOMEM));
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  if (!len)
+    print_usage(argv[0]);
+  if (!threads) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (int) cores : 1;
+  }
+
+  int failed = 0, regressed = 0, invalid = 0;
+  printf("%d warmup, %d measured runs per scene on %d thread%s\n", warmup, reps, threads,
+         threads == 1 ? "" : "s");
+  printf("%-36s %9s %9s %9s %9s %8s %9s%s\n", "scene", "load", "median", "p90", "min",
+         "Mrays/s", "peak MiB", baseline_file_name ? "   vs baseline" : "");
+  for (size_t i = 0; i < len; i++) {
+    BenchResult *r = &results[i];
+    run_scene(r);
+    // Scenes that don't parse aren't a performance problem, just skip them
+    if (r->ok < 0) {
+      printf("%-36s skipped, invalid scene\n", r->scene);
+      invalid++;
+      continue;
+    }
+    if (!r->ok) {
+      printf("%-36s failed\n", r->scene);
+      failed++;
+      continue;
+    }
+    printf("%-36s %8.4fs %8.4fs %8.4fs %8.4fs %8.2f %9.1f", r->scene, r->load_seconds,
+           r->median_seconds, r->p90_seconds, r->min_seconds,
+           r->median_seconds > 0 ? r->rays / r->median_seconds / 1e6 : 0,
+           r->peak_memory_kb / 1024.0);
+    double base = baseline_file_name ? baseline_seconds(baseline_file_name, r->scene) : 0;
+    if (base > 0) {
+      double change = 100 * (r->median_seconds - base) / base;
+      int regression = change > threshold;
+      regressed += regression;
+      printf("   %+6.1f%%%s", change, regression ? " REGRESSION" : "");
+    } else if (baseline_file_name) {
+      printf("   (new)");
+    }
+    printf("\n");
+  }
+
+  int rc;
+  if (json_file_name && (rc = write_json(json_file_name, results, len)) != 0) {
+    fprintf(stderr, "failed to write results to %s: %s\n", json_file_name, strerror(rc));
+    failed++;
+  }
+  if (invalid)
+    printf("%d invalid scene%s skipped\n", invalid, invalid == 1 ? "" : "s");
+  if (regressed)
+    printf("%d scene%s slower than the baseline by more than %.1f%%\n", regressed,
+           regressed == 1 ? "" : "s", threshold);
+  free(results);
+  return failed || regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,10 +5,16 @@
 static double rads(double deg) { return deg * (M_PI / 180); }
 
 int camera_create_from_scene(Scene *scene, Camera *out) {
+  return camera_create(scene->eye, scene->viewdir, scene->updir, scene->fov_h,
+                       scene->pixel_width, scene->pixel_height, out);
+}
+
+int camera_create(Vec3 eye, Vec3 viewdir, Vec3 updir, float fov_h, int width,
+                  int height, Camera *out) {
   Camera new_camera;
-  new_camera.eye_pos = scene->eye;
-  new_camera.viewdir = norm(scene->viewdir);
-  new_camera.up = norm(scene->updir);
+  new_camera.eye_pos = eye;
+  new_camera.viewdir = norm(viewdir);
+  new_camera.up = norm(updir);
 
   // We check if the two vectors are approximately identical (the cross product
   // will yield close to zero).
@@ -29,12 +35,11 @@ int camera_create_from_scene(Scene *scene, Camera *out) {
   // Calculate the viewing window dimensions
   //  assume distance from eye to viewing plane is an arbitrary 1, which
   //  simplifies expressions
-  new_camera.window_width = 2 * tan(rads(scene->fov_h) / 2);
-  double inv_asp_ratio =
-	  (double) scene->pixel_height / (double) scene->pixel_width;
+  new_camera.window_width = 2 * tan(rads(fov_h) / 2);
+  double inv_asp_ratio = (double) height / (double) width;
   new_camera.window_height = new_camera.window_width * inv_asp_ratio;
-  new_camera.window_pixel_width = scene->pixel_width;
-  new_camera.window_pixel_height = scene->pixel_height;
+  new_camera.window_pixel_width = width;
+  new_camera.window_pixel_height = height;
 
   Vec3 vw_center = vecadd(new_camera.eye_pos, new_camera.viewdir);
   Vec3 half_width = vecmul(new_camera.u, new_camera.window_width / 2);
@@ -49,18 +54,18 @@ int camera_create_from_scene(Scene *scene, Camera *out) {
 }
 
 Ray camera_trace_ray(Camera *camera, int x, int y) {
+  return camera_trace_ray_subpixel(camera, x + 0.5f, y + 0.5f);
+}
+
+Ray camera_trace_ray_subpixel(Camera *camera, float x, float y) {
   // The window starts from ul and goes to lr: (0, 0) is ul, (w, h) is lr
   Vec3 width_v = vecsub(camera->vw_ur, camera->vw_ul);
   Vec3 height_v = vecsub(camera->vw_ll, camera->vw_ul);
   Vec3 du = vecmul(vecdiv(width_v, camera->window_pixel_width), x);
   Vec3 dv = vecmul(vecdiv(height_v, camera->window_pixel_height), y);
-  Vec3 pad_u = vecdiv(width_v, camera->window_pixel_width * 2);
-  Vec3 pad_v = vecdiv(height_v, camera->window_pixel_height * 2);
 
   Vec3 vw_pos = vecadd(camera->vw_ul, du);
   vw_pos = vecadd(vw_pos, dv);
-  vw_pos = vecadd(vw_pos, pad_u);
-  vw_pos = vecadd(vw_pos, pad_v);
 
   return ray_from_line(camera->eye_pos, vw_pos);
 }
@@ -26,6 +26,15 @@ typedef struct Camera {
  */
 int camera_create_from_scene(Scene *scene, Camera *out);
 
+/**
+ * Calculates a camera frame looking from eye along viewdir, with a horizontal
+ * field of view of fov_h degrees, for an image of width x height pixels
+ *
+ * @return 0 if successful, 1 if updir and viewdir are zero or parallel
+ */
+int camera_create(Vec3 eye, Vec3 viewdir, Vec3 updir, float fov_h, int width,
+                  int height, Camera *out);
+
 /**
  * Creates a new ray that goes from the eye through the pixel represented by x and y
  *
@@ -35,4 +44,11 @@ int camera_create_from_scene(Scene *scene, Camera *out);
  */
 Ray camera_trace_ray(Camera *camera, int x, int y);
 
+/**
+ * Like camera_trace_ray, but for any point of the viewing window in continuous
+ * pixel coordinates: (0, 0) is the upper left corner of the first pixel and
+ * (x + 0.5, y + 0.5) is the center of pixel (x, y).
+ */
+Ray camera_trace_ray_subpixel(Camera *camera, float x, float y);
+
 #endif //_CAMERA_H_
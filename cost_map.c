@@ -0,0 +1,113 @@
+#include "cost_map.h"
+
+#include <stdlib.h>
+
+static const char *const channel_names[COST_CHANNELS] = {"rays", "tests", "nodes", "time"};
+
+CostMap *cost_map_new(int x0, int y0, int width, int height) {
+  CostMap *map = malloc(sizeof(CostMap));
+  if (!map)
+    return NULL;
+  map->x0 = x0;
+  map->y0 = y0;
+  map->width = width;
+  map->height = height;
+  map->pixels = calloc((size_t) width * height, sizeof(PixelCost));
+  if (!map->pixels) {
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+void cost_map_destroy(CostMap *map) {
+  if (!map)
+    return;
+  free(map->pixels);
+  free(map);
+}
+
+PixelCost *cost_map_at(CostMap *map, int x, int y) {
+  x -= map->x0;
+  y -= map->y0;
+  if (x < 0 || y < 0 || x >= map->width || y >= map->height)
+    return NULL;
+  return &map->pixels[(size_t) y * map->width + x];
+}
+
+static uint32_t saturate(uint64_t value) {
+  return value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+}
+
+void cost_map_record(CostMap *map, int x, int y, const RenderStats *before,
+                     const RenderStats *after, double seconds) {
+  PixelCost *cost = cost_map_at(map, x, y);
+  if (!cost)
+    return;
+  uint64_t tests = 0;
+  for (int i = 0; i < 3; i++)
+    tests += after->object_tests[i] - before->object_tests[i];
+  cost->rays = saturate(render_stats_rays(after) - render_stats_rays(before));
+  cost->tests = saturate(tests);
+  cost->nodes = saturate(after->light_nodes - before->light_nodes);
+  cost->nanoseconds = seconds * 1e9 >= UINT32_MAX ? UINT32_MAX : (uint32_t) (seconds * 1e9);
+}
+
+static uint32_t channel_value(const PixelCost *cost, CostChannel channel) {
+  switch (channel) {
+  case COST_RAYS:
+    return cost->rays;
+  case COST_TESTS:
+    return cost->tests;
+  case COST_NODES:
+    return cost->nodes;
+  default:
+    return cost->nanoseconds;
+  }
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Black, blue, red, yellow, white at t = 0, 0.25, 0.5, 0.75, 1
+PpmColor cost_map_false_color(float t) {
+  static const float stops[5][3] = {
+    {0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+  t = CLAMP(t) * 4;
+  int i = MIN((int) t, 3);
+  float f = t - i;
+  Color c;
+  c.x = stops[i][0] + (stops[i + 1][0] - stops[i][0]) * f;
+  c.y = stops[i][1] + (stops[i + 1][1] - stops[i][1]) * f;
+  c.z = stops[i][2] + (stops[i + 1][2] - stops[i][2]) * f;
+  return ppm_color_from_color(c);
+}
+
+PixelMap *cost_map_heatmap(const CostMap *map, CostChannel channel) {
+  size_t len = (size_t) map->width * map->height;
+  PixelMap *out = pixel_map_new(map->width, map->height);
+  uint32_t *values = malloc(sizeof(uint32_t) * len);
+  if (!out || !values) {
+    if (out)
+      pixel_map_destroy(out);
+    free(values);
+    return NULL;
+  }
+  for (size_t i = 0; i < len; i++)
+    values[i] = channel_value(&map->pixels[i], channel);
+  qsort(values, len, sizeof(uint32_t), compare_u32);
+  uint32_t scale = len ? values[len - 1 - len / 100] : 0;
+  free(values);
+
+  for (size_t i = 0; i < len; i++) {
+    uint32_t v = channel_value(&map->pixels[i], channel);
+    out->data[i] = cost_map_false_color(scale ? (float) v / scale : 0);
+  }
+  return out;
+}
+
+const char *cost_channel_name(CostChannel channel) {
+  return channel_names[channel];
+}
@@ -0,0 +1,75 @@
+#ifndef RAYTRACERPROJ__COST_MAP_H_
+#define RAYTRACERPROJ__COST_MAP_H_
+
+#include "ppm_file.h"
+#include "stats.h"
+
+// What a single pixel cost to render. Counts that don't fit stay at
+// UINT32_MAX, a pixel of a huge scene can take more than 4.29 s or 2^32 tests.
+typedef struct PixelCost {
+  uint32_t rays; // of any kind, see render_stats_rays
+  uint32_t tests; // ray-object intersection tests
+  uint32_t nodes; // light tree nodes visited
+  uint32_t nanoseconds; // wall time
+} PixelCost;
+
+// The quantities of a PixelCost that can be drawn as a heatmap
+typedef enum {
+  COST_RAYS,
+  COST_TESTS,
+  COST_NODES,
+  COST_TIME,
+  COST_CHANNELS
+} CostChannel;
+
+// Per pixel costs of a region of an image, filled in by renders that get it
+// through RenderOptions.cost_map. Regions rendered at the same time must not
+// overlap, as every pixel is written by the thread rendering it.
+typedef struct CostMap {
+  int x0, y0; // image coordinates of the first pixel
+  int width, height;
+  PixelCost *pixels; // width * height, row by row
+} CostMap;
+
+/**
+ * Creates a cost map of the pixels in [x0, x0 + width) x [y0, y0 + height)
+ * with all costs 0
+ *
+ * @return The new map (free with cost_map_destroy), or NULL if out of memory
+ */
+CostMap *cost_map_new(int x0, int y0, int width, int height);
+void cost_map_destroy(CostMap *map);
+
+/**
+ * @return The cost of pixel (x, y) of the image, NULL if the map doesn't cover it
+ */
+PixelCost *cost_map_at(CostMap *map, int x, int y);
+
+/**
+ * Sets the cost of pixel (x, y) to the difference of a context's counters
+ * after and before rendering it and the time it took
+ */
+void cost_map_record(CostMap *map, int x, int y, const RenderStats *before,
+                     const RenderStats *after, double seconds);
+
+/**
+ * Draws one channel of the map in false color, from black (cheapest) over
+ * blue, red and yellow to white. Colors are scaled to the 99th percentile so
+ * a few outliers don't wash out the rest.
+ *
+ * @return A map sized like the cost map (free with pixel_map_destroy), NULL
+ *          if out of memory
+ */
+PixelMap *cost_map_heatmap(const CostMap *map, CostChannel channel);
+
+/**
+ * @return The false color of cost_map_heatmap for t in [0, 1]
+ */
+PpmColor cost_map_false_color(float t);
+
+/**
+ * @return The name of a channel, for file names and reports
+ */
+const char *cost_channel_name(CostChannel channel);
+
+#endif //RAYTRACERPROJ__COST_MAP_H_
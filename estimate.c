@@ -0,0 +1,254 @@
+#include "estimate.h"
+#include "sampler.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+static const char *const quantile_names[ESTIMATE_QUANTILES] = {"median", "p90", "p99", "max"};
+
+// The sampled work of a tile, scaled up to all of its pixels once done
+typedef struct TileSample {
+  double work;
+  uint32_t sampled;
+} TileSample;
+
+// Samples that took more than this many times the median time per unit of
+// work were most likely interrupted and don't count towards the rate
+#define OUTLIER_RATIO 4
+
+static int blocks(int pixels, int step) {
+  return (pixels + step - 1) / step;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// What a pixel cost in units that take about the same time each
+static double pixel_work(const PixelCost *cost) {
+  return (double) cost->rays + cost->tests + cost->nodes;
+}
+
+// Seconds per unit of work of the samples. A single sample is too short to
+// time reliably, a preempted one would count as if a whole block of pixels
+// had been that slow, so they are timed together, without the outliers.
+static double seconds_per_work(const PixelCost *costs, size_t len) {
+  double *ratios = malloc(sizeof(double) * len);
+  if (!ratios || !len) {
+    free(ratios);
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++)
+    ratios[i] = costs[i].nanoseconds / MAX(pixel_work(&costs[i]), 1);
+  qsort(ratios, len, sizeof(double), compare_double);
+  double limit = OUTLIER_RATIO * ratios[len / 2], nanoseconds = 0, work = 0;
+  free(ratios);
+  for (size_t i = 0; i < len; i++) {
+    double w = MAX(pixel_work(&costs[i]), 1);
+    if (costs[i].nanoseconds / w > limit)
+      continue;
+    nanoseconds += costs[i].nanoseconds;
+    work += w;
+  }
+  return work > 0 ? nanoseconds * 1e-9 / work : 0;
+}
+
+// Fills in the quantiles of the field at offset of the sampled costs, nearest rank
+static void cost_quantiles(const PixelCost *costs, size_t len, size_t offset,
+                           uint32_t *values, PixelCost *quantiles) {
+  static const double ranks[ESTIMATE_QUANTILES] = {0.5, 0.9, 0.99, 1};
+  if (!len)
+    return;
+  for (size_t i = 0; i < len; i++)
+    values[i] = *(const uint32_t *) ((const char *) &costs[i] + offset);
+  qsort(values, len, sizeof(uint32_t), compare_u32);
+  for (int q = 0; q < ESTIMATE_QUANTILES; q++) {
+    size_t rank = (size_t) ceil(ranks[q] * len);
+    *(uint32_t *) ((char *) &quantiles[q] + offset) = values[rank > 0 ? rank - 1 : 0];
+  }
+}
+
+// Hands the tiles out in the order of tracer_render_views, round k being
+// tile k of every view that has one, to the thread that is free first
+static double schedule_tiles(size_t len, const size_t *first_tile, const double *tile_seconds,
+                             int threads) {
+  double *free_at = calloc(threads, sizeof(double));
+  if (!free_at)
+    return 0;
+  size_t rounds = 0;
+  for (size_t i = 0; i < len; i++)
+    rounds = MAX(rounds, first_tile[i + 1] - first_tile[i]);
+  for (size_t k = 0; k < rounds; k++) {
+    for (size_t i = 0; i < len; i++) {
+      if (k >= first_tile[i + 1] - first_tile[i])
+        continue;
+      int next = 0;
+      for (int t = 1; t < threads; t++)
+        if (free_at[t] < free_at[next])
+          next = t;
+      free_at[next] += tile_seconds[first_tile[i] + k];
+    }
+  }
+  double end = 0;
+  for (int t = 0; t < threads; t++)
+    end = MAX(end, free_at[t]);
+  free(free_at);
+  return end;
+}
+
+int tracer_estimate_views(Scene *scene, View *views, size_t len, const RenderOptions *opts,
+                          float fraction, int threads, RenderEstimate *out) {
+  if (!(fraction > 0 && fraction <= 1) || threads < 1)
+    return EINVAL;
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+  // Every pixel is recorded on its own, which wavefront tracing can't do
+  RenderOptions sample_opts = *opts;
+  sample_opts.wavefront = 0;
+  sample_opts.trace = NULL;
+  int step = MAX(1, (int) lroundf(1 / sqrtf(fraction)));
+
+  // Tiles of view i are first_tile[i] to first_tile[i + 1]
+  size_t *first_tile = malloc(sizeof(size_t) * (len + 1));
+  size_t samples = 0;
+  if (!first_tile)
+    return ENOMEM;
+  first_tile[0] = 0;
+  for (size_t i = 0; i < len; i++) {
+    int width = views[i].x1 - views[i].x0, height = views[i].y1 - views[i].y0;
+    first_tile[i + 1] = first_tile[i] + (size_t) blocks(width, VIEW_TILE) * blocks(height, VIEW_TILE);
+    samples += (size_t) blocks(width, step) * blocks(height, step);
+  }
+  TileSample *tiles = calloc(first_tile[len], sizeof(TileSample));
+  double *tile_seconds = malloc(sizeof(double) * first_tile[len]);
+  PixelCost *costs = malloc(sizeof(PixelCost) * samples);
+  uint32_t *values = malloc(sizeof(uint32_t) * samples);
+  CostMap *map = cost_map_new(0, 0, 1, 1);
+  int rc = 0;
+  if (!tiles || !tile_seconds || !costs || !values || !map) {
+    rc = ENOMEM;
+    goto done;
+  }
+
+  RenderEstimate estimate = {0};
+  estimate.threads = threads;
+  sample_opts.cost_map = map;
+  PpmColor color;
+  PixelMap pixel = {1, 1, &color};
+  size_t n = 0;
+  double work = 0, begin = stats_clock();
+  for (size_t i = 0; i < len; i++) {
+    View *view = &views[i];
+    int width = view->x1 - view->x0, height = view->y1 - view->y0;
+    int blocks_x = blocks(width, step), tiles_x = blocks(width, VIEW_TILE);
+    estimate.pixels += (uint64_t) width * height;
+    for (int by = 0; by < blocks(height, step); by++) {
+      for (int bx = 0; bx < blocks_x; bx++) {
+        // A random pixel of the block, which is cut off at the edges of the view
+        int x0 = view->x0 + bx * step, y0 = view->y0 + by * step;
+        int block_width = MIN(step, view->x1 - x0), block_height = MIN(step, view->y1 - y0);
+        uint32_t block = (uint32_t) by * blocks_x + bx;
+        int x = x0 + (int) (sampler_hash(opts->seed, (uint32_t) i, block, 0) % block_width);
+        int y = y0 + (int) (sampler_hash(opts->seed, (uint32_t) i, block, 1) % block_height);
+
+        map->x0 = x;
+        map->y0 = y;
+        tracer_render_region(scene, &view->camera, x, y, x + 1, y + 1, &pixel, &sample_opts, NULL);
+        PixelCost cost = map->pixels[0];
+        costs[n++] = cost;
+        // Each sample stands for the pixels of its block
+        uint64_t weight = (uint64_t) block_width * block_height;
+        estimate.rays += cost.rays * weight;
+        estimate.tests += cost.tests * weight;
+        estimate.light_nodes += cost.nodes * weight;
+        work += MAX(pixel_work(&cost), 1) * weight;
+        TileSample *tile = &tiles[first_tile[i] + (size_t) ((y - view->y0) / VIEW_TILE) * tiles_x +
+                                  (x - view->x0) / VIEW_TILE];
+        tile->work += MAX(pixel_work(&cost), 1);
+        tile->sampled++;
+      }
+    }
+  }
+  estimate.sampled = n;
+  estimate.sample_seconds = stats_clock() - begin;
+
+  double rate = seconds_per_work(costs, n);
+  estimate.cpu_seconds = work * rate;
+  // Tiles without a sample of their own, if blocks are larger than tiles,
+  // cost as much per pixel as the average
+  double pixel_seconds = estimate.pixels ? estimate.cpu_seconds / estimate.pixels : 0;
+  double tiles_seconds = 0;
+  for (size_t i = 0; i < len; i++) {
+    View *view = &views[i];
+    int tiles_x = blocks(view->x1 - view->x0, VIEW_TILE);
+    for (size_t t = first_tile[i]; t < first_tile[i + 1]; t++) {
+      int tx = (int) ((t - first_tile[i]) % tiles_x), ty = (int) ((t - first_tile[i]) / tiles_x);
+      int x0 = view->x0 + tx * VIEW_TILE, y0 = view->y0 + ty * VIEW_TILE;
+      int tile_pixels = (MIN(x0 + VIEW_TILE, view->x1) - x0) * (MIN(y0 + VIEW_TILE, view->y1) - y0);
+      double per_pixel =
+        tiles[t].sampled ? tiles[t].work * rate / tiles[t].sampled : pixel_seconds;
+      tile_seconds[t] = per_pixel * tile_pixels;
+      tiles_seconds += tile_seconds[t];
+    }
+  }
+  // Blocks straddle tiles, scaled so the tiles add up to the total again
+  for (size_t t = 0; t < first_tile[len]; t++) {
+    if (tiles_seconds > 0)
+      tile_seconds[t] *= estimate.cpu_seconds / tiles_seconds;
+    estimate.slowest_tile_seconds = MAX(estimate.slowest_tile_seconds, tile_seconds[t]);
+  }
+  estimate.wall_seconds = schedule_tiles(len, first_tile, tile_seconds, threads);
+
+  cost_quantiles(costs, n, offsetof(PixelCost, rays), values, estimate.quantiles);
+  cost_quantiles(costs, n, offsetof(PixelCost, tests), values, estimate.quantiles);
+  cost_quantiles(costs, n, offsetof(PixelCost, nodes), values, estimate.quantiles);
+  cost_quantiles(costs, n, offsetof(PixelCost, nanoseconds), values, estimate.quantiles);
+  *out = estimate;
+
+done:
+  cost_map_destroy(map);
+  free(values);
+  free(costs);
+  free(tile_seconds);
+  free(tiles);
+  free(first_tile);
+  return rc;
+}
+
+void render_estimate_print(FILE *out, const RenderEstimate *estimate) {
+  double pixels = estimate->pixels ? (double) estimate->pixels : 1;
+  fprintf(out, "Estimated from %" PRIu64 " of %" PRIu64 " pixels (%.2lf%%), traced in %.3lf s\n",
+          estimate->sampled, estimate->pixels, 100.0 * estimate->sampled / pixels,
+          estimate->sample_seconds);
+  fprintf(out, "Rays: %" PRIu64 " (%.1lf per pixel), intersection tests: %" PRIu64
+               ", light tree nodes visited: %" PRIu64 "\n",
+          estimate->rays, estimate->rays / pixels, estimate->tests, estimate->light_nodes);
+  fprintf(out, "Per pixel   ");
+  for (int q = 0; q < ESTIMATE_QUANTILES; q++)
+    fprintf(out, " %10s", quantile_names[q]);
+  fprintf(out, "\n  rays      ");
+  for (int q = 0; q < ESTIMATE_QUANTILES; q++)
+    fprintf(out, " %10" PRIu32, estimate->quantiles[q].rays);
+  fprintf(out, "\n  tests     ");
+  for (int q = 0; q < ESTIMATE_QUANTILES; q++)
+    fprintf(out, " %10" PRIu32, estimate->quantiles[q].tests);
+  fprintf(out, "\n  time (us) ");
+  for (int q = 0; q < ESTIMATE_QUANTILES; q++)
+    fprintf(out, " %10.2lf", estimate->quantiles[q].nanoseconds / 1e3);
+  fprintf(out, "\nRender time: %.3lf s on 1 thread, %.3lf s on %d thread%s "
+               "(slowest tile %.3lf s)\n",
+          estimate->cpu_seconds, estimate->wall_seconds, estimate->threads,
+          estimate->threads == 1 ? "" : "s", estimate->slowest_tile_seconds);
+}
@@ -0,0 +1,51 @@
+#ifndef RAYTRACERPROJ__ESTIMATE_H_
+#define RAYTRACERPROJ__ESTIMATE_H_
+
+#include "views.h"
+
+// Percentiles of the per pixel costs in a RenderEstimate
+typedef enum {
+  ESTIMATE_P50,
+  ESTIMATE_P90,
+  ESTIMATE_P99,
+  ESTIMATE_MAX,
+  ESTIMATE_QUANTILES
+} EstimateQuantile;
+
+// What rendering a set of views will cost, extrapolated from a sparse sample
+// of their pixels
+typedef struct RenderEstimate {
+  uint64_t pixels; // in all views
+  uint64_t sampled; // pixels traced for the estimate
+  double sample_seconds; // time spent tracing them
+  // Expected totals of the render
+  uint64_t rays, tests, light_nodes;
+  double cpu_seconds; // render time on one thread
+  // Render time on threads threads, with tiles handed out in the order of
+  // tracer_render_views to whichever thread is free first
+  int threads;
+  double wall_seconds;
+  double slowest_tile_seconds;
+  PixelCost quantiles[ESTIMATE_QUANTILES]; // of the sampled pixels, each field on its own
+} RenderEstimate;
+
+/**
+ * Estimates the cost of tracer_render_views(scene, views, len, opts, threads)
+ * by rendering about fraction of the pixels of every view, one per square
+ * block of 1 / fraction pixels at a random position in it, on the calling
+ * thread. The pixels are traced exactly as in the full render, without
+ * wavefront tracing, and assumed to cost as much on every thread.
+ *
+ * @param fraction Part of the pixels to trace, in (0, 1]
+ * @return 0 if successful, EINVAL if fraction or threads is out of range,
+ *          ENOMEM if out of memory
+ */
+int tracer_estimate_views(Scene *scene, View *views, size_t len, const RenderOptions *opts,
+                          float fraction, int threads, RenderEstimate *out);
+
+/**
+ * Writes a human readable report of estimate to out
+ */
+void render_estimate_print(FILE *out, const RenderEstimate *estimate);
+
+#endif //RAYTRACERPROJ__ESTIMATE_H_
@@ -0,0 +1,360 @@
+#include "gbuffer.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GBUFFER_MAGIC 0x3242474du // "MGB2"
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Hash of everything that decides where the primary rays hit
+static uint32_t geometry_hash(Scene *scene, Camera *camera) {
+  uint32_t h = 2166136261u;
+  h = hash_bytes(h, &camera->eye_pos, sizeof(Vec3));
+  h = hash_bytes(h, &camera->vw_ul, sizeof(Vec3));
+  h = hash_bytes(h, &camera->vw_ur, sizeof(Vec3));
+  h = hash_bytes(h, &camera->vw_ll, sizeof(Vec3));
+  h = hash_bytes(h, &camera->window_pixel_width, sizeof(int));
+  h = hash_bytes(h, &camera->window_pixel_height, sizeof(int));
+  h = hash_bytes(h, &scene->palette_len, sizeof(size_t));
+  h = hash_bytes(h, &scene->objects_len, sizeof(size_t));
+  for (size_t i = 0; i < scene->objects_len; i++) {
+    Object *obj = &scene->objects[i];
+    h = hash_bytes(h, &obj->type, sizeof(obj->type));
+    switch (obj->type) {
+    case OBJECT_SPHERE:
+      h = hash_bytes(h, &obj->sphere.center, sizeof(Vec3));
+      h = hash_bytes(h, &obj->sphere.radius, sizeof(float));
+      break;
+    case OBJECT_CYLINDER:
+      h = hash_bytes(h, &obj->cyl.center, sizeof(Vec3));
+      h = hash_bytes(h, &obj->cyl.dir, sizeof(Vec3));
+      h = hash_bytes(h, &obj->cyl.radius, sizeof(float));
+      h = hash_bytes(h, &obj->cyl.height, sizeof(float));
+      break;
+    case OBJECT_TRIANGLE:
+      h = hash_bytes(h, obj->tri.p, sizeof(obj->tri.p));
+      h = hash_bytes(h, obj->tri.n, sizeof(obj->tri.n));
+      h = hash_bytes(h, obj->tri.t, sizeof(obj->tri.t));
+      break;
+    }
+  }
+  h = hash_bytes(h, scene->vertices, sizeof(Vec3) * scene->vert_len);
+  h = hash_bytes(h, scene->normals, sizeof(Vec3) * scene->norm_len);
+  h = hash_bytes(h, scene->texs, sizeof(Vec2) * scene->texs_len);
+  return h;
+}
+
+// The material obj is drawn with, as the scene assigns it now
+static Material *object_material(Object *obj) {
+  switch (obj->type) {
+  case OBJECT_SPHERE:
+    return obj->sphere.color;
+  case OBJECT_CYLINDER:
+    return obj->cyl.color;
+  default:
+    return obj->tri.mat;
+  }
+}
+
+static void record_hit(GBufferSample *sample, Scene *scene, Intersection *in) {
+  memset(sample, 0, sizeof(GBufferSample));
+  sample->obj = -1;
+  if (in->t == INFINITY)
+    return;
+  sample->pos = in->pos;
+  sample->norm = in->norm;
+  sample->t = in->t;
+  sample->obj = (int) (in->obj - scene->objects);
+  sample->has_tex_coords = in->has_tex_coords;
+  sample->tex_coords = in->tex_coords;
+}
+
+// Records the shadow factor of every light reaching in; lights out of reach
+// are never shaded and get 0
+static void record_visibility(TraceContext *ctx, Intersection *in, uint8_t *vis) {
+  Scene *scene = ctx->scene;
+  memset(vis, 0, scene->lights_len);
+  LightIter it;
+  light_tree_begin(&scene->light_tree, scene->lights, in->pos, &it);
+  for (int i; (i = light_tree_next(&it)) >= 0;)
+    vis[i] = (uint8_t) lroundf(scene_shadow_factor(ctx, &scene->lights[i], in) * 255);
+}
+
+// Shades a primary hit with the shadow factors in vis, recording them first
+// unless they are already known. Without vis, shadows are traced as usual.
+static Color shade_hit(TraceContext *ctx, Ray *ray, Intersection *in,
+                       uint8_t *vis, int recorded) {
+  if (!vis)
+    return scene_shade_ray(ctx, ray, in);
+  if (!recorded) {
+    // Secondary hits see the same samples whether or not shadows were recorded
+    Sampler sampler = ctx->sampler;
+    record_visibility(ctx, in, vis);
+    ctx->sampler = sampler;
+  }
+
+  float factors[GBUFFER_MAX_LIGHTS];
+  for (size_t i = 0; i < ctx->scene->lights_len; i++)
+    factors[i] = vis[i] / 255.0f;
+  return scene_shade_ray_visibility(ctx, ray, in, factors);
+}
+
+GBuffer *gbuffer_capture(Scene *scene, Camera *camera, const RenderOptions *opts,
+                         PixelMap *out) {
+  GBuffer *gb = calloc(1, sizeof(GBuffer));
+  if (!gb)
+    return NULL;
+  int width = scene->pixel_width, height = scene->pixel_height;
+  size_t pixels = (size_t) width * height;
+  gb->width = width;
+  gb->height = height;
+  gb->geometry_hash = geometry_hash(scene, camera);
+  gb->lights_len = scene->lights_len;
+  gb->lights = malloc(sizeof(Light) * (scene->lights_len ? scene->lights_len : 1));
+  gb->samples = malloc(sizeof(GBufferSample) * pixels);
+  if (scene->lights_len <= GBUFFER_MAX_LIGHTS)
+    gb->visibility = malloc(scene->lights_len * pixels + 1);
+  if (!gb->lights || !gb->samples ||
+      (scene->lights_len <= GBUFFER_MAX_LIGHTS && !gb->visibility)) {
+    gbuffer_destroy(gb);
+    return NULL;
+  }
+  if (scene->lights_len)
+    memcpy(gb->lights, scene->lights, sizeof(Light) * scene->lights_len);
+
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+  TraceContext ctx;
+  tracer_context_init(&ctx, scene, camera, opts);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      size_t pixel = (size_t) y * width + x;
+      tracer_seed_sample(&ctx, x, y, 0);
+      Ray ray = camera_trace_ray(camera, x, y);
+      Intersection in = scene_find_best_inter(scene, &ray);
+
+      record_hit(&gb->samples[pixel], scene, &in);
+      Color c = scene->bg_color;
+      if (in.t != INFINITY) {
+        uint8_t *vis = gb->visibility ? &gb->visibility[pixel * gb->lights_len] : NULL;
+        c = shade_hit(&ctx, &ray, &in, vis, 0);
+      } else if (gb->visibility) {
+        memset(&gb->visibility[pixel * gb->lights_len], 0, gb->lights_len);
+      }
+      if (out)
+        pixel_map_put(out, x, y, ppm_color_from_color(c));
+    }
+  }
+  return gb;
+}
+
+GBuffer *gbuffer_capture_hits(Scene *scene, Camera *camera) {
+  GBuffer *gb = calloc(1, sizeof(GBuffer));
+  if (!gb)
+    return NULL;
+  gb->width = scene->pixel_width;
+  gb->height = scene->pixel_height;
+  gb->samples = malloc(sizeof(GBufferSample) * gb->width * gb->height);
+  if (!gb->samples) {
+    gbuffer_destroy(gb);
+    return NULL;
+  }
+  if (gbuffer_update_hits(gb, scene, camera, 0, 0, gb->width, gb->height) != 0) {
+    gbuffer_destroy(gb);
+    return NULL;
+  }
+  return gb;
+}
+
+int gbuffer_update_hits(GBuffer *gb, Scene *scene, Camera *camera, int x0, int y0,
+                        int x1, int y1) {
+  if (gb->visibility || gb->width != scene->pixel_width ||
+      gb->height != scene->pixel_height)
+    return EINVAL;
+  Light *lights = realloc(gb->lights, sizeof(Light) * (scene->lights_len ? scene->lights_len : 1));
+  if (!lights)
+    return ENOMEM;
+  gb->lights = lights;
+  gb->lights_len = scene->lights_len;
+  if (scene->lights_len)
+    memcpy(gb->lights, scene->lights, sizeof(Light) * scene->lights_len);
+  gb->geometry_hash = geometry_hash(scene, camera);
+
+  for (int y = MAX(y0, 0); y < MIN(y1, gb->height); y++) {
+    for (int x = MAX(x0, 0); x < MIN(x1, gb->width); x++) {
+      Ray ray = camera_trace_ray(camera, x, y);
+      Intersection in = scene_find_best_inter(scene, &ray);
+      record_hit(&gb->samples[(size_t) y * gb->width + x], scene, &in);
+    }
+  }
+  return 0;
+}
+
+int gbuffer_hit(const GBuffer *gb, Scene *scene, int x, int y, Intersection *out) {
+  const GBufferSample *sample = &gb->samples[(size_t) y * gb->width + x];
+  Intersection in = {0};
+  in.t = INFINITY;
+  if (sample->obj >= 0) {
+    in.pos = sample->pos;
+    in.norm = sample->norm;
+    in.t = sample->t;
+    in.obj = &scene->objects[sample->obj];
+    in.mat = object_material(in.obj);
+    in.has_tex_coords = sample->has_tex_coords;
+    in.tex_coords = sample->tex_coords;
+    in.throughput = 1;
+  }
+  *out = in;
+  return sample->obj >= 0;
+}
+
+// Recorded shadow factors stay valid as long as no light moved, changed
+// shape or reaches further than it did (lights out of reach weren't recorded)
+static int can_reuse_shadows(const GBuffer *gb, Scene *scene) {
+  if (!gb->visibility || gb->lights_len != scene->lights_len)
+    return 0;
+  for (size_t i = 0; i < gb->lights_len; i++) {
+    const Light *was = &gb->lights[i];
+    const Light *is = &scene->lights[i];
+    if (was->pos.x != is->pos.x || was->pos.y != is->pos.y ||
+        was->pos.z != is->pos.z || was->w != is->w ||
+        was->radius != is->radius || was->samples != is->samples ||
+        is->reach > was->reach)
+      return 0;
+  }
+  return 1;
+}
+
+int gbuffer_relight(const GBuffer *gb, Scene *scene, Camera *camera,
+                    const RenderOptions *opts, PixelMap *out, int *reused_shadows) {
+  if (out->width != gb->width || out->height != gb->height ||
+      gb->width != scene->pixel_width || gb->height != scene->pixel_height ||
+      gb->geometry_hash != geometry_hash(scene, camera))
+    return EINVAL;
+
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+  int reuse = can_reuse_shadows(gb, scene);
+  if (reused_shadows)
+    *reused_shadows = reuse;
+
+  uint8_t scratch[GBUFFER_MAX_LIGHTS];
+  TraceContext ctx;
+  tracer_context_init(&ctx, scene, camera, opts);
+  for (int y = 0; y < gb->height; y++) {
+    for (int x = 0; x < gb->width; x++) {
+      size_t pixel = (size_t) y * gb->width + x;
+      Intersection in;
+      if (!gbuffer_hit(gb, scene, x, y, &in)) {
+        pixel_map_put(out, x, y, ppm_color_from_color(scene->bg_color));
+        continue;
+      }
+
+      tracer_seed_sample(&ctx, x, y, 0);
+      Ray ray = camera_trace_ray(camera, x, y);
+      uint8_t *vis = NULL;
+      if (reuse)
+        vis = &gb->visibility[pixel * gb->lights_len];
+      else if (scene->lights_len <= GBUFFER_MAX_LIGHTS)
+        vis = scratch;
+      Color c = shade_hit(&ctx, &ray, &in, vis, reuse);
+      pixel_map_put(out, x, y, ppm_color_from_color(c));
+    }
+  }
+  return 0;
+}
+
+int gbuffer_write(const GBuffer *gb, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return errno;
+
+  uint32_t magic = GBUFFER_MAGIC;
+  uint64_t lights_len = gb->lights_len;
+  int32_t has_visibility = gb->visibility != NULL && gb->lights_len > 0;
+  size_t pixels = (size_t) gb->width * gb->height;
+  int ok = fwrite(&magic, sizeof(magic), 1, f) == 1 &&
+           fwrite(&gb->width, sizeof(int), 1, f) == 1 &&
+           fwrite(&gb->height, sizeof(int), 1, f) == 1 &&
+           fwrite(&gb->geometry_hash, sizeof(uint32_t), 1, f) == 1 &&
+           fwrite(&lights_len, sizeof(lights_len), 1, f) == 1 &&
+           fwrite(&has_visibility, sizeof(has_visibility), 1, f) == 1 &&
+           fwrite(gb->lights, sizeof(Light), gb->lights_len, f) == gb->lights_len &&
+           fwrite(gb->samples, sizeof(GBufferSample), pixels, f) == pixels &&
+           (!has_visibility ||
+            fwrite(gb->visibility, gb->lights_len, pixels, f) == pixels);
+  int rc = ok ? 0 : errno ? errno : EIO;
+  if (fclose(f) != 0 && rc == 0)
+    rc = errno;
+  return rc;
+}
+
+GBuffer *gbuffer_read(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "failed to read G-buffer %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  GBuffer *gb = calloc(1, sizeof(GBuffer));
+  uint32_t magic = 0;
+  uint64_t lights_len = 0;
+  int32_t has_visibility = 0;
+  int ok = gb && fread(&magic, sizeof(magic), 1, f) == 1 &&
+           magic == GBUFFER_MAGIC &&
+           fread(&gb->width, sizeof(int), 1, f) == 1 &&
+           fread(&gb->height, sizeof(int), 1, f) == 1 &&
+           fread(&gb->geometry_hash, sizeof(uint32_t), 1, f) == 1 &&
+           fread(&lights_len, sizeof(lights_len), 1, f) == 1 &&
+           fread(&has_visibility, sizeof(has_visibility), 1, f) == 1 &&
+           gb->width > 0 && gb->height > 0 &&
+           (!has_visibility || (lights_len > 0 && lights_len <= GBUFFER_MAX_LIGHTS));
+
+  size_t pixels = ok ? (size_t) gb->width * gb->height : 0;
+  if (ok) {
+    gb->lights_len = lights_len;
+    gb->lights = malloc(sizeof(Light) * (lights_len ? lights_len : 1));
+    gb->samples = malloc(sizeof(GBufferSample) * pixels);
+    if (has_visibility)
+      gb->visibility = malloc(lights_len * pixels + 1);
+    ok = gb->lights && gb->samples && (!has_visibility || gb->visibility) &&
+         fread(gb->lights, sizeof(Light), lights_len, f) == lights_len &&
+         fread(gb->samples, sizeof(GBufferSample), pixels, f) == pixels &&
+         (!has_visibility ||
+          fread(gb->visibility, lights_len, pixels, f) == pixels);
+  }
+  fclose(f);
+
+  if (!ok) {
+    fprintf(stderr, "failed to read G-buffer %s: invalid or truncated file\n", path);
+    gbuffer_destroy(gb);
+    return NULL;
+  }
+  return gb;
+}
+
+void gbuffer_destroy(GBuffer *gb) {
+  if (!gb)
+    return;
+  free(gb->lights);
+  free(gb->samples);
+  free(gb->visibility);
+  free(gb);
+}
@@ -0,0 +1,98 @@
+#ifndef RAYTRACERPROJ__GBUFFER_H_
+#define RAYTRACERPROJ__GBUFFER_H_
+
+#include "tracer.h"
+
+// Shadow factors are only kept for scenes with up to this many lights
+#define GBUFFER_MAX_LIGHTS 64
+
+// The primary hit of one pixel
+typedef struct GBufferSample {
+  Vec3 pos;
+  Vec3 norm;
+  float t;
+  int obj; // index into scene->objects, -1 if the pixel shows the background
+  int has_tex_coords;
+  Vec2 tex_coords;
+} GBufferSample;
+
+// Everything about a frame's primary hits that doesn't depend on materials or
+// lights, so it can be shaded again after those changed (relighting). Only
+// valid for the camera and geometry it was captured from.
+typedef struct GBuffer {
+  int width, height;
+  uint32_t geometry_hash; // of the camera and geometry at capture time
+  size_t lights_len;
+  Light *lights; // the lights at capture time
+  uint8_t *visibility; // lights_len shadow factors (0-255) per pixel, NULL if there were too many lights
+  GBufferSample *samples; // width * height, row by row
+} GBuffer;
+
+/**
+ * Traces one primary ray through the center of every pixel, records its hit
+ * and the shadow factor of every light reaching it, and shades the hit into
+ * out (if not NULL) like tracer_render_region would without anti-aliasing.
+ *
+ * @return The new G-buffer (free with gbuffer_destroy), or NULL if out of memory
+ */
+GBuffer *gbuffer_capture(Scene *scene, Camera *camera, const RenderOptions *opts,
+                         PixelMap *out);
+
+/**
+ * Traces one primary ray through the center of every pixel and records its
+ * hit, without shading it or recording shadows (visibility is NULL)
+ *
+ * @return The new G-buffer (free with gbuffer_destroy), or NULL if out of memory
+ */
+GBuffer *gbuffer_capture_hits(Scene *scene, Camera *camera);
+
+/**
+ * Records the primary hits of the pixels in [x0, x1) x [y0, y1) of a G-buffer
+ * without shadows again, for scene as it is now. Once every region a scene
+ * edit changed is updated, gb is a capture of the edited scene.
+ *
+ * @return 0 if successful, EINVAL if gb has shadows or is not sized like the
+ *          scene's image, ENOMEM if out of memory
+ */
+int gbuffer_update_hits(GBuffer *gb, Scene *scene, Camera *camera, int x0, int y0,
+                        int x1, int y1);
+
+/**
+ * Sets out to the recorded primary hit of pixel (x, y), with its object and
+ * the material the object has now taken from scene
+ *
+ * @return 1 if the pixel hit something, 0 if it shows the background
+ */
+int gbuffer_hit(const GBuffer *gb, Scene *scene, int x, int y, Intersection *out);
+
+/**
+ * Shades the hits of gb with the scene's current materials and lights into
+ * out, which must be image sized. Shadow rays are only traced again if a
+ * light moved, was added or removed or got brighter since the capture;
+ * material and depth cueing edits reuse the recorded shadow factors.
+ * Reflections and refractions are always traced.
+ *
+ * @param reused_shadows If not NULL, set to 1 if the recorded shadows were used
+ * @return 0 if successful, EINVAL if out has the wrong size or the camera or
+ *          geometry of scene differ from the captured ones
+ */
+int gbuffer_relight(const GBuffer *gb, Scene *scene, Camera *camera,
+                    const RenderOptions *opts, PixelMap *out, int *reused_shadows);
+
+/**
+ * Saves gb to path in a machine specific binary format
+ *
+ * @return 0 if successful, errno otherwise
+ */
+int gbuffer_write(const GBuffer *gb, const char *path);
+
+/**
+ * Loads a G-buffer saved by gbuffer_write
+ *
+ * @return The G-buffer, or NULL if it could not be read. Errors are reported
+ *          on stderr.
+ */
+GBuffer *gbuffer_read(const char *path);
+void gbuffer_destroy(GBuffer *gb);
+
+#endif //RAYTRACERPROJ__GBUFFER_H_
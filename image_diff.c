@@ -0,0 +1,64 @@
+#include "image_diff.h"
+#include "cost_map.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+int image_diff(const PixelMap *reference, const PixelMap *image, ImageDiff *out,
+               PixelMap **heatmap) {
+  if (reference->width != image->width || reference->height != image->height)
+    return EINVAL;
+  ImageDiff diff = {0};
+  diff.pixels = (long) image->width * image->height;
+  // Largest channel difference of every pixel, drawn once max_error is known
+  uint8_t *errors = NULL;
+  if (heatmap && !(errors = malloc(diff.pixels)))
+    return ENOMEM;
+
+  double sum = 0;
+  for (long i = 0; i < diff.pixels; i++) {
+    PpmColor a = reference->data[i], b = image->data[i];
+    int d[3] = {abs(a.r - b.r), abs(a.g - b.g), abs(a.b - b.b)};
+    int worst = MAX(d[0], MAX(d[1], d[2]));
+    sum += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    if (worst)
+      diff.differing++;
+    if (worst > diff.max_error) {
+      diff.max_error = worst;
+      diff.max_x = (int) (i % image->width);
+      diff.max_y = (int) (i / image->width);
+    }
+    if (errors)
+      errors[i] = (uint8_t) worst;
+  }
+  diff.rmse = diff.pixels ? sqrt(sum / (3.0 * diff.pixels)) : 0;
+  diff.psnr = diff.rmse > 0 ? 20 * log10(255 / diff.rmse) : INFINITY;
+
+  if (heatmap) {
+    *heatmap = pixel_map_new(image->width, image->height);
+    if (!*heatmap) {
+      free(errors);
+      return ENOMEM;
+    }
+    for (long i = 0; i < diff.pixels; i++)
+      (*heatmap)->data[i] =
+        cost_map_false_color(diff.max_error ? (float) errors[i] / diff.max_error : 0);
+    free(errors);
+  }
+  *out = diff;
+  return 0;
+}
+
+void image_diff_print(FILE *out, const ImageDiff *diff) {
+  fprintf(out, "RMSE %.3lf, PSNR ", diff->rmse);
+  if (isinf(diff->psnr))
+    fprintf(out, "inf");
+  else
+    fprintf(out, "%.1lf dB", diff->psnr);
+  fprintf(out, ", max error %d", diff->max_error);
+  if (diff->max_error)
+    fprintf(out, " at (%d, %d)", diff->max_x, diff->max_y);
+  fprintf(out, ", %ld of %ld pixels differ (%.2lf%%)\n", diff->differing, diff->pixels,
+          diff->pixels ? 100.0 * diff->differing / diff->pixels : 0);
+}
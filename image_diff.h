@@ -0,0 +1,33 @@
+#ifndef RAYTRACERPROJ__IMAGE_DIFF_H_
+#define RAYTRACERPROJ__IMAGE_DIFF_H_
+
+#include "ppm_file.h"
+#include <stdio.h>
+
+// How much two images of the same size differ, in 8 bit channel steps
+typedef struct ImageDiff {
+  double rmse; // root mean square error over all channels of all pixels
+  double psnr; // peak signal to noise ratio in dB, INFINITY if the images are equal
+  int max_error; // largest difference of a single channel
+  int max_x, max_y; // a pixel with that difference
+  long differing; // pixels with any channel different
+  long pixels;
+} ImageDiff;
+
+/**
+ * Compares two images channel by channel
+ *
+ * @param heatmap If not NULL, set to a false color image of the largest
+ *                channel difference of every pixel, black where they are
+ *                equal and white at max_error (free with pixel_map_destroy)
+ * @return 0 if successful, EINVAL if the images differ in size, ENOMEM
+ */
+int image_diff(const PixelMap *reference, const PixelMap *image, ImageDiff *out,
+               PixelMap **heatmap);
+
+/**
+ * Prints the differences on one line, e.g. "RMSE 0.412, PSNR 55.8 dB, ..."
+ */
+void image_diff_print(FILE *out, const ImageDiff *diff);
+
+#endif //RAYTRACERPROJ__IMAGE_DIFF_H_
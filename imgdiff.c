@@ -0,0 +1,80 @@
+// masptracer-imgdiff: compares two renders of the same scene, e.g. one with
+// an approximation turned on against one without, and reports how much they
+// differ. Fails if they differ by more than the given limits.
+
+#include "image_diff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print_usage(const char *program_name) {
+  fprintf(stderr,
+          "usage: %s reference.ppm image.ppm [--heatmap out.ppm] [--max-rmse r]\n"
+          "          [--min-psnr db]\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *files[2] = {NULL, NULL};
+  const char *heatmap_file_name = NULL;
+  double max_rmse = -1, min_psnr = -1;
+  int len = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--heatmap") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      heatmap_file_name = argv[i];
+    } else if (strcmp(argv[i], "--max-rmse") == 0) {
+      if (++i >= argc || (max_rmse = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--min-psnr") == 0) {
+      if (++i >= argc || (min_psnr = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (argv[i][0] == '-' || len == 2) {
+      print_usage(argv[0]);
+    } else {
+      files[len++] = argv[i];
+    }
+  }
+  if (len != 2)
+    print_usage(argv[0]);
+
+  PixelMap *images[2];
+  for (int i = 0; i < 2; i++) {
+    int rc = pixel_map_read_from_file(files[i], &images[i]);
+    if (rc != 0) {
+      fprintf(stderr, "failed to read %s: %s\n", files[i], strerror(rc));
+      return EXIT_FAILURE;
+    }
+  }
+  ImageDiff diff;
+  PixelMap *heatmap = NULL;
+  if (image_diff(images[0], images[1], &diff, heatmap_file_name ? &heatmap : NULL) != 0) {
+    fprintf(stderr, "the images differ in size, %dx%d and %dx%d\n", images[0]->width,
+            images[0]->height, images[1]->width, images[1]->height);
+    return EXIT_FAILURE;
+  }
+  image_diff_print(stdout, &diff);
+  if (heatmap) {
+    int rc = pixel_map_write_to_ppm(heatmap, heatmap_file_name);
+    if (rc != 0) {
+      fprintf(stderr, "failed to write heatmap to %s: %s\n", heatmap_file_name, strerror(rc));
+      return EXIT_FAILURE;
+    }
+    pixel_map_destroy(heatmap);
+  }
+  pixel_map_destroy(images[0]);
+  pixel_map_destroy(images[1]);
+
+  int failed = 0;
+  if (max_rmse >= 0 && diff.rmse > max_rmse) {
+    printf("RMSE is above %.3lf\n", max_rmse);
+    failed = 1;
+  }
+  if (min_psnr >= 0 && diff.psnr < min_psnr) {
+    printf("PSNR is below %.1lf dB\n", min_psnr);
+    failed = 1;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
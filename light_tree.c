@@ -0,0 +1,199 @@
+#include "light_tree.h"
+#include "scene.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+float light_reach(const Light *light) {
+  Vec3 att = light->att;
+  if (!light->w || !light->is_attenuated || veclen2(att) <= 0)
+    return INFINITY;
+  if (att.x < 0 || att.y < 0 || att.z < 0)
+    return INFINITY;
+
+  float brightest = MAX(light->color.x, MAX(light->color.y, light->color.z));
+  if (brightest <= 0)
+    return 0;
+
+  // Solve att.x + att.y * d + att.z * d^2 = brightest / LIGHT_CUTOFF for d
+  float k = brightest / LIGHT_CUTOFF;
+  if (att.x >= k)
+    return 0;
+  if (att.z > 0)
+    return (-att.y + sqrt(att.y * att.y - 4 * att.z * (att.x - k))) / (2 * att.z);
+  if (att.y > 0)
+    return (k - att.x) / att.y;
+  return INFINITY;
+}
+
+static float axis(Vec3 v, int a) {
+  return a == 0 ? v.x : a == 1 ? v.y : v.z;
+}
+
+// Partially sorts order so the light at nth has the median position along
+// axis a, with smaller positions before it and larger ones after it
+static void select_nth(int *order, int len, int nth, const Light *lights, int a) {
+  int lo = 0, hi = len - 1;
+  while (lo < hi) {
+    float pivot = axis(lights[order[(lo + hi) / 2]].pos, a);
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (axis(lights[order[i]].pos, a) < pivot)
+        i++;
+      while (axis(lights[order[j]].pos, a) > pivot)
+        j--;
+      if (i <= j) {
+        int tmp = order[i];
+        order[i++] = order[j];
+        order[j--] = tmp;
+      }
+    }
+    if (nth <= j)
+      hi = j;
+    else if (nth >= i)
+      lo = i;
+    else
+      break;
+  }
+}
+
+static int build_node(LightTree *tree, const Light *lights, int first, int count) {
+  int index = (int) tree->nodes_len++;
+  LightNode *node = &tree->nodes[index];
+
+  Vec3 cmin = {INFINITY, INFINITY, INFINITY};
+  Vec3 cmax = {-INFINITY, -INFINITY, -INFINITY};
+  node->min = cmin;
+  node->max = cmax;
+  for (int i = first; i < first + count; i++) {
+    const Light *l = &lights[tree->order[i]];
+    node->min.x = MIN(node->min.x, l->pos.x - l->reach);
+    node->min.y = MIN(node->min.y, l->pos.y - l->reach);
+    node->min.z = MIN(node->min.z, l->pos.z - l->reach);
+    node->max.x = MAX(node->max.x, l->pos.x + l->reach);
+    node->max.y = MAX(node->max.y, l->pos.y + l->reach);
+    node->max.z = MAX(node->max.z, l->pos.z + l->reach);
+    cmin.x = MIN(cmin.x, l->pos.x);
+    cmin.y = MIN(cmin.y, l->pos.y);
+    cmin.z = MIN(cmin.z, l->pos.z);
+    cmax.x = MAX(cmax.x, l->pos.x);
+    cmax.y = MAX(cmax.y, l->pos.y);
+    cmax.z = MAX(cmax.z, l->pos.z);
+  }
+
+  if (count <= LIGHT_TREE_LEAF) {
+    node->first = first;
+    node->count = count;
+    return index;
+  }
+
+  // Split at the median light along the axis the positions spread most on
+  Vec3 extent = vecsub(cmax, cmin);
+  int a = extent.x >= extent.y && extent.x >= extent.z ? 0
+          : extent.y >= extent.z ? 1 : 2;
+  int mid = count / 2;
+  select_nth(tree->order + first, count, mid, lights, a);
+
+  node->count = 0;
+  build_node(tree, lights, first, mid);
+  int right = build_node(tree, lights, first + mid, count - mid);
+  tree->nodes[index].first = right;
+  return index;
+}
+
+int light_tree_build(LightTree *tree, const Light *lights, size_t len) {
+  LightTree new_tree = {0};
+  size_t bounded = 0;
+  for (size_t i = 0; i < len; i++)
+    if (isfinite(lights[i].reach))
+      bounded++;
+
+  if (len > 0) {
+    new_tree.order = malloc(sizeof(int) * len);
+    new_tree.unbounded = malloc(sizeof(int) * len);
+    new_tree.nodes = malloc(sizeof(LightNode) * 2 * len);
+    if (!new_tree.order || !new_tree.unbounded || !new_tree.nodes) {
+      light_tree_destroy(&new_tree);
+      return ENOMEM;
+    }
+  }
+
+  size_t order_len = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (isfinite(lights[i].reach))
+      new_tree.order[order_len++] = (int) i;
+    else
+      new_tree.unbounded[new_tree.unbounded_len++] = (int) i;
+  }
+  if (bounded > 0)
+    build_node(&new_tree, lights, 0, (int) bounded);
+
+  *tree = new_tree;
+  return 0;
+}
+
+void light_tree_destroy(LightTree *tree) {
+  free(tree->nodes);
+  free(tree->order);
+  free(tree->unbounded);
+  tree->nodes = NULL;
+  tree->order = NULL;
+  tree->unbounded = NULL;
+  tree->nodes_len = 0;
+  tree->unbounded_len = 0;
+}
+
+void light_tree_begin(const LightTree *tree, const Light *lights, Vec3 pos,
+                      LightIter *it) {
+  it->tree = tree;
+  it->lights = lights;
+  it->pos = pos;
+  it->next_unbounded = 0;
+  it->leaf_next = it->leaf_end = 0;
+  it->sp = 0;
+  it->visited = 0;
+  if (tree->nodes_len > 0)
+    it->stack[it->sp++] = 0;
+}
+
+static int node_contains(const LightNode *node, Vec3 p) {
+  return p.x >= node->min.x && p.x <= node->max.x &&
+         p.y >= node->min.y && p.y <= node->max.y &&
+         p.z >= node->min.z && p.z <= node->max.z;
+}
+
+// Counts the visit and returns whether the node contains the iterator's point
+static int visit_node(LightIter *it, const LightNode *node) {
+  it->visited++;
+  return node_contains(node, it->pos);
+}
+
+int light_tree_next(LightIter *it) {
+  const LightTree *tree = it->tree;
+  if (it->next_unbounded < tree->unbounded_len)
+    return tree->unbounded[it->next_unbounded++];
+
+  for (;;) {
+    while (it->leaf_next < it->leaf_end) {
+      int i = tree->order[it->leaf_next++];
+      const Light *l = &it->lights[i];
+      if (dist2(l->pos, it->pos) <= l->reach * l->reach)
+        return i;
+    }
+    if (it->sp == 0)
+      return -1;
+
+    // Descend to the next leaf containing pos, leaving right children for later
+    const LightNode *node = &tree->nodes[it->stack[--it->sp]];
+    while (visit_node(it, node)) {
+      if (node->count > 0) {
+        it->leaf_next = node->first;
+        it->leaf_end = node->first + node->count;
+        break;
+      }
+      it->stack[it->sp++] = node->first;
+      node++;
+    }
+  }
+}
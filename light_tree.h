@@ -0,0 +1,73 @@
+#ifndef RAYTRACERPROJ__LIGHT_TREE_H_
+#define RAYTRACERPROJ__LIGHT_TREE_H_
+
+#include "vec.h"
+#include <stddef.h>
+
+struct Light;
+
+// Attenuated lights are treated as dark past the distance where they can add
+// less than this to a color channel (a quarter of an 8 bit step)
+#define LIGHT_CUTOFF (1.0f / 1024)
+
+// Lights per leaf, and the deepest tree an iterator can walk
+#define LIGHT_TREE_LEAF 4
+#define LIGHT_TREE_STACK 64
+
+typedef struct LightNode {
+  Vec3 min, max; // bounds of the spheres of influence of the node's lights
+  int first; // leaf: first index into order, inner node: the right child
+  int count; // leaf: number of lights, inner node: 0 (left child follows)
+} LightNode;
+
+// Bounding volume hierarchy over the spheres of influence of the scene's
+// lights. Lights with an infinite reach (directional and unattenuated lights)
+// are kept in a separate list that every query returns.
+typedef struct LightTree {
+  LightNode *nodes;
+  size_t nodes_len;
+  int *order; // indices of the bounded lights, grouped by leaf
+  int *unbounded; // indices of the lights every point can see
+  size_t unbounded_len;
+} LightTree;
+
+typedef struct LightIter {
+  const LightTree *tree;
+  const struct Light *lights;
+  Vec3 pos;
+  size_t next_unbounded;
+  int leaf_next, leaf_end;
+  int stack[LIGHT_TREE_STACK];
+  int sp;
+  size_t visited; // nodes tested against pos so far
+} LightIter;
+
+/**
+ * Returns the distance beyond which light contributes less than LIGHT_CUTOFF,
+ * INFINITY if it never gets that dark
+ */
+float light_reach(const struct Light *light);
+
+/**
+ * Builds the tree over lights, whose reach must already be set. The lights
+ * are only referenced by index, so the array may be moved afterwards.
+ *
+ * @return 0 on success, ENOMEM if the tree could not be allocated
+ */
+int light_tree_build(LightTree *tree, const struct Light *lights, size_t len);
+void light_tree_destroy(LightTree *tree);
+
+/**
+ * Starts enumerating the lights that reach pos. The order is deterministic,
+ * so samplers consume their dimensions in the same order on every run.
+ */
+void light_tree_begin(const LightTree *tree, const struct Light *lights,
+                      Vec3 pos, LightIter *it);
+
+/**
+ * @return The index of the next light that reaches the iterator's point, or
+ *          -1 once all of them have been returned
+ */
+int light_tree_next(LightIter *it);
+
+#endif //RAYTRACERPROJ__LIGHT_TREE_H_
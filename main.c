@@ -1,21 +1,72 @@
 
-#include "camera.h"
-#include "ppm_file.h"
-#include "scene_config.h"
+#include "cost_map.h"
+#include "estimate.h"
+#include "gbuffer.h"
+#include "image_diff.h"
+#include "perf_counters.h"
+#include "progressive.h"
+#include "scene_diff.h"
+#include "shadow_map.h"
+#include "trace.h"
+#include "tracer.h"
+#include "views.h"
 #include <errno.h>
 #include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 static const char *input_file_name;
 static const char *gen_type;
 static const char *output_file_name;
+static int progressive;
+static int time_budget_ms;
+static float convergence = -1;
+static int aa_min_samples = 1, aa_max_samples;
+static float aa_threshold = -1;
+static float min_throughput = -1;
+static int rr_depth;
+static int wavefront;
+static int light_samples;
+static int shadow_map_size;
+static const char *gbuffer_file_name;
+static const char *relight_file_name;
+static int watch;
+static CameraRig rig;
+static int threads;
+static int crop[4] = {-1};
+static int tiled;
+static TileOrder tile_order;
+static int heatmap;
+static const char *stats_file_name;
+static int perf;
+static const char *trace_file_name;
+static int validate;
+static float min_psnr = -1;
+static int estimate;
+static float estimate_percent = 1;
+static PerfCounters perf_counters;
+static PerfSample perf_last;
+static volatile sig_atomic_t interrupted;
 
 static void print_usage(const char *program_name) {
   fprintf(stderr,
-          "invalid usage: raytracer [input desc file] [-g gradient/mandel] [-o outputfile]\n");
+          "invalid usage: raytracer [input desc file] [-g gradient/mandel] [-o outputfile]\n"
+          "                         [--progressive] [--time-budget ms] [--converge eps]\n"
+          "                         [--aa min_spp max_spp] [--aa-threshold t]\n"
+          "                         [--min-throughput t] [--rr depth] [--wavefront]\n"
+          "                         [--light-samples n] [--shadow-maps size]\n"
+          "                         [--gbuffer file | --relight file] [--watch]\n"
+          "                         [--rig stereo sep | cube | array cols rows spacing]\n"
+          "                         [--threads n] [--crop x0 y0 x1 y1] [--tiled]\n"
+          "                         [--tile-order interleaved | cost]\n"
+          "                         [--stats file.json] [--heatmap] [--perf]\n"
+          "                         [--trace file.json] [--validate] [--min-psnr db]\n"
+          "                         [--estimate] [--estimate-percent p]\n");
   exit(EXIT_FAILURE);
 }
 
@@ -47,6 +98,170 @@ static char *replace_file_ext(const char *filename, const char *ext) {
   return out;
 }
 
+// Inserts _name before the extension of filename
+// i.e. out.ppm, left -> out_left.ppm
+// Returns new string that must be freed
+static char *view_file_name(const char *filename, const char *name) {
+  const char *ext = get_base_filename(filename);
+  size_t stem = ext - filename;
+  char *out = malloc(strlen(filename) + strlen(name) + 2);
+  memcpy(out, filename, stem);
+  sprintf(out + stem, "_%s%s", name, ext);
+  return out;
+}
+
+// Writes a false color image of every channel of the view's costs next to
+// the output file, e.g. out_rays.ppm or out_left_rays.ppm
+static int write_heatmaps(View *view, int single) {
+  for (int channel = 0; channel < COST_CHANNELS; channel++) {
+    char suffix[SCENE_CAMERA_NAME + 16];
+    snprintf(suffix, sizeof(suffix), "%s%s%s", single ? "" : view->name,
+             single ? "" : "_", cost_channel_name(channel));
+    char *file_name = view_file_name(output_file_name, suffix);
+    PixelMap *image = cost_map_heatmap(view->costs, channel);
+    int rc = ENOMEM;
+    if (image) {
+      rc = pixel_map_write_to_ppm(image, file_name);
+      pixel_map_destroy(image);
+    }
+    if (rc != 0) {
+      fprintf(stderr, "failed to write heatmap to %s: %s\n", file_name, strerror(rc));
+      free(file_name);
+      return rc;
+    }
+    free(file_name);
+  }
+  return 0;
+}
+
+// Renders the main camera (or its crop) into a new image
+static PixelMap *render_main_view(Scene *scene, const RenderOptions *opts, RenderStats *stats) {
+  View *views;
+  size_t len;
+  if (views_create(scene, NULL, &views, &len) != 0)
+    return NULL;
+  PixelMap *image = NULL;
+  if ((crop[0] < 0 || view_crop(&views[0], crop[0], crop[1], crop[2], crop[3]) == 0) &&
+      tracer_render_views(scene, views, 1, opts, threads, stats) == 0) {
+    image = views[0].image;
+    views[0].image = NULL;
+  }
+  views_destroy(views, len);
+  return image;
+}
+
+// Renders the main camera once with every approximation of opts turned off
+// and once as asked, writes the second render to the output file and the
+// difference next to it (out_error.ppm), and reports the speedup next to the
+// error. shadow_map_seconds is added to the time of the second render.
+// Returns the exit status, a failure if the PSNR is below min_psnr.
+static int validate_render(Scene *scene, const RenderOptions *opts, double shadow_map_seconds) {
+  RenderOptions reference;
+  render_options_default(&reference);
+  reference.seed = opts->seed;
+  reference.max_reflect_depth = opts->max_reflect_depth;
+  reference.max_refract_depth = opts->max_refract_depth;
+  reference.min_throughput = 0;
+  // As many samples everywhere as adaptive anti-aliasing takes at most
+  if (opts->aa_min_samples > 1)
+    reference.aa_min_samples = reference.aa_max_samples = opts->aa_max_samples;
+
+  RenderStats reference_stats = {0}, fast_stats = {0};
+  double begin = stats_clock();
+  PixelMap *expected = render_main_view(scene, &reference, &reference_stats);
+  double reference_seconds = stats_clock() - begin;
+  begin = stats_clock();
+  PixelMap *image = render_main_view(scene, opts, &fast_stats);
+  double fast_seconds = stats_clock() - begin + shadow_map_seconds;
+  if (!expected || !image) {
+    fprintf(stderr, "failed to render: %s\n", strerror(ENOMEM));
+    return EXIT_FAILURE;
+  }
+
+  ImageDiff diff;
+  PixelMap *heatmap;
+  if (image_diff(expected, image, &diff, &heatmap) != 0) {
+    fprintf(stderr, "failed to compare the renders: %s\n", strerror(ENOMEM));
+    return EXIT_FAILURE;
+  }
+  printf("Reference: %.3lf s, %llu rays (no pruning, shadow maps, light sampling, "
+         "roulette or adaptive sampling, not wavefront)\n",
+         reference_seconds, (unsigned long long) render_stats_rays(&reference_stats));
+  printf("Fast:      %.3lf s, %llu rays", fast_seconds,
+         (unsigned long long) render_stats_rays(&fast_stats));
+  if (shadow_map_seconds > 0)
+    printf(" (%.3lf s building shadow maps)", shadow_map_seconds);
+  printf("\nSpeedup %.2lfx, ", fast_seconds > 0 ? reference_seconds / fast_seconds : 0);
+  image_diff_print(stdout, &diff);
+
+  char *heatmap_file_name = view_file_name(output_file_name, "error");
+  int rc = pixel_map_write_to_ppm(image, output_file_name);
+  if (rc != 0)
+    fprintf(stderr, "failed to write ppm file to %s: %s\n", output_file_name, strerror(rc));
+  else if ((rc = pixel_map_write_to_ppm(heatmap, heatmap_file_name)) != 0)
+    fprintf(stderr, "failed to write heatmap to %s: %s\n", heatmap_file_name, strerror(rc));
+  free(heatmap_file_name);
+  pixel_map_destroy(heatmap);
+  pixel_map_destroy(image);
+  pixel_map_destroy(expected);
+  if (rc != 0)
+    return EXIT_FAILURE;
+  if (min_psnr >= 0 && diff.psnr < min_psnr) {
+    printf("PSNR is below %.1lf dB\n", min_psnr);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Traces a sample of the pixels of every view and prints what rendering all
+// of them would cost, after setup_seconds of loading and building the
+// acceleration structures. Returns the exit status.
+static int estimate_render(Scene *scene, const RenderOptions *opts, double setup_seconds) {
+  View *views;
+  size_t len;
+  int rc = views_create(scene, &rig, &views, &len);
+  if (rc != 0) {
+    fprintf(stderr, "failed to set up the cameras: %s\n",
+            rc == EINVAL ? "a camera's updir and viewdir must be non-zero and not parallel"
+                         : strerror(rc));
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; crop[0] >= 0 && i < len; i++) {
+    if (view_crop(&views[i], crop[0], crop[1], crop[2], crop[3]) != 0) {
+      fprintf(stderr, "crop window is outside of the %dx%d image of camera %s\n",
+              views[i].camera.window_pixel_width, views[i].camera.window_pixel_height,
+              views[i].name);
+      views_destroy(views, len);
+      return EXIT_FAILURE;
+    }
+  }
+  RenderEstimate result;
+  rc = tracer_estimate_views(scene, views, len, opts, estimate_percent / 100, threads, &result);
+  views_destroy(views, len);
+  if (rc != 0) {
+    fprintf(stderr, "failed to estimate the render: %s\n", strerror(rc));
+    return EXIT_FAILURE;
+  }
+  if (opts->wavefront)
+    printf("Estimating the recursive tracer, --wavefront is ignored\n");
+  if (opts->tile_order == TILE_ORDER_COST)
+    printf("Scheduling tiles in interleaved order, --tile-order cost is ignored\n");
+  printf("Loaded in %.3lf s, %zu view%s\n", setup_seconds, len, len == 1 ? "" : "s");
+  render_estimate_print(stdout, &result);
+  return EXIT_SUCCESS;
+}
+
+// Adds the hardware counts since the last call to the given stage
+static void perf_mark(RunStats *run, RenderStage stage) {
+  if (!perf)
+    return;
+  PerfSample now, delta;
+  perf_counters_read(&perf_counters, &now);
+  perf_sample_diff(&perf_last, &now, &delta);
+  perf_sample_add(&run->stage_perf[stage], &delta);
+  perf_last = now;
+}
+
 static void parse_args(int argc, char **argv) {
   if (argc < 2)
     print_usage(argv[0]);
@@ -60,6 +275,118 @@ static void parse_args(int argc, char **argv) {
       if (++i >= argc)
         print_usage(argv[0]);
       output_file_name = argv[i];
+    } else if (strcmp(argv[i], "--progressive") == 0) {
+      progressive = 1;
+    } else if (strcmp(argv[i], "--time-budget") == 0) {
+      if (++i >= argc || (time_budget_ms = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+      progressive = 1;
+    } else if (strcmp(argv[i], "--converge") == 0) {
+      if (++i >= argc || (convergence = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+      progressive = 1;
+    } else if (strcmp(argv[i], "--aa") == 0) {
+      if (i + 2 >= argc)
+        print_usage(argv[0]);
+      aa_min_samples = atoi(argv[++i]);
+      aa_max_samples = atoi(argv[++i]);
+      // One sample is the center ray without anti-aliasing, it can't adapt
+      if (aa_min_samples < 1 || aa_max_samples < aa_min_samples ||
+          (aa_min_samples == 1 && aa_max_samples > 1))
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--aa-threshold") == 0) {
+      if (++i >= argc || (aa_threshold = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--min-throughput") == 0) {
+      if (++i >= argc || (min_throughput = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--rr") == 0) {
+      if (++i >= argc || (rr_depth = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      wavefront = 1;
+    } else if (strcmp(argv[i], "--light-samples") == 0) {
+      if (++i >= argc || (light_samples = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--shadow-maps") == 0) {
+      if (++i >= argc || (shadow_map_size = atoi(argv[i])) < 2)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--gbuffer") == 0) {
+      if (++i >= argc || relight_file_name)
+        print_usage(argv[0]);
+      gbuffer_file_name = argv[i];
+    } else if (strcmp(argv[i], "--relight") == 0) {
+      if (++i >= argc || gbuffer_file_name)
+        print_usage(argv[0]);
+      relight_file_name = argv[i];
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      watch = 1;
+    } else if (strcmp(argv[i], "--rig") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      if (strcmp(argv[i], "stereo") == 0) {
+        rig.type = RIG_STEREO;
+        if (++i >= argc || (rig.spacing = atof(argv[i])) <= 0)
+          print_usage(argv[0]);
+      } else if (strcmp(argv[i], "cube") == 0) {
+        rig.type = RIG_CUBE;
+      } else if (strcmp(argv[i], "array") == 0) {
+        rig.type = RIG_ARRAY;
+        if (i + 3 >= argc)
+          print_usage(argv[0]);
+        rig.cols = atoi(argv[++i]);
+        rig.rows = atoi(argv[++i]);
+        rig.spacing = atof(argv[++i]);
+        if (rig.cols < 1 || rig.rows < 1 || rig.spacing <= 0)
+          print_usage(argv[0]);
+      } else {
+        print_usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      if (++i >= argc || (threads = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--crop") == 0) {
+      if (i + 4 >= argc)
+        print_usage(argv[0]);
+      for (int j = 0; j < 4; j++)
+        crop[j] = atoi(argv[++i]);
+      if (crop[0] < 0 || crop[1] < 0 || crop[2] <= crop[0] || crop[3] <= crop[1])
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--tiled") == 0) {
+      tiled = 1;
+    } else if (strcmp(argv[i], "--tile-order") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      if (strcmp(argv[i], "interleaved") == 0)
+        tile_order = TILE_ORDER_INTERLEAVED;
+      else if (strcmp(argv[i], "cost") == 0)
+        tile_order = TILE_ORDER_COST;
+      else
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--heatmap") == 0) {
+      heatmap = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      stats_file_name = argv[i];
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      perf = 1;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      trace_file_name = argv[i];
+    } else if (strcmp(argv[i], "--validate") == 0) {
+      validate = 1;
+    } else if (strcmp(argv[i], "--min-psnr") == 0) {
+      if (++i >= argc || (min_psnr = atof(argv[i])) < 0)
+        print_usage(argv[0]);
+      validate = 1;
+    } else if (strcmp(argv[i], "--estimate") == 0) {
+      estimate = 1;
+    } else if (strcmp(argv[i], "--estimate-percent") == 0) {
+      if (++i >= argc || (estimate_percent = atof(argv[i])) <= 0 || estimate_percent > 100)
+        print_usage(argv[0]);
+      estimate = 1;
     } else {
       if (input_file_name)
         print_usage(argv[0]);
@@ -71,54 +398,399 @@ static void parse_args(int argc, char **argv) {
     gen_type = "mandel";
   if (!input_file_name)
     print_usage(argv[0]);
+  if (watch && (progressive || gbuffer_file_name || relight_file_name))
+    print_usage(argv[0]);
+  // Progressive passes trace one centered ray per pixel with the recursive tracer
+  if (progressive && (aa_max_samples || wavefront))
+    print_usage(argv[0]);
+  if (heatmap && (tiled || wavefront))
+    print_usage(argv[0]);
+  if (validate && (rig.type != RIG_NONE || tiled || heatmap || stats_file_name || perf ||
+                   trace_file_name))
+    print_usage(argv[0]);
+  if (estimate && (validate || tiled || heatmap || stats_file_name || perf || trace_file_name))
+    print_usage(argv[0]);
+  if ((rig.type != RIG_NONE || crop[0] >= 0 || tiled || heatmap || validate || estimate) &&
+      (progressive || gbuffer_file_name || relight_file_name || watch))
+    print_usage(argv[0]);
+  if (!threads) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (int) cores : 1;
+  }
 
   if (!output_file_name)
     output_file_name = replace_file_ext(input_file_name, "ppm");
 }
 
+static void on_interrupt(int sig) {
+  (void) sig;
+  interrupted = 1;
+}
+
+// Whether a and b are the same version of a file. Modification times are
+// compared to the nanosecond, so a same length edit saved within a second of
+// the previous one still counts, and editors that save by renaming a new
+// file over the old one change the inode.
+static int same_file_version(const struct stat *a, const struct stat *b) {
+  return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+         a->st_size == b->st_size && a->st_ino == b->st_ino;
+}
+
+// Re-renders the tiles of ppm that an edit of the scene file can change every
+// time the file is saved, and writes the image out again. An edit that
+// doesn't parse keeps the previous version. Runs until ^C.
+static int watch_scene_file(Scene **scene, Camera *camera, PixelMap **ppm,
+                            RenderOptions *opts, ShadowMaps **shadow_maps) {
+  signal(SIGINT, on_interrupt);
+  GBuffer *hits = gbuffer_capture_hits(*scene, camera);
+  struct stat st;
+  if (!hits || stat(input_file_name, &st) != 0) {
+    fprintf(stderr, "failed to watch %s: %s\n", input_file_name,
+            strerror(hits ? errno : ENOMEM));
+    gbuffer_destroy(hits);
+    return EXIT_FAILURE;
+  }
+  struct stat version = st;
+  printf("Watching %s for changes\n", input_file_name);
+
+  while (!interrupted) {
+    struct timespec poll_interval = {0, 100 * 1000 * 1000};
+    nanosleep(&poll_interval, NULL);
+    if (stat(input_file_name, &st) != 0 || same_file_version(&st, &version))
+      continue;
+    version = st;
+
+    double begin = stats_clock();
+    Scene *new_scene = tracer_scene_load(input_file_name);
+    if (!new_scene)
+      continue;
+    Camera new_camera;
+    if (camera_create_from_scene(new_scene, &new_camera) != 0) {
+      fprintf(stderr,
+              "invalid updir/viewdir combination provided, both must be non-zero and not parallel\n");
+      tracer_scene_destroy(new_scene);
+      continue;
+    }
+
+    DirtyTiles tiles;
+    if (scene_diff_tiles(*scene, camera, new_scene, &new_camera, opts, hits, &tiles) != 0) {
+      fprintf(stderr, "failed to compare scenes: %s\n", strerror(ENOMEM));
+      tracer_scene_destroy(new_scene);
+      continue;
+    }
+
+    int width = new_scene->pixel_width, height = new_scene->pixel_height;
+    int resized = (*ppm)->width != width || (*ppm)->height != height;
+    if (resized) {
+      pixel_map_destroy(*ppm);
+      *ppm = pixel_map_new(width, height);
+    }
+    if (shadow_map_size) {
+      shadow_maps_destroy(*shadow_maps);
+      *shadow_maps = shadow_maps_build(new_scene, &new_camera, shadow_map_size);
+      opts->shadow_maps = *shadow_maps;
+    }
+
+    for (int ty = 0; ty < tiles.tiles_y; ty++) {
+      for (int tx = 0; tx < tiles.tiles_x; tx++) {
+        if (!tiles.dirty[ty * tiles.tiles_x + tx])
+          continue;
+        int x0 = tx * DIFF_TILE, y0 = ty * DIFF_TILE;
+        int x1 = MIN(x0 + DIFF_TILE, width), y1 = MIN(y0 + DIFF_TILE, height);
+        tracer_render_region(new_scene, &new_camera, x0, y0, x1, y1, *ppm, opts, NULL);
+        if (hits && !resized)
+          gbuffer_update_hits(hits, new_scene, &new_camera, x0, y0, x1, y1);
+      }
+    }
+    // Without hits the next edit traces them itself
+    if (resized) {
+      gbuffer_destroy(hits);
+      hits = gbuffer_capture_hits(new_scene, &new_camera);
+    }
+    tracer_scene_destroy(*scene);
+    *scene = new_scene;
+    *camera = new_camera;
+
+    int rc = pixel_map_write_to_ppm(*ppm, output_file_name);
+    if (rc != 0)
+      fprintf(stderr, "failed to write ppm file to %s: %s\n",
+              output_file_name, strerror(rc));
+    double time_spent = stats_clock() - begin;
+    printf("Re-rendered %d of %d tiles%s in %lf seconds\n", tiles.count,
+           tiles.tiles_x * tiles.tiles_y, tiles.full ? " (full frame)" : "",
+           time_spent);
+    dirty_tiles_destroy(&tiles);
+  }
+  gbuffer_destroy(hits);
+  return 0;
+}
+
 int main(int argc, char **argv) {
   parse_args(argc, argv);
 
-  clock_t begin = clock();
+  // One buffer per render thread, the first one is this thread's. Created
+  // before the clock starts so the timeline begins with parsing
+  Trace *trace = NULL;
+  if (trace_file_name && !(trace = trace_new(threads))) {
+    fprintf(stderr, "failed to set up the trace: %s\n", strerror(ENOMEM));
+    return EXIT_FAILURE;
+  }
+
+  // Wall clock time, CPU time would add up the time of every thread
+  double begin = stats_clock();
+  RunStats run = {0};
+  run.perf = perf;
+  // Opened before any worker thread starts, so those are counted as well
+  if (perf) {
+    if (perf_counters_open(&perf_counters) == 0)
+      fprintf(stderr, "hardware counters are unavailable: %s\n", strerror(errno));
+    perf_counters_read(&perf_counters, &perf_last);
+  }
 
   Camera camera;
-  Scene *scene = scene_create_from_file(input_file_name);
+  Scene *scene = tracer_scene_load(input_file_name);
   if (!scene)
     return EXIT_FAILURE;
+  double loaded = stats_clock();
+  trace_span(trace, "parse", begin, loaded);
+  // Textures are read throughout parsing, shown as one span of their total time
+  if (scene->texture_seconds > 0)
+    trace_span(trace, "textures", begin, begin + scene->texture_seconds);
+  trace_span(trace, "light tree", loaded - scene->light_tree_seconds, loaded);
+  run.stage_seconds[STAGE_TEXTURES] = scene->texture_seconds;
+  run.stage_seconds[STAGE_ACCEL] = scene->light_tree_seconds;
+  run.stage_seconds[STAGE_PARSE] =
+    stats_clock() - begin - scene->texture_seconds - scene->light_tree_seconds;
+  // Loading reads the textures and builds the light tree, all counted as parsing
+  perf_mark(&run, STAGE_PARSE);
 
-  PixelMap *ppm = pixel_map_new(scene->pixel_width, scene->pixel_height);
+  // Plain renders allocate their images per view, if at all (--tiled)
+  int render_views = !relight_file_name && !gbuffer_file_name && !progressive;
+  PixelMap *ppm = render_views ? NULL : pixel_map_new(scene->pixel_width, scene->pixel_height);
   if (camera_create_from_scene(scene, &camera) != 0) {
     fprintf(stderr,
             "invalid updir/viewdir combination provided, both must be non-zero and not parallel\n");
     return EXIT_FAILURE;
   }
-  scene->camera = &camera;
 
-  for (int x = 0; x < scene->pixel_width; x++) {
-    for (int y = 0; y < scene->pixel_height; y++) {
-      Ray ray = camera_trace_ray(&camera, x, y);
-      Intersection best_inter = scene_find_best_inter(scene, &ray);
-      if (best_inter.t != INFINITY) {
-        Color c = scene_shade_ray(scene, &ray, &best_inter);
-        pixel_map_put(ppm, x, y, ppm_color_from_color(c));
+  RenderOptions opts;
+  RenderStats stats = {0};
+  render_options_default(&opts);
+  opts.aa_min_samples = aa_min_samples;
+  if (aa_max_samples)
+    opts.aa_max_samples = aa_max_samples;
+  if (aa_threshold >= 0)
+    opts.aa_threshold = aa_threshold;
+  if (min_throughput >= 0)
+    opts.min_throughput = min_throughput;
+  opts.rr_depth = rr_depth;
+  opts.wavefront = wavefront;
+  opts.light_samples = light_samples;
+  opts.trace = trace;
+  opts.tile_order = tile_order;
+  ShadowMaps *shadow_maps = NULL;
+  double shadow_map_seconds = 0;
+  if (shadow_map_size) {
+    double build_begin = stats_clock();
+    shadow_maps = shadow_maps_build(scene, &camera, shadow_map_size);
+    if (!shadow_maps) {
+      fprintf(stderr, "failed to build shadow maps: %s\n", strerror(ENOMEM));
+      return EXIT_FAILURE;
+    }
+    opts.shadow_maps = shadow_maps;
+    shadow_map_seconds = stats_clock() - build_begin;
+    run.stage_seconds[STAGE_ACCEL] += shadow_map_seconds;
+    trace_span(trace, "shadow maps", build_begin, stats_clock());
+  }
+  perf_mark(&run, STAGE_ACCEL);
+  if (validate || estimate) {
+    int status = validate ? validate_render(scene, &opts, shadow_map_seconds)
+                          : estimate_render(scene, &opts, stats_clock() - begin);
+    shadow_maps_destroy(shadow_maps);
+    tracer_scene_destroy(scene);
+    return status;
+  }
+  if (scene->cameras_len && (progressive || gbuffer_file_name || relight_file_name || watch))
+    fprintf(stderr, "only the main camera is rendered, the other %zu are ignored\n",
+            scene->cameras_len);
+
+  int written = 0;
+  // Writes done while rendering count as the write stage, see write_begin
+  double render_begin = stats_clock(), write_begin, render_end = 0;
+  if (relight_file_name) {
+    GBuffer *gb = gbuffer_read(relight_file_name);
+    if (!gb)
+      return EXIT_FAILURE;
+    int reused_shadows;
+    if (gbuffer_relight(gb, scene, &camera, &opts, ppm, &reused_shadows) != 0) {
+      fprintf(stderr, "G-buffer %s doesn't match the scene's camera and geometry\n",
+              relight_file_name);
+      return EXIT_FAILURE;
+    }
+    printf("Relit from %s (%s)\n", relight_file_name,
+           reused_shadows ? "shadows reused" : "shadows traced");
+    gbuffer_destroy(gb);
+  } else if (gbuffer_file_name) {
+    GBuffer *gb = gbuffer_capture(scene, &camera, &opts, ppm);
+    if (!gb) {
+      fprintf(stderr, "failed to capture G-buffer: %s\n", strerror(ENOMEM));
+      return EXIT_FAILURE;
+    }
+    perf_mark(&run, STAGE_RENDER);
+    write_begin = render_end = stats_clock();
+    int rc = gbuffer_write(gb, gbuffer_file_name);
+    run.stage_seconds[STAGE_WRITE] += stats_clock() - write_begin;
+    trace_span(trace, "write", write_begin, stats_clock());
+    perf_mark(&run, STAGE_WRITE);
+    if (rc != 0) {
+      fprintf(stderr, "failed to write G-buffer to %s: %s\n",
+              gbuffer_file_name, strerror(rc));
+      return EXIT_FAILURE;
+    }
+    gbuffer_destroy(gb);
+  } else if (progressive) {
+    // Stop refining on ^C and write out what we have
+    signal(SIGINT, on_interrupt);
+    ProgressiveOptions popts;
+    progressive_options_default(&popts);
+    popts.time_budget_ms = time_budget_ms;
+    if (convergence >= 0)
+      popts.convergence = convergence;
+    popts.cancel = &interrupted;
+
+    ProgressiveResult result;
+    int rc = tracer_render_progressive(scene, &camera, ppm, &opts, &popts, &result);
+    if (rc != 0) {
+      fprintf(stderr, "failed to render progressively: %s\n", strerror(rc));
+      return EXIT_FAILURE;
+    }
+    printf("Progressive render: %d passes, %d samples per pixel%s in %.1lf ms\n",
+           result.passes, result.samples,
+           result.full_res ? "" : " (preview only)", result.elapsed_ms);
+    stats = result.stats;
+  } else {
+    View *views;
+    size_t views_len;
+    int rc = views_create(scene, &rig, &views, &views_len);
+    if (rc != 0) {
+      fprintf(stderr, "failed to set up the cameras: %s\n",
+              rc == EINVAL ? "a camera's updir and viewdir must be non-zero and not parallel"
+                           : strerror(rc));
+      return EXIT_FAILURE;
+    }
+    // Watch mode keeps re-rendering the main camera only
+    size_t rendered = watch ? 1 : views_len;
+    // Just the main camera is written to the output file as usual
+    int single = rendered == 1 && rig.type == RIG_NONE;
+    for (size_t i = 0; i < rendered; i++) {
+      if (crop[0] >= 0 && view_crop(&views[i], crop[0], crop[1], crop[2], crop[3]) != 0) {
+        fprintf(stderr, "crop window is outside of the %dx%d image of camera %s\n",
+                views[i].camera.window_pixel_width, views[i].camera.window_pixel_height,
+                views[i].name);
+        return EXIT_FAILURE;
+      }
+      View *view = &views[i];
+      if (heatmap && !(view->costs = cost_map_new(view->x0, view->y0, view->x1 - view->x0,
+                                                  view->y1 - view->y0))) {
+        fprintf(stderr, "failed to allocate heatmaps: %s\n", strerror(ENOMEM));
+        return EXIT_FAILURE;
+      }
+      if (!tiled)
+        continue;
+      char *file_name = single ? strdup(output_file_name)
+                               : view_file_name(output_file_name, views[i].name);
+      rc = ppm_tiled_file_open(file_name, views[i].x1 - views[i].x0,
+                               views[i].y1 - views[i].y0, &views[i].file);
+      if (rc != 0) {
+        fprintf(stderr, "failed to create ppm file %s: %s\n", file_name, strerror(rc));
+        return EXIT_FAILURE;
+      }
+      free(file_name);
+    }
+    rc = tracer_render_views(scene, views, rendered, &opts, threads, &stats);
+    if (rc != 0) {
+      fprintf(stderr, "failed to render: %s\n", strerror(rc));
+      return EXIT_FAILURE;
+    }
+    perf_mark(&run, STAGE_RENDER);
+    write_begin = render_end = stats_clock();
+    for (size_t i = 0; i < rendered; i++) {
+      char *file_name = single ? strdup(output_file_name)
+                               : view_file_name(output_file_name, views[i].name);
+      if (tiled) {
+        rc = ppm_tiled_file_close(views[i].file);
+        views[i].file = NULL;
       } else {
-        pixel_map_put(ppm, x, y, ppm_color_from_color(scene->bg_color));
+        rc = pixel_map_write_to_ppm(views[i].image, file_name);
+        // Kept for watch mode to update
+        if (single) {
+          ppm = views[i].image;
+          views[i].image = NULL;
+        }
+      }
+      if (rc != 0) {
+        fprintf(stderr, "failed to write ppm file to %s: %s\n",
+                file_name, strerror(rc));
+        return EXIT_FAILURE;
       }
+      free(file_name);
+      if (heatmap && write_heatmaps(&views[i], single) != 0)
+        return EXIT_FAILURE;
     }
+    run.stage_seconds[STAGE_WRITE] += stats_clock() - write_begin;
+    trace_span(trace, "write", write_begin, stats_clock());
+    perf_mark(&run, STAGE_WRITE);
+    if (!single)
+      printf("Rendered %zu views\n", rendered);
+    written = 1;
+    views_destroy(views, views_len);
   }
 
-  int rc = pixel_map_write_to_ppm(ppm, output_file_name);
+  run.stage_seconds[STAGE_RENDER] =
+    stats_clock() - render_begin - run.stage_seconds[STAGE_WRITE];
+  perf_mark(&run, STAGE_RENDER);
+
+  write_begin = stats_clock();
+  if (!render_end)
+    render_end = write_begin;
+  trace_span(trace, "render", render_begin, render_end);
+  int rc = written ? 0 : pixel_map_write_to_ppm(ppm, output_file_name);
   if (rc != 0) {
     fprintf(stderr, "failed to write ppm file to %s: %s\n",
             output_file_name, strerror(rc));
     return EXIT_FAILURE;
   }
+  run.stage_seconds[STAGE_WRITE] += stats_clock() - write_begin;
+  if (!written)
+    trace_span(trace, "write", write_begin, stats_clock());
+  perf_mark(&run, STAGE_WRITE);
+  if (perf)
+    perf_counters_close(&perf_counters);
 
-  clock_t end = clock();
-  double time_spent = (double) (end - begin) / CLOCKS_PER_SEC;
-  printf("Rendering finished in %lf seconds\n", time_spent);
+  printf("Rendering finished in %lf seconds\n", stats_clock() - begin);
+  run.render = stats;
+  run.threads = render_views ? threads : 1;
+  run.peak_memory_kb = stats_peak_memory_kb();
+  run_stats_print(stdout, &run);
+  if (stats_file_name && (rc = run_stats_write_json(&run, stats_file_name)) != 0) {
+    fprintf(stderr, "failed to write stats to %s: %s\n", stats_file_name, strerror(rc));
+    return EXIT_FAILURE;
+  }
+  if (trace) {
+    opts.trace = NULL;
+    if ((rc = trace_write_json(trace, trace_file_name)) != 0) {
+      fprintf(stderr, "failed to write trace to %s: %s\n", trace_file_name, strerror(rc));
+      return EXIT_FAILURE;
+    }
+    trace_destroy(trace);
+  }
+
+  if (watch && watch_scene_file(&scene, &camera, &ppm, &opts, &shadow_maps) != 0)
+    return EXIT_FAILURE;
 
-  pixel_map_destroy(ppm);
-  scene_destroy(scene);
+  if (ppm)
+    pixel_map_destroy(ppm);
+  shadow_maps_destroy(shadow_maps);
+  tracer_scene_destroy(scene);
   return 0;
 }
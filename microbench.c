@@ -0,0 +1,238 @@
+// masptracer-microbench: times the intersection and shading kernels on their
+// own, on fixed pseudo-random inputs, so changes to a kernel can be measured
+// without the noise of a whole render.
+
+#define _USE_MATH_DEFINES
+#include "ppm_file.h"
+#include "sampler.h"
+#include "scene.h"
+#include "stats.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Inputs per kernel, cycled through; small enough to stay in the L1 cache
+#define INPUTS 1024
+#define SEED 42
+
+// Minimum time each kernel runs for
+static double min_seconds = 0.2;
+static const char *filter;
+
+typedef enum { MIX_HIT, MIX_MISS, MIX_NONE } Mix;
+static const char *const mix_names[] = {"hit", "miss", "-"};
+
+// Everything the kernels are called with
+typedef struct Inputs {
+  Scene scene; // vertices of the triangle
+  Vec3 vertices[3];
+  Material mat;
+  Sphere sphere;
+  Cylinder cyl;
+  Triangle tri;
+  Light light;
+  DepthCue cue;
+  PixelMap *texture;
+  Ray rays[INPUTS];
+  Intersection hits[INPUTS]; // for the shading kernels
+  Vec3 dirs[INPUTS]; // unit directions to a light
+  float values[INPUTS]; // distances
+  Vec2 uvs[INPUTS];
+} Inputs;
+
+// A kernel called on input i, returns something that depends on the result
+// so the call can't be optimized away
+typedef float (*Kernel)(Inputs *in, int i, int *hit);
+
+static float random_float(uint32_t a, uint32_t b) {
+  return sampler_hash(SEED, a, b, 0) / 4294967296.0f;
+}
+
+static Vec3 random_unit(uint32_t a) {
+  float z = 2 * random_float(a, 0) - 1, phi = 2 * (float) M_PI * random_float(a, 1);
+  float r = sqrtf(MAX(0, 1 - z * z));
+  return (Vec3) {r * cosf(phi), r * sinf(phi), z};
+}
+
+// Rays from a shell of radius 10 around the origin, about the fraction aimed
+// of them towards a point on the primitive picked by aim, the rest in random
+// directions
+static void make_rays(Inputs *in, float aimed, Vec3 (*aim)(Inputs *in, int i)) {
+  for (int i = 0; i < INPUTS; i++) {
+    Ray *ray = &in->rays[i];
+    ray->pos = vecmul(random_unit(i), 10);
+    if (random_float(i, 2) < aimed)
+      ray->dir = norm(vecsub(aim(in, i), ray->pos));
+    else
+      ray->dir = random_unit(i + INPUTS);
+  }
+}
+
+static Vec3 aim_sphere(Inputs *in, int i) {
+  (void) in;
+  return vecmul(random_unit(i + 2 * INPUTS), 0.9f * random_float(i, 3));
+}
+
+static Vec3 aim_cylinder(Inputs *in, int i) {
+  Vec3 p = vecmul(random_unit(i + 2 * INPUTS), 0.9f * random_float(i, 3));
+  p.z = in->cyl.center.z + in->cyl.height * random_float(i, 4);
+  return p;
+}
+
+static Vec3 aim_triangle(Inputs *in, int i) {
+  float u = random_float(i, 3), v = random_float(i, 4);
+  if (u + v > 1) {
+    u = 1 - u;
+    v = 1 - v;
+  }
+  Vec3 *p = in->vertices;
+  return vecadd(p[0], vecadd(vecmul(vecsub(p[1], p[0]), u), vecmul(vecsub(p[2], p[0]), v)));
+}
+
+static float sphere_kernel(Inputs *in, int i, int *hit) {
+  Intersection out = {0};
+  *hit = ray_intersects_sphere(&in->scene, &in->rays[i], &in->sphere, &out);
+  return out.t;
+}
+
+static float cylinder_kernel(Inputs *in, int i, int *hit) {
+  Intersection out = {0};
+  *hit = ray_intersects_cylinder(&in->scene, &in->rays[i], &in->cyl, &out);
+  return out.t;
+}
+
+static float triangle_kernel(Inputs *in, int i, int *hit) {
+  Intersection out = {0};
+  *hit = ray_intersects_triangle(&in->scene, &in->rays[i], &in->tri, &out);
+  return out.t;
+}
+
+static float specular_kernel(Inputs *in, int i, int *hit) {
+  (void) hit;
+  return calc_specular_comp(in->light.pos, &in->hits[i], in->dirs[i]).x;
+}
+
+static float atten_kernel(Inputs *in, int i, int *hit) {
+  (void) hit;
+  Color c = {1, 0.5f, 0.25f};
+  return apply_atten(&in->light, c, in->values[i] * in->values[i]).x;
+}
+
+static float depth_cue_kernel(Inputs *in, int i, int *hit) {
+  (void) hit;
+  Color c = {1, 0.5f, 0.25f};
+  return apply_depth_cueing(c, &in->cue, in->values[i]).x;
+}
+
+static float texture_kernel(Inputs *in, int i, int *hit) {
+  (void) hit;
+  return pixel_map_nearest_lookup(in->texture, in->uvs[i]).x;
+}
+
+static void setup(Inputs *in) {
+  memset(in, 0, sizeof(Inputs));
+  in->mat = (Material) {.diffuse_color = {0.8f, 0.2f, 0.2f}, .spec_color = {1, 1, 1},
+                        .ka = 0.1f, .kd = 0.6f, .ks = 0.3f, .n = 30,
+                        .opacity = 1, .idx_of_refraction = 1};
+  in->sphere = (Sphere) {{0, 0, 0}, 1, &in->mat};
+  in->cyl = (Cylinder) {{0, 0, -1}, {0, 0, 1}, 1, 2, &in->mat};
+  in->vertices[0] = (Vec3) {-1, -1, 0};
+  in->vertices[1] = (Vec3) {1, -1, 0};
+  in->vertices[2] = (Vec3) {0, 1, 0};
+  in->scene.vertices = in->vertices;
+  in->tri = (Triangle) {{0, 1, 2}, {0, 0, 0}, {-1, -1, -1}, &in->mat};
+  in->light = (Light) {.pos = {10, 10, 10}, .w = 1, .color = {1, 1, 1},
+                       .is_attenuated = 1, .att = {1, 0.05f, 0.01f}};
+  in->cue = (DepthCue) {{0.5f, 0.5f, 0.6f}, 0.2f, 1, 5, 50};
+  in->texture = pixel_map_new(256, 256);
+  for (int i = 0; i < 256 * 256; i++)
+    in->texture->data[i] = (PpmColor) {i & 255, (i >> 8) & 255, (i * 7) & 255};
+
+  for (int i = 0; i < INPUTS; i++) {
+    Intersection *hit = &in->hits[i];
+    hit->pos = vecmul(random_unit(i), 1);
+    hit->norm = hit->pos;
+    hit->mat = &in->mat;
+    in->dirs[i] = norm(vecsub(in->light.pos, hit->pos));
+    in->values[i] = 60 * random_float(i, 5);
+    in->uvs[i] = (Vec2) {random_float(i, 6), random_float(i, 7)};
+  }
+}
+
+// Calls kernel over and over, doubling the iterations until they take at
+// least min_seconds, and prints the time per call
+static void run(const char *name, Mix mix, Inputs *in, Kernel kernel) {
+  if (filter && !strstr(name, filter))
+    return;
+  volatile float sink = 0;
+  long hits = 0, calls = 0;
+  double seconds = 0;
+  for (long iterations = INPUTS; seconds < min_seconds; iterations *= 2) {
+    float sum = 0;
+    long hit_count = 0;
+    double begin = stats_clock();
+    for (long k = 0; k < iterations; k++) {
+      int hit = 0;
+      sum += kernel(in, (int) (k % INPUTS), &hit);
+      hit_count += hit;
+    }
+    seconds = stats_clock() - begin;
+    sink += sum;
+    hits = hit_count;
+    calls = iterations;
+  }
+  double ns = seconds * 1e9 / calls;
+  printf("%-26s %-5s %10.2f %12.2f", name, mix_names[mix], ns, 1e3 / ns);
+  if (mix != MIX_NONE)
+    printf(" %9.1f%%", 100.0 * hits / calls);
+  printf("\n");
+}
+
+static void print_usage(const char *program_name) {
+  fprintf(stderr, "usage: %s [--min-time ms] [--filter name]\n", program_name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--min-time") == 0) {
+      if (++i >= argc || (min_seconds = atof(argv[i]) / 1000) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--filter") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      filter = argv[i];
+    } else {
+      print_usage(argv[0]);
+    }
+  }
+
+  Inputs *in = malloc(sizeof(Inputs));
+  setup(in);
+  printf("%-26s %-5s %10s %12s %10s\n", "kernel", "mix", "ns/call", "Mcalls/s", "hits");
+  // Hit heavy mixes aim 90% of the rays at the primitive, miss heavy ones 10%
+  struct {
+    const char *name;
+    Vec3 (*aim)(Inputs *in, int i);
+    Kernel kernel;
+  } intersections[] = {
+    {"ray_intersects_sphere", aim_sphere, sphere_kernel},
+    {"ray_intersects_cylinder", aim_cylinder, cylinder_kernel},
+    {"ray_intersects_triangle", aim_triangle, triangle_kernel},
+  };
+  for (int i = 0; i < 3; i++) {
+    make_rays(in, 0.9f, intersections[i].aim);
+    run(intersections[i].name, MIX_HIT, in, intersections[i].kernel);
+    make_rays(in, 0.1f, intersections[i].aim);
+    run(intersections[i].name, MIX_MISS, in, intersections[i].kernel);
+  }
+  run("calc_specular_comp", MIX_NONE, in, specular_kernel);
+  run("apply_atten", MIX_NONE, in, atten_kernel);
+  run("apply_depth_cueing", MIX_NONE, in, depth_cue_kernel);
+  run("pixel_map_nearest_lookup", MIX_NONE, in, texture_kernel);
+
+  pixel_map_destroy(in->texture);
+  free(in);
+  return 0;
+}
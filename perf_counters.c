@@ -0,0 +1,95 @@
+#include "perf_counters.h"
+
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *const event_names[PERF_EVENTS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+#ifdef __linux__
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[PERF_EVENTS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+int perf_counters_open(PerfCounters *pc) {
+  int opened = 0;
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1; // worker threads started later count too
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pc->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pc->fds[i] >= 0)
+      opened++;
+  }
+  return opened;
+}
+
+void perf_counters_close(PerfCounters *pc) {
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    if (pc->fds[i] >= 0)
+      close(pc->fds[i]);
+    pc->fds[i] = -1;
+  }
+}
+
+void perf_counters_read(const PerfCounters *pc, PerfSample *out) {
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    uint64_t values[3]; // count, time enabled, time running
+    if (pc->fds[i] < 0 || read(pc->fds[i], values, sizeof(values)) != sizeof(values))
+      continue;
+    // Multiplexed events only ran part of the time
+    if (values[2] > 0 && values[2] < values[1])
+      values[0] = (uint64_t) ((double) values[0] * values[1] / values[2]);
+    out->counts[i] = values[0];
+    out->available |= 1u << i;
+  }
+}
+#else
+int perf_counters_open(PerfCounters *pc) {
+  for (int i = 0; i < PERF_EVENTS; i++)
+    pc->fds[i] = -1;
+  return 0;
+}
+
+void perf_counters_close(PerfCounters *pc) {
+}
+
+void perf_counters_read(const PerfCounters *pc, PerfSample *out) {
+  memset(out, 0, sizeof(*out));
+}
+#endif
+
+void perf_sample_diff(const PerfSample *before, const PerfSample *after, PerfSample *out) {
+  out->available = before->available & after->available;
+  for (int i = 0; i < PERF_EVENTS; i++)
+    out->counts[i] = after->counts[i] - before->counts[i];
+}
+
+void perf_sample_add(PerfSample *dst, const PerfSample *src) {
+  dst->available |= src->available;
+  for (int i = 0; i < PERF_EVENTS; i++)
+    dst->counts[i] += src->counts[i];
+}
+
+const char *perf_event_name(PerfEvent event) {
+  return event_names[event];
+}
@@ -0,0 +1,60 @@
+#ifndef RAYTRACERPROJ__PERF_COUNTERS_H_
+#define RAYTRACERPROJ__PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+// Hardware events counted by PerfCounters
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES, // L1 data cache read misses
+  PERF_LLC_MISSES, // last level cache misses
+  PERF_BRANCH_MISSES,
+  PERF_EVENTS
+} PerfEvent;
+
+// Event counts at some point, or between two points
+typedef struct PerfSample {
+  uint64_t counts[PERF_EVENTS];
+  unsigned available; // bit i is set if event i was counted
+} PerfSample;
+
+// Hardware performance counters of the whole process (perf_event_open on
+// Linux), user space only. Threads started after the counters are opened are
+// counted too, once they have exited.
+typedef struct PerfCounters {
+  int fds[PERF_EVENTS]; // -1 for events that can't be counted
+} PerfCounters;
+
+/**
+ * Opens and starts a counter for every event the CPU, kernel and permissions
+ * (see /proc/sys/kernel/perf_event_paranoid) allow
+ *
+ * @return The number of events being counted, 0 if there are no counters at
+ *          all (e.g. in most virtual machines or on other systems than Linux)
+ */
+int perf_counters_open(PerfCounters *pc);
+void perf_counters_close(PerfCounters *pc);
+
+/**
+ * Reads the counts since perf_counters_open, scaled up if the kernel had to
+ * share the hardware counters between events
+ */
+void perf_counters_read(const PerfCounters *pc, PerfSample *out);
+
+/**
+ * Sets out to the counts between the samples before and after
+ */
+void perf_sample_diff(const PerfSample *before, const PerfSample *after, PerfSample *out);
+
+/**
+ * Adds the counts of src to dst, events counted in either are available in dst
+ */
+void perf_sample_add(PerfSample *dst, const PerfSample *src);
+
+/**
+ * @return The name of an event, for reports
+ */
+const char *perf_event_name(PerfEvent event);
+
+#endif //RAYTRACERPROJ__PERF_COUNTERS_H_
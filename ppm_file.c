@@ -1,11 +1,13 @@
 #include "ppm_file.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 PpmColor rgb_black() {
   PpmColor result = {0};
@@ -69,18 +71,21 @@ PpmColor pixel_map_get(PixelMap *this, int x, int y) {
   return empty;
 }
 
-static void write_header(PixelMap *this, FILE *file) {
+// Formats the header of a ppm file of the given format (P3 or P6) into buf
+// Returns the length of the header
+static int format_header(char *buf, size_t size, const char *format, int width,
+                         int height) {
   char time_str[64];
   time_t now = time(0);
   struct tm *tm = localtime(&now);
   strftime(time_str, sizeof(time_str), "%c", tm);
 
-  fprintf(file,
-          "P3\n"
-          "# generated by masptracer at %s\n"
-          "%d %d\n"
-          "255\n",
-          time_str, this->width, this->height);
+  return snprintf(buf, size,
+                  "%s\n"
+                  "# generated by masptracer at %s\n"
+                  "%d %d\n"
+                  "255\n",
+                  format, time_str, width, height);
 }
 
 int pixel_map_write_to_ppm(PixelMap *this, const char *output_filename) {
@@ -88,7 +93,9 @@ int pixel_map_write_to_ppm(PixelMap *this, const char *output_filename) {
   if (!output_file)
     return errno;
 
-  write_header(this, output_file);
+  char header[128];
+  format_header(header, sizeof(header), "P3", this->width, this->height);
+  fputs(header, output_file);
   for (int i = 0; i < this->width * this->height; i++) {
     PpmColor c = this->data[i];
     fprintf(output_file, "%d %d %d\n", c.r, c.g, c.b);
@@ -99,21 +106,53 @@ int pixel_map_write_to_ppm(PixelMap *this, const char *output_filename) {
   return 0;
 }
 
+// Reads the next number of a ppm header, skipping whitespace and comments
+// Returns 1 if successful, 0 otherwise
+static int read_header_value(FILE *input_file, int *value) {
+  int c;
+  while ((c = fgetc(input_file)) == '#' || (c != EOF && strchr(" \t\r\n", c))) {
+    if (c == '#')
+      while ((c = fgetc(input_file)) != EOF && c != '\n')
+        ;
+  }
+  if (c == EOF)
+    return 0;
+  ungetc(c, input_file);
+  return fscanf(input_file, "%d", value) == 1;
+}
+
 int pixel_map_read_from_file(const char *input_filename, PixelMap **out) {
-  FILE *input_file = fopen(input_filename, "r");
+  FILE *input_file = fopen(input_filename, "rb");
   if (!input_file)
     return errno;
 
-  int width, height;
+  // P3 as written by pixel_map_write_to_ppm, or P6 as by ppm_tiled_file_open
+  int format = 0, width, height;
   int max_value;
-  int rc = fscanf(input_file, "P3 %d %d %d\n", &width, &height, &max_value);
-  if (rc != 3 || width <= 0 || height <= 0 || max_value <= 0) {
+  int rc = fscanf(input_file, "P%d", &format);
+  if (rc != 1 || (format != 3 && format != 6) || !read_header_value(input_file, &width) ||
+      !read_header_value(input_file, &height) || !read_header_value(input_file, &max_value) ||
+      width <= 0 || height <= 0 || max_value <= 0 || (format == 6 && max_value > 255)) {
     fprintf(stderr, "invalid header for ppm file\n");
     fclose(input_file);
     return EINVAL;
   }
 
   PixelMap *new_map = pixel_map_new(width, height);
+  if (format == 6) {
+    // A single whitespace character separates the header from the pixels
+    size_t len = (size_t) width * height;
+    if (fgetc(input_file) == EOF ||
+        fread(new_map->data, sizeof(PpmColor), len, input_file) != len) {
+      fprintf(stderr, "ppm file is missing pixels (expected %zu)\n", len);
+      pixel_map_destroy(new_map);
+      fclose(input_file);
+      return EINVAL;
+    }
+    fclose(input_file);
+    *out = new_map;
+    return 0;
+  }
   int r, g, b;
   int i = 0;
   while ((rc = fscanf(input_file, "%d %d %d", &r, &g, &b)) == 3) {
@@ -149,3 +188,55 @@ Color pixel_map_nearest_lookup(PixelMap *this, Vec2 uv) {
                              (int)round(uv.y * (this->height - 1)));
   return ppm2color(c);
 }
+
+int ppm_tiled_file_open(const char *output_filename, int width, int height,
+                        PpmTiledFile **out) {
+  int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return errno;
+
+  char header[128];
+  int len = format_header(header, sizeof(header), "P6", width, height);
+  // Sizing the file up front leaves the pixels as a hole until written
+  off_t size = len + (off_t) width * height * sizeof(PpmColor);
+  if (write(fd, header, len) != len || ftruncate(fd, size) != 0) {
+    int rc = errno;
+    close(fd);
+    return rc;
+  }
+
+  PpmTiledFile *file = malloc(sizeof(PpmTiledFile));
+  file->fd = fd;
+  file->width = width;
+  file->height = height;
+  file->data_offset = len;
+  *out = file;
+  return 0;
+}
+
+int ppm_tiled_file_write(PpmTiledFile *this, int x, int y, const PixelMap *tile) {
+  if (x < 0 || y < 0 || x + tile->width > this->width || y + tile->height > this->height)
+    return EINVAL;
+
+  // Rows of the tile are consecutive pixels in the file
+  size_t row_size = tile->width * sizeof(PpmColor);
+  for (int row = 0; row < tile->height; row++) {
+    off_t pos = this->data_offset + ((off_t) (y + row) * this->width + x) * sizeof(PpmColor);
+    const char *data = (const char *) &tile->data[row * tile->width];
+    size_t done = 0;
+    while (done < row_size) {
+      ssize_t n = pwrite(this->fd, data + done, row_size - done, pos + done);
+      if (n < 0 && errno != EINTR)
+        return errno;
+      if (n > 0)
+        done += n;
+    }
+  }
+  return 0;
+}
+
+int ppm_tiled_file_close(PpmTiledFile *this) {
+  int rc = close(this->fd) == 0 ? 0 : errno;
+  free(this);
+  return rc;
+}
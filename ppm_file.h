@@ -41,4 +41,25 @@ int pixel_map_write_to_ppm(PixelMap *this, const char *output_filename);
 
 int pixel_map_read_from_file(const char *input_filename, PixelMap **out);
 
+// A binary (P6) ppm file of a fixed size that regions are written into as
+// they are done, in any order and from any thread, so the whole image never
+// has to be in memory
+typedef struct PpmTiledFile {
+  int fd;
+  int width, height;
+  long data_offset; // where the pixels start, after the header
+} PpmTiledFile;
+
+// Creates output_filename with room for width x height pixels, all black
+// Returns 0 if successful, errno otherwise
+int ppm_tiled_file_open(const char *output_filename, int width, int height,
+                        PpmTiledFile **out);
+
+// Writes tile with its upper left corner at pixel (x, y) of the file
+// Returns 0 if successful, EINVAL if the tile doesn't fit, errno otherwise
+int ppm_tiled_file_write(PpmTiledFile *this, int x, int y, const PixelMap *tile);
+
+// Closes the file, returns 0 if successful, errno otherwise
+int ppm_tiled_file_close(PpmTiledFile *this);
+
 #endif // RAYTRACERPROJ__PPM_FILE_H
@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 199309L
+#include "progressive.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+void progressive_options_default(ProgressiveOptions *popts) {
+  ProgressiveOptions defaults = {0};
+  defaults.time_budget_ms = 0;
+  defaults.convergence = 0.0005f;
+  defaults.start_block = 8;
+  defaults.preview_depth = 1;
+  defaults.max_samples = 16;
+  defaults.cancel = NULL;
+  *popts = defaults;
+}
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Checked once per row, which is frequent enough for the deadline and cheap
+// enough not to show up in the render time
+static int should_stop(const ProgressiveOptions *popts, double deadline) {
+  if (popts->cancel && *popts->cancel)
+    return 1;
+  return deadline > 0 && now_ms() >= deadline;
+}
+
+static void fill_block(PixelMap *out, int x, int y, int size, PpmColor c) {
+  for (int by = y; by < MIN(y + size, out->height); by++)
+    for (int bx = x; bx < MIN(x + size, out->width); bx++)
+      pixel_map_put(out, bx, by, c);
+}
+
+// Coarse passes: one preview ray per block, halving the block size each pass.
+// Pixels on the grid of the previous pass were already traced and are skipped,
+// so after the last pass accum holds exactly one preview sample per pixel.
+// Returns 1 if stopped early.
+static int render_blocks(TraceContext *ctx, PixelMap *out, Color *accum,
+                         const ProgressiveOptions *popts, double deadline,
+                         int *passes) {
+  for (int block = popts->start_block; block >= 1; block /= 2) {
+    for (int y = 0; y < out->height; y += block) {
+      if (should_stop(popts, deadline))
+        return 1;
+      for (int x = 0; x < out->width; x += block) {
+        int prev = block * 2;
+        if (block != popts->start_block && x % prev == 0 && y % prev == 0)
+          continue;
+        Color c = tracer_trace_pixel(ctx, x, y);
+        accum[x + y * out->width] = c;
+        fill_block(out, x, y, block, ppm_color_from_color(c));
+      }
+    }
+    (*passes)++;
+  }
+  return 0;
+}
+
+int tracer_render_progressive(Scene *scene, Camera *camera, PixelMap *out,
+                              const RenderOptions *opts,
+                              const ProgressiveOptions *popts,
+                              ProgressiveResult *result) {
+  if (out->width != scene->pixel_width || out->height != scene->pixel_height)
+    return EINVAL;
+
+  ProgressiveResult res = {0};
+  double start = now_ms();
+  double deadline = popts->time_budget_ms > 0 ? start + popts->time_budget_ms : 0;
+  int width = out->width;
+  int height = out->height;
+
+  RenderOptions preview_opts = *opts;
+  preview_opts.max_reflect_depth = MIN(opts->max_reflect_depth, popts->preview_depth);
+  preview_opts.max_refract_depth = MIN(opts->max_refract_depth, popts->preview_depth);
+  int preview_is_full = preview_opts.max_reflect_depth == opts->max_reflect_depth &&
+                        preview_opts.max_refract_depth == opts->max_refract_depth;
+
+  Color *accum = calloc((size_t) width * height, sizeof(Color));
+  if (!accum)
+    return ENOMEM;
+  TraceContext ctx;
+  tracer_context_init(&ctx, scene, camera, &preview_opts);
+  if (render_blocks(&ctx, out, accum, popts, deadline, &res.passes))
+    goto done;
+  if (preview_is_full) {
+    res.full_res = 1;
+    res.samples = 1;
+  }
+
+  render_stats_merge(&res.stats, &ctx.stats);
+  tracer_context_init(&ctx, scene, camera, opts);
+
+  // Full depth pass, unless the last block pass already was one
+  if (!res.full_res) {
+    for (int y = 0; y < height; y++) {
+      if (should_stop(popts, deadline))
+        goto done;
+      for (int x = 0; x < width; x++) {
+        Color c = tracer_trace_pixel(&ctx, x, y);
+        accum[x + y * width] = c;
+        pixel_map_put(out, x, y, ppm_color_from_color(c));
+      }
+    }
+    res.passes++;
+    res.full_res = 1;
+    res.samples = 1;
+  }
+
+  // Refinement: one more jittered sample per pixel each pass
+  for (int s = 1; s < popts->max_samples; s++) {
+    double change = 0;
+    for (int y = 0; y < height; y++) {
+      if (should_stop(popts, deadline))
+        goto done;
+      for (int x = 0; x < width; x++) {
+        tracer_seed_sample(&ctx, x, y, s);
+        Vec2 offset = sampler_next_2d(&ctx.sampler);
+        Ray ray = camera_trace_ray_subpixel(camera, x + offset.x, y + offset.y);
+        Color c = tracer_trace_ray(&ctx, &ray);
+
+        Color *sum = &accum[x + y * width];
+        Color prev_avg = vecdiv(*sum, s);
+        *sum = vecadd(*sum, c);
+        Color avg = vecdiv(*sum, s + 1);
+        change += fabs(avg.x - prev_avg.x) + fabs(avg.y - prev_avg.y) +
+                  fabs(avg.z - prev_avg.z);
+        pixel_map_put(out, x, y, ppm_color_from_color(avg));
+      }
+    }
+    res.passes++;
+    res.samples = s + 1;
+    if (change / (3.0 * width * height) < popts->convergence)
+      break;
+  }
+
+done:
+  render_stats_merge(&res.stats, &ctx.stats);
+  free(accum);
+  res.elapsed_ms = now_ms() - start;
+  if (result)
+    *result = res;
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef RAYTRACERPROJ__PROGRESSIVE_H_
+#define RAYTRACERPROJ__PROGRESSIVE_H_
+
+#include "tracer.h"
+#include <signal.h>
+
+typedef struct ProgressiveOptions {
+  int time_budget_ms; // wall clock deadline for the whole render, 0 for none
+  float convergence; // stop once a refinement pass changes pixels by less than this on average
+  int start_block; // edge length in pixels of the blocks of the first (coarsest) pass, a power of two
+  int preview_depth; // bounce depth used until the image is at full resolution
+  int max_samples; // samples per pixel after which refinement stops
+  volatile sig_atomic_t *cancel; // if not NULL, the render stops as soon as *cancel becomes non-zero
+} ProgressiveOptions;
+
+typedef struct ProgressiveResult {
+  int passes; // number of passes that ran to completion
+  int samples; // samples per pixel reached by every pixel
+  int full_res; // 1 if every pixel was traced at full depth at least once
+  double elapsed_ms;
+  RenderStats stats;
+} ProgressiveResult;
+
+void progressive_options_default(ProgressiveOptions *popts);
+
+/**
+ * Renders the whole image in passes of increasing quality: first one ray per
+ * start_block x start_block block (upscaled), halving the block size each pass
+ * at preview_depth, then one full depth ray per pixel and finally additional
+ * jittered samples per pixel.
+ *
+ * out always holds the best image so far, so it can be written out whenever
+ * this returns, whether the deadline passed, the image converged or the
+ * render was cancelled.
+ *
+ * @param result Statistics about the passes that ran, may be NULL
+ * @return 0 if successful, EINVAL if out isn't the size of the image,
+ *          ENOMEM if out of memory
+ */
+int tracer_render_progressive(Scene *scene, Camera *camera, PixelMap *out,
+                              const RenderOptions *opts,
+                              const ProgressiveOptions *popts,
+                              ProgressiveResult *result);
+
+#endif //RAYTRACERPROJ__PROGRESSIVE_H_
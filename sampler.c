@@ -0,0 +1,115 @@
+#include "sampler.h"
+
+void pcg32_seed(Pcg32 *rng, uint64_t seed, uint64_t stream) {
+  rng->state = 0;
+  rng->inc = (stream << 1u) | 1u;
+  pcg32_next(rng);
+  rng->state += seed;
+  pcg32_next(rng);
+}
+
+uint32_t pcg32_next(Pcg32 *rng) {
+  uint64_t old = rng->state;
+  rng->state = old * 6364136223846793005ULL + rng->inc;
+  uint32_t xorshifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+  uint32_t rot = (uint32_t) (old >> 59u);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+void pcg32_advance(Pcg32 *rng, uint64_t delta) {
+  uint64_t mult = 6364136223846793005ULL, plus = rng->inc;
+  uint64_t acc_mult = 1, acc_plus = 0;
+  for (; delta; delta >>= 1) {
+    if (delta & 1) {
+      acc_mult *= mult;
+      acc_plus = acc_plus * mult + plus;
+    }
+    plus *= mult + 1;
+    mult *= mult;
+  }
+  rng->state = acc_mult * rng->state + acc_plus;
+}
+
+static float to_unit_float(uint32_t x) {
+  return (float) (x >> 8) * (1.0f / (1 << 24));
+}
+
+float pcg32_next_float(Pcg32 *rng) {
+  return to_unit_float(pcg32_next(rng));
+}
+
+// First dimension of the Sobol sequence, the base 2 van der Corput sequence
+static uint32_t sobol_dim0(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v >>= 1)
+    if (index & 1)
+      result ^= v;
+  return result;
+}
+
+// Second dimension of the Sobol sequence (primitive polynomial x + 1)
+static uint32_t sobol_dim1(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    if (index & 1)
+      result ^= v;
+  return result;
+}
+
+// XORing with a random value permutes the elementary intervals of the
+// sequence without breaking their stratification
+Vec2 sequence2d_get(const Sequence2D *seq, uint32_t index) {
+  Vec2 result;
+  result.x = to_unit_float(sobol_dim0(index) ^ seq->scramble_x);
+  result.y = to_unit_float(sobol_dim1(index) ^ seq->scramble_y);
+  return result;
+}
+
+uint32_t sampler_hash(uint32_t seed, uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t h = seed ^ (a * 0x9E3779B1u) ^ (b * 0x85EBCA77u) ^ (c * 0xC2B2AE3Du);
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return h;
+}
+
+void sampler_start(Sampler *s, uint32_t seed, int x, int y, int sample) {
+  s->seed = seed;
+  s->x = x;
+  s->y = y;
+  s->sample = sample;
+  s->dimension = 0;
+  s->position = 0;
+  uint32_t pixel = sampler_hash(seed, (uint32_t) x, (uint32_t) y, 0);
+  pcg32_seed(&s->rng, ((uint64_t) pixel << 32) | (uint32_t) sample, pixel);
+}
+
+// Draw number dimension of the sample's stream, so a dimension set directly
+// gives the same value as reaching it by drawing. Drawing in order needs no
+// skipping.
+float sampler_next_1d(Sampler *s) {
+  uint32_t dim = s->dimension++;
+  pcg32_advance(&s->rng, (uint64_t) dim - s->position);
+  s->position = dim + 1;
+  return pcg32_next_float(&s->rng);
+}
+
+Vec2 sampler_next_2d(Sampler *s) {
+  uint32_t dim = s->dimension++;
+  uint32_t pixel = sampler_hash(s->seed, (uint32_t) s->x, (uint32_t) s->y, 0);
+  Sequence2D seq;
+  seq.scramble_x = sampler_hash(pixel, dim, 0, 1);
+  seq.scramble_y = sampler_hash(pixel, dim, 0, 2);
+  return sequence2d_get(&seq, (uint32_t) s->sample);
+}
+
+Sequence2D sampler_next_sequence(Sampler *s) {
+  uint32_t dim = s->dimension++;
+  uint32_t pixel = sampler_hash(s->seed, (uint32_t) s->x, (uint32_t) s->y, 0);
+  Sequence2D seq;
+  seq.scramble_x = sampler_hash(pixel, dim, (uint32_t) s->sample + 1, 1);
+  seq.scramble_y = sampler_hash(pixel, dim, (uint32_t) s->sample + 1, 2);
+  return seq;
+}
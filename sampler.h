@@ -0,0 +1,73 @@
+#ifndef RAYTRACERPROJ__SAMPLER_H_
+#define RAYTRACERPROJ__SAMPLER_H_
+
+#include "vec.h"
+#include <stdint.h>
+
+// PCG32 (O'Neill 2014): small state, fast and statistically much better than
+// rand(). Every Sampler owns one, so there is no shared state between threads.
+typedef struct Pcg32 {
+  uint64_t state;
+  uint64_t inc; // stream selector, always odd
+} Pcg32;
+
+void pcg32_seed(Pcg32 *rng, uint64_t seed, uint64_t stream);
+uint32_t pcg32_next(Pcg32 *rng);
+float pcg32_next_float(Pcg32 *rng); // uniform in [0, 1)
+// Skips delta draws in O(log delta) (Brown 1994), a delta past 2^63 goes back
+void pcg32_advance(Pcg32 *rng, uint64_t delta);
+
+// A scrambled 2D Sobol sequence. The first 4^k points stratify the unit square
+// into a 2^k x 2^k grid (and any 2^m points into elementary intervals), so
+// prefixes of the sequence are good point sets for any sample count.
+typedef struct Sequence2D {
+  uint32_t scramble_x;
+  uint32_t scramble_y;
+} Sequence2D;
+
+Vec2 sequence2d_get(const Sequence2D *seq, uint32_t index);
+
+// Per-sample source of random and low discrepancy numbers. Everything it
+// returns is a pure function of (seed, pixel, sample, dimension), where the
+// dimension counts the values drawn since sampler_start. Images are
+// therefore identical no matter which thread renders which pixel.
+typedef struct Sampler {
+  Pcg32 rng;
+  uint32_t seed;
+  int x, y;
+  int sample;
+  uint32_t dimension;
+  uint32_t position; // draws rng is past sampler_start
+} Sampler;
+
+/**
+ * Prepares the sampler for the given sample of pixel (x, y)
+ */
+void sampler_start(Sampler *s, uint32_t seed, int x, int y, int sample);
+
+/**
+ * Returns a uniformly distributed random number in [0, 1), the draw of the
+ * sample's random stream at the current dimension
+ */
+float sampler_next_1d(Sampler *s);
+
+/**
+ * Returns the next 2D dimension of this pixel's sample as a point of a
+ * sequence indexed by the sample number, so the N samples of a pixel are
+ * stratified against each other in every dimension (e.g. the image plane).
+ */
+Vec2 sampler_next_2d(Sampler *s);
+
+/**
+ * Returns a fresh sequence, decorrelated from every other pixel, sample and
+ * dimension, for when a single sample needs a whole point set at once (e.g.
+ * the shadow rays towards one area light)
+ */
+Sequence2D sampler_next_sequence(Sampler *s);
+
+/**
+ * Hashes the integers into a well mixed 32 bit value
+ */
+uint32_t sampler_hash(uint32_t seed, uint32_t a, uint32_t b, uint32_t c);
+
+#endif //RAYTRACERPROJ__SAMPLER_H_
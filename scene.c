@@ -1,6 +1,9 @@
+#define _USE_MATH_DEFINES
 #include "scene.h"
 #include "camera.h"
 #include "ppm_file.h"
+#include "shadow_map.h"
+#include "tracer.h"
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
@@ -19,8 +22,9 @@ int ray_intersects_object(Scene *scene, Ray *ray, Object *obj, Intersection *out
 
 // Find the best intersection of the ray with any object in the scene
 // If no intersection found, return an intersection with t of INFINITY
-Intersection scene_find_best_inter_ignore(Scene *scene, Ray *ray,
-                                          Object *ignore) {
+// Each test is counted in tests (indexed by ObjectType) unless it is NULL.
+static Intersection find_best_inter(Scene *scene, Ray *ray, Object *ignore,
+                                    uint64_t *tests) {
   Intersection best;
   best.t = INFINITY;
 
@@ -29,19 +33,52 @@ Intersection scene_find_best_inter_ignore(Scene *scene, Ray *ray,
     if (ignore == obj)
       continue;
 
+    if (tests)
+      tests[obj->type]++;
     Intersection inter = {0};
     if (ray_intersects_object(scene, ray, obj, &inter)) {
       if (inter.t > 0.01 && inter.t < best.t) {
         best = inter;
         best.obj = obj;
+        best.throughput = 1;
       }
     }
   }
   return best;
 }
 
+Intersection scene_find_best_inter_ignore(Scene *scene, Ray *ray,
+                                          Object *ignore) {
+  return find_best_inter(scene, ray, ignore, NULL);
+}
+
 Intersection scene_find_best_inter(Scene *scene, Ray *ray) {
-  return scene_find_best_inter_ignore(scene, ray, NULL);
+  return find_best_inter(scene, ray, NULL, NULL);
+}
+
+Intersection scene_closest_hit(TraceContext *ctx, Ray *ray, Object *ignore) {
+  return find_best_inter(ctx->scene, ray, ignore, ctx->stats.object_tests);
+}
+
+float scene_object_bounds(Scene *scene, Object *obj, Vec3 *center) {
+  switch (obj->type) {
+  case OBJECT_SPHERE:
+    *center = obj->sphere.center;
+    return obj->sphere.radius;
+  case OBJECT_CYLINDER: {
+    Cylinder *cyl = &obj->cyl;
+    *center = vecadd(cyl->center, vecmul(cyl->dir, cyl->height / 2));
+    return sqrt(cyl->radius * cyl->radius + cyl->height * cyl->height / 4);
+  }
+  default: {
+    Vec3 p[3];
+    for (int i = 0; i < 3; i++)
+      p[i] = scene->vertices[obj->tri.p[i]];
+    *center = vecdiv(vecadd(p[0], vecadd(p[1], p[2])), 3);
+    return sqrt(MAX(dist2(*center, p[0]), MAX(dist2(*center, p[1]),
+                                              dist2(*center, p[2]))));
+  }
+  }
 }
 
 static Color calc_diffuse_comp(Color diff_color, Intersection *in, Vec3 L) {
@@ -51,17 +88,20 @@ static Color calc_diffuse_comp(Color diff_color, Intersection *in, Vec3 L) {
   return result;
 }
 
-static Color calc_specular_comp(Scene *scene, Intersection *in, Vec3 L) {
+Color calc_specular_comp(Vec3 eye, Intersection *in, Vec3 L) {
   Color result = {0};
+  // A light behind the surface has no highlight either, even if H leans
+  // towards the normal
+  if (dot(L, in->norm) <= 0)
+    return result;
   Vec3 H = norm(
-    vecadd(L, norm(vecsub(scene->camera->eye_pos,
-                          in->pos)))); // L and viewdir are always unit length
+    vecadd(L, norm(vecsub(eye, in->pos)))); // L and viewdir are always unit length
   float factor = pow(MAX(dot(in->norm, H), 0), in->mat->n);
   result = vecadd(result, vecmul(in->mat->spec_color, in->mat->ks * factor));
   return result;
 }
 
-static Color apply_atten(Light *l, Color c, float dist2) {
+Color apply_atten(Light *l, Color c, float dist2) {
   float att_factor =
     1 / (l->att.x + l->att.y * sqrt(dist2) + l->att.z * dist2);
   if (att_factor > 1)
@@ -69,18 +109,18 @@ static Color apply_atten(Light *l, Color c, float dist2) {
   return vecmul(c, att_factor);
 }
 
-static Color apply_depth_cueing(Color c, DepthCue *dc, float dist) {
-  float a_dc;
+float scene_depth_cue_factor(DepthCue *dc, float dist) {
   if (dist <= dc->dist_min)
-    a_dc = dc->a_max;
-  else if (dist >= dc->dist_max)
-    a_dc = dc->a_min;
-  else {
-    a_dc = dc->a_min +
-           (dc->a_max - dc->a_min) *
-           ((dc->dist_max - dist) / (dc->dist_max - dc->dist_min));
-  }
+    return dc->a_max;
+  if (dist >= dc->dist_max)
+    return dc->a_min;
+  return dc->a_min +
+         (dc->a_max - dc->a_min) *
+         ((dc->dist_max - dist) / (dc->dist_max - dc->dist_min));
+}
 
+Color apply_depth_cueing(Color c, DepthCue *dc, float dist) {
+  float a_dc = scene_depth_cue_factor(dc, dist);
   return clamp(vecadd(vecmul(c, a_dc), vecmul(dc->color, 1 - a_dc)));
 }
 
@@ -89,126 +129,254 @@ static float find_ray_param_for_point_on_ray(Ray *r, Vec3 p_on_ray) {
     return (p_on_ray.x - r->pos.x) / r->dir.x;
   if (r->dir.y != 0)
     return (p_on_ray.y - r->pos.y) / r->dir.y;
-  if (r->dir.x != 0)
+  if (r->dir.z != 0)
     return (p_on_ray.z - r->pos.z) / r->dir.z;
   return 0;
 }
 
-// Return 0 if object is in a shadow, 1 otherwise
-static int calc_shadow_factor(Scene *scene, int is_positional, Vec3 L_pos,
-                              Vec3 L, Intersection *in) {
-  Ray shadow_ray;
-  shadow_ray.pos = in->pos;
-  shadow_ray.dir = L;
-
+static int blocks_ray(Scene *scene, Ray *ray, Object *obj, float max_t,
+                      uint64_t *tests) {
+  if (tests)
+    tests[obj->type]++;
+  Intersection inter = {0};
+  return ray_intersects_object(scene, ray, obj, &inter) &&
+         inter.t > 0.01 && inter.t < max_t;
+}
 
+static Object *find_occluder(Scene *scene, Ray *ray, float max_t, Object *ignore,
+                             uint64_t *tests) {
   for (int oid = 0; oid < scene->objects_len; oid++) {
     Object *obj = &scene->objects[oid];
-    if (obj == in->obj)
-      continue;
+    if (obj != ignore && blocks_ray(scene, ray, obj, max_t, tests))
+      return obj; // any occluder will do, no need to find the closest
+  }
+  return NULL;
+}
 
-    Intersection inter = {0};
-    if (ray_intersects_object(scene, &shadow_ray, obj, &inter)) {
-      if (is_positional)
-      {
-        float light_t = find_ray_param_for_point_on_ray(&shadow_ray, L_pos);
-        if (inter.t > light_t)
-        {
+Object *scene_find_occluder(Scene *scene, Ray *ray, float max_t, Object *ignore) {
+  return find_occluder(scene, ray, max_t, ignore, NULL);
+}
 
-        }
+int scene_occluded(Scene *scene, Ray *ray, float max_t, Object *ignore) {
+  return scene_find_occluder(scene, ray, max_t, ignore) != NULL;
+}
 
-      }
-      if (inter.t > 0.01 && inter.t < best.t) {
-        best = inter;
-        best.obj = obj;
+static void occluded_batch(Scene *scene, int count, const Ray *rays,
+                           const float *max_t, Object *ignore, Object **occluders,
+                           uint64_t *tests) {
+  int remaining = count;
+  for (int i = 0; i < count; i++)
+    occluders[i] = NULL;
+
+  // Objects in the outer loop, so each one is fetched once for all rays
+  for (int oid = 0; oid < scene->objects_len && remaining > 0; oid++) {
+    Object *obj = &scene->objects[oid];
+    if (obj == ignore)
+      continue;
+
+    for (int i = 0; i < count; i++) {
+      Ray ray = rays[i];
+      if (!occluders[i] && blocks_ray(scene, &ray, obj, max_t[i], tests)) {
+        occluders[i] = obj;
+        remaining--;
       }
     }
   }
-  return best;
+}
+
+void scene_occluded_batch(Scene *scene, int count, const Ray *rays,
+                          const float *max_t, Object *ignore, Object **occluders) {
+  occluded_batch(scene, count, rays, max_t, ignore, occluders, NULL);
+}
 
-  if (shadow_in.t == INFINITY)
+// Returns the cached occluder of light if it blocks ray, else NULL
+static Object *cached_occluder(TraceContext *ctx, Light *light, Ray *ray,
+                               float max_t, Object *ignore) {
+  size_t slot = (size_t) (light - ctx->scene->lights) % OCCLUDER_CACHE_SIZE;
+  Object *obj = ctx->occluders.occluders[slot];
+  ctx->stats.shadow_rays++;
+  if (ctx->occluders.lights[slot] != light || !obj || obj == ignore ||
+      !blocks_ray(ctx->scene, ray, obj, max_t, ctx->stats.object_tests))
+    return NULL;
+  ctx->stats.shadow_cache_hits++;
+  ctx->stats.shadow_occluded++;
+  return obj;
+}
+
+static void cache_occluder(TraceContext *ctx, Light *light, Object *obj) {
+  ctx->stats.shadow_occluded++;
+  size_t slot = (size_t) (light - ctx->scene->lights) % OCCLUDER_CACHE_SIZE;
+  ctx->occluders.lights[slot] = light;
+  ctx->occluders.occluders[slot] = obj;
+}
+
+int scene_shadow_occluded(TraceContext *ctx, Light *light, Ray *ray,
+                          float max_t, Object *ignore) {
+  if (cached_occluder(ctx, light, ray, max_t, ignore))
     return 1;
+  Object *obj = find_occluder(ctx->scene, ray, max_t, ignore, ctx->stats.object_tests);
+  if (obj)
+    cache_occluder(ctx, light, obj);
+  return obj != NULL;
+}
 
-  if (is_positional) {
-    float light_t = find_ray_param_for_point_on_ray(&shadow_ray, L_pos);
-    if (shadow_in.t > light_t)
-      return 1;
-    return 0;
+// Return 0 if object is in a shadow, 1 otherwise
+static int calc_shadow_factor(TraceContext *ctx, Light *light, Vec3 L_pos,
+                              Vec3 L, Intersection *in) {
+  Ray shadow_ray;
+  shadow_ray.pos = in->pos;
+  shadow_ray.dir = L;
+
+  // Occluders behind a point light don't cast a shadow
+  float light_t = INFINITY;
+  if (light->w)
+    light_t = find_ray_param_for_point_on_ray(&shadow_ray, L_pos);
+
+  return !scene_shadow_occluded(ctx, light, &shadow_ray, light_t, in->obj);
+}
+
+Ray scene_shadow_ray(Light *light, Intersection *in, float *max_t) {
+  Ray shadow_ray;
+  shadow_ray.pos = in->pos;
+  shadow_ray.dir = light->w ? norm(vecsub(light->pos, in->pos)) : vecinv(light->pos);
+  *max_t = light->w ? find_ray_param_for_point_on_ray(&shadow_ray, light->pos)
+                    : INFINITY;
+  return shadow_ray;
+}
+
+// Concentric mapping (Shirley & Chiu 1997) of [0, 1)^2 onto the unit disk,
+// which keeps stratified cells compact instead of stretching them
+static Vec2 concentric_disk(float u, float v) {
+  Vec2 result = {0};
+  float a = 2 * u - 1;
+  float b = 2 * v - 1;
+  if (a == 0 && b == 0)
+    return result;
+
+  float r, phi;
+  if (fabs(a) > fabs(b)) {
+    r = a;
+    phi = (M_PI / 4) * (b / a);
+  } else {
+    r = b;
+    phi = (M_PI / 2) - (M_PI / 4) * (a / b);
   }
-  return 0;
+  result.x = r * cos(phi);
+  result.y = r * sin(phi);
+  return result;
 }
 
-static float rand_sphere(float radius) {
-  return (-1 + 2 * ((float) rand() / RAND_MAX)) * radius;
-}
-
-static float calc_shadow_factor_smooth(Scene *scene, Light *light,
-                                        Intersection *in) {
-  // The radius of the spherical light source we sample from
-  float light_r = 0.5;
-  const int total_iters = 1;
-  int sum = 0;
-  if (total_iters > 1)
-  {
-    for (int i = 0; i < total_iters; i++) {
-      Vec3 random_offset = {rand_sphere(light_r), rand_sphere(light_r),
-                            rand_sphere(light_r)};
-      // We don't do soft shadows for directional lights (what does it mean?)
-      Vec3 L_pos = light->w ? vecadd(light->pos, random_offset) : light->pos;
-      Vec3 L = light->w ? norm(vecsub(L_pos, in->pos)) : vecinv(L_pos);
-      sum += calc_shadow_factor(scene, light->w, L_pos, L, in);
-    }
+// Casts shadow rays towards points [first, first + count) of seq mapped onto
+// the light's disk (facing the hit point) and returns how many reached the light
+static int sample_light_disk(TraceContext *ctx, Light *light, Intersection *in,
+                             Sequence2D *seq, int first, int count) {
+  Vec3 to_light = norm(vecsub(light->pos, in->pos));
+  Vec3 helper = fabs(to_light.x) < 0.9 ? (Vec3) {1, 0, 0} : (Vec3) {0, 1, 0};
+  Vec3 tangent = norm(cross(to_light, helper));
+  Vec3 bitangent = cross(to_light, tangent);
+
+  int lit = 0;
+  for (int i = first; i < first + count; i++) {
+    Vec2 uv = sequence2d_get(seq, i);
+    Vec2 d = concentric_disk(uv.x, uv.y);
+    Vec3 L_pos = vecadd(light->pos,
+                        vecadd(vecmul(tangent, d.x * light->radius),
+                               vecmul(bitangent, d.y * light->radius)));
+    lit += calc_shadow_factor(ctx, light, L_pos, norm(vecsub(L_pos, in->pos)), in);
   }
-  else {
+  return lit;
+}
+
+// Number of shadow rays cast before deciding whether a point is in the penumbra
+#define SHADOW_PROBES 4
+
+int scene_shadow_map_lookup(TraceContext *ctx, Light *light, Intersection *in) {
+  const ShadowMaps *maps = ctx->opts->shadow_maps;
+  if (!maps)
+    return SHADOW_MAP_UNKNOWN;
+  int visible = shadow_maps_lookup(maps, (int) (light - ctx->scene->lights),
+                                   in->pos, in->obj);
+  if (visible != SHADOW_MAP_UNKNOWN)
+    ctx->stats.shadow_map_hits++;
+  return visible;
+}
+
+// Point lights with a radius are treated as disks facing the hit point: a few probe rays, one per
+// quadrant of the disk, decide whether the point is fully lit or fully
+// occluded, and only points in the penumbra get the light's full sample count.
+// Probes and the remaining rays are prefixes of one Sobol sequence, so together
+// they stay stratified over the disk. Lights with no more samples than probes
+// just cast all of them.
+// Directional lights and lights without a radius give hard shadows.
+float scene_shadow_factor(TraceContext *ctx, Light *light, Intersection *in) {
+  if (!light->w || light->radius <= 0) {
+    int visible = scene_shadow_map_lookup(ctx, light, in);
+    if (visible != SHADOW_MAP_UNKNOWN)
+      return visible;
     Vec3 L = light->w ? norm(vecsub(light->pos, in->pos)) : vecinv(light->pos);
-    sum = calc_shadow_factor(scene, light->w, light->pos, L, in);
+    return calc_shadow_factor(ctx, light, light->pos, L, in);
   }
-  return (float) sum / total_iters;
+
+  Sequence2D seq = sampler_next_sequence(&ctx->sampler);
+  if (light->samples <= SHADOW_PROBES)
+    return (float) sample_light_disk(ctx, light, in, &seq, 0, light->samples) / light->samples;
+  int lit = sample_light_disk(ctx, light, in, &seq, 0, SHADOW_PROBES);
+  if (lit == 0 || lit == SHADOW_PROBES) {
+    ctx->stats.shadow_probe_exits++;
+    return (float) lit / SHADOW_PROBES;
+  }
+
+  lit += sample_light_disk(ctx, light, in, &seq, SHADOW_PROBES,
+                           light->samples - SHADOW_PROBES);
+  return (float) lit / light->samples;
 }
 
-#define MAX_REFLECT_DEPTH 12
+float scene_secondary_ray_weight(TraceContext *ctx, Intersection *in,
+                                 Color result, float factor,
+                                 float *throughput, float *survival) {
+  const RenderOptions *opts = ctx->opts;
+  float headroom = 1 - MIN(result.x, MIN(result.y, result.z));
+  *throughput = in->throughput * factor;
+  *survival = 1;
+  if (headroom <= 0 || *throughput < opts->min_throughput)
+    return 0;
 
-static Color sample_specular_reflection(Scene *scene, Ray *ray, Intersection *in)
-{
-  Color result = {0};
-  if (in->depth >= MAX_REFLECT_DEPTH)
-    return result;
+  if (opts->rr_depth > 0 && in->depth >= opts->rr_depth) {
+    float p = MIN(*throughput, 1);
+    if (sampler_next_1d(&ctx->sampler) >= p)
+      return 0;
+    *throughput /= p;
+    *survival = 1 / p;
+  }
+  return factor;
+}
+
+Color scene_add_secondary(Color result, Color c, float survival) {
+  Color bounded = clamp(result);
+  Color added = vecsub(clamp(vecadd(bounded, c)), bounded);
+  return vecadd(result, vecmul(added, survival));
+}
 
+float scene_reflection_ray(Ray *ray, Intersection *in, Ray *out) {
   Vec3 I = vecinv(ray->dir);
   float a = dot(in->norm, I);
   Vec3 R = vecsub(vecmul(in->norm, 2 * a), I);
 
-  Ray refl_ray = {
-      .dir = R,
-      .pos = vecadd(in->pos, vecmul(in->norm, 0.01))
-  };
-
-  Intersection new_in = scene_find_best_inter_ignore(scene, &refl_ray, in->obj);
-  if (new_in.t == INFINITY)
-    return result;
-  new_in.depth = in->depth + 1;
+  out->dir = R;
+  out->pos = vecadd(in->pos, vecmul(in->norm, 0.01));
 
-  result = scene_shade_ray(scene, &refl_ray, &new_in);
   float refr_idx = in->mat->idx_of_refraction;
   float f0 = ((refr_idx - 1)/(refr_idx + 1));
   f0 = f0 * f0;
-  float fr = f0 + (1 - f0) * pow(1 - dot(I, in->norm), 5);
-  return clamp(vecmul(result, fr));
+  return f0 + (1 - f0) * pow(1 - a, 5);
 }
 
-#define MAX_REFRACT_DEPTH 3
-
 static float get_refra_idx(Material *mat)
 {
   return mat == NULL ? 1 : mat->idx_of_refraction;
 }
 
-static Color sample_refraction(Scene *scene, Ray *ray, Intersection *in)
-{
-  Color result = {0};
-  if (in->depth >= MAX_REFRACT_DEPTH)
-    return result;
-
+float scene_refraction_ray(Ray *ray, Intersection *in, Ray *out) {
   Vec3 I = vecinv(ray->dir);
   Vec3 aligned_norm = in->norm;
   if (dot(in->norm, I) < 0)
@@ -223,67 +391,260 @@ static Color sample_refraction(Scene *scene, Ray *ray, Intersection *in)
   Vec3 A = vecmul(vecinv(aligned_norm), cos_theta_t);
   Vec3 B = vecmul((vecsub(vecmul(aligned_norm, cos_theta_i), I)), snell);
   Vec3 T = vecadd(A, B);
-  Ray new_ray = {
-  	.dir = T,
-  	.pos = vecadd(in->pos, vecmul(T, 0.01))
-  };
+  out->dir = T;
+  out->pos = vecadd(in->pos, vecmul(T, 0.01));
+
+  float f0 = ((idx_t - idx_i)/(idx_t + idx_i));
+  f0 = f0 * f0;
+  float fr = f0 + (1 - f0) * pow(1 - cos_theta_i, 5);
+  return (1 - fr) * (1 - in->mat->opacity);
+}
+
+// The color of in with its mirror reflection added to local
+static Color sample_specular_reflection(TraceContext *ctx, Ray *ray,
+                                        Intersection *in, Color local)
+{
+  if (in->depth >= ctx->opts->max_reflect_depth)
+    return local;
+
+  // The Fresnel term only depends on the geometry, so we know how much the
+  // reflection can contribute before tracing it
+  Ray refl_ray;
+  float fr = scene_reflection_ray(ray, in, &refl_ray);
+  float throughput, survival;
+  float weight = scene_secondary_ray_weight(ctx, in, clamp(local), fr, &throughput, &survival);
+  if (weight == 0)
+    return local;
+
+  ctx->stats.reflection_rays++;
+  Intersection new_in = scene_closest_hit(ctx, &refl_ray, in->obj);
+  if (new_in.t == INFINITY)
+    return local;
+  new_in.depth = in->depth + 1;
+  new_in.throughput = throughput;
 
-  Intersection new_in = scene_find_best_inter(scene, &new_ray);
+  Color result = scene_shade_ray(ctx, &refl_ray, &new_in);
+  return scene_add_secondary(local, clamp(vecmul(result, weight)), survival);
+}
+
+// The color of in with the light it lets through added to local
+static Color sample_refraction(TraceContext *ctx, Ray *ray, Intersection *in,
+                               Color local)
+{
+  if (in->depth >= ctx->opts->max_refract_depth)
+    return local;
+
+  Ray new_ray;
+  float transmission = scene_refraction_ray(ray, in, &new_ray);
+  float throughput, survival;
+  float weight =
+    scene_secondary_ray_weight(ctx, in, clamp(local), transmission, &throughput, &survival);
+  if (weight == 0)
+    return local;
+
+  ctx->stats.refraction_rays++;
+  Intersection new_in = scene_closest_hit(ctx, &new_ray, NULL);
   if (new_in.t == INFINITY)
-	return result;
+	return local;
   new_in.depth = in->depth + 1;
+  new_in.throughput = throughput;
   // We do a simple alternation between air and the previously intersected material
   new_in.from_mat = in->from_mat == NULL ? in->mat : NULL;
 
-  result = scene_shade_ray(scene, &new_ray, &new_in);
-  float f0 = ((idx_t - idx_i)/(idx_t + idx_i));
-  f0 = f0 * f0;
-  float fr = f0 + (1 - f0) * pow(1 - cos_theta_i, 5);
-  result = vecmul(result, 1 - fr);
-  result = vecmul(result, 1 - in->mat->opacity);
-  return clamp(result);
+  Color result = scene_shade_ray(ctx, &new_ray, &new_in);
+  return scene_add_secondary(local, clamp(vecmul(result, weight)), survival);
 }
 
-Color scene_shade_ray(Scene *scene, Ray *ray, Intersection *in) {
-  Color result;
-  Color diff_color = in->mat->diffuse_color;
-  if (in->has_tex_coords)
-    diff_color = pixel_map_nearest_lookup(in->mat->texture, in->tex_coords);
+// Upper bound of the light's unshadowed contribution at pos
+static float light_importance(Light *light, Vec3 pos) {
+  Color c = light->color;
+  if (light->is_attenuated && veclen2(light->att) > 0)
+    c = apply_atten(light, c, dist2(light->pos, pos));
+  return MAX(c.x, MAX(c.y, c.z));
+}
 
-  result = vecmul(diff_color, in->mat->ka);
-  for (int i = 0; i < scene->lights_len; i++) {
+void scene_lights_begin(TraceContext *ctx, Intersection *in, LightLoop *loop) {
+  Scene *scene = ctx->scene;
+  int max_lights = ctx->opts->light_samples;
+  light_tree_begin(&scene->light_tree, scene->lights, in->pos, &loop->it);
+  loop->step = 0;
+  if (max_lights <= 0)
+    return;
+
+  float total = 0;
+  int count = 0;
+  for (int i; (i = light_tree_next(&loop->it)) >= 0; count++)
+    total += light_importance(&scene->lights[i], in->pos);
+  ctx->stats.light_nodes += loop->it.visited;
+  light_tree_begin(&scene->light_tree, scene->lights, in->pos, &loop->it);
+  if (count <= max_lights || total <= 0)
+    return;
+
+  // Stratified picks: one every step along the summed brightness, starting
+  // at a random offset
+  loop->step = total / max_lights;
+  loop->next_pick = sampler_next_1d(&ctx->sampler) * loop->step;
+  loop->sum = 0;
+}
+
+Light *scene_lights_next(TraceContext *ctx, Intersection *in, LightLoop *loop,
+                         float *weight) {
+  Scene *scene = ctx->scene;
+  for (int i; (i = light_tree_next(&loop->it)) >= 0;) {
     Light *light = &scene->lights[i];
-    Vec3 L = light->w ? norm(vecsub(light->pos, in->pos)) : vecinv(light->pos);
+    if (loop->step == 0) {
+      *weight = 1;
+      return light;
+    }
 
-    // Blinn-phong
-    Color non_amb_color = {0};
-    non_amb_color = clamp(vecadd(non_amb_color, calc_diffuse_comp(diff_color, in, L)));
+    float importance = light_importance(light, in->pos);
+    int picks = 0;
+    loop->sum += importance;
+    while (loop->next_pick < loop->sum) {
+      picks++;
+      loop->next_pick += loop->step;
+    }
+    if (picks > 0) {
+      *weight = picks * loop->step / importance;
+      return light;
+    }
+  }
+  ctx->stats.light_nodes += loop->it.visited;
+  return NULL;
+}
+
+Color scene_surface_color(Intersection *in) {
+  if (in->has_tex_coords)
+    return pixel_map_nearest_lookup(in->mat->texture, in->tex_coords);
+  return in->mat->diffuse_color;
+}
+
+Color scene_light_contribution(TraceContext *ctx, Intersection *in,
+                               Light *light, Color diff_color) {
+  Vec3 L = light->w ? norm(vecsub(light->pos, in->pos)) : vecinv(light->pos);
+
+  // Blinn-phong
+  Color non_amb_color = {0};
+  non_amb_color = clamp(vecadd(non_amb_color, calc_diffuse_comp(diff_color, in, L)));
+  non_amb_color = clamp(
+    vecadd(non_amb_color, calc_specular_comp(ctx->camera->eye_pos, in, L)));
+  non_amb_color = elemmul(non_amb_color, light->color);
+
+  // Attenuation
+  if (light->is_attenuated && veclen2(light->att) > 0)
     non_amb_color =
-      clamp(vecadd(non_amb_color, calc_specular_comp(scene, in, L)));
-    non_amb_color = elemmul(non_amb_color, light->color);
+      apply_atten(light, non_amb_color, dist2(light->pos, in->pos));
+  return non_amb_color;
+}
+
+// Whether adding c to result can still change the clamped color
+static int can_brighten(Color result, Color c) {
+  return (c.x > 0 && result.x < 1) || (c.y > 0 && result.y < 1) ||
+         (c.z > 0 && result.z < 1);
+}
+
+// Adds the lights of the batch that aren't occluded to result
+static Color resolve_shadow_batch(TraceContext *ctx, Intersection *in,
+                                  ShadowBatch *batch, Color result) {
+  Object *occluders[SHADOW_BATCH];
+  int count = 0;
+  for (int i = 0; i < batch->len; i++) {
+    // Brighter lights in the batch may already have saturated the color
+    if (!can_brighten(result, batch->colors[i])) {
+      ctx->stats.shadow_skipped++;
+      continue;
+    }
+    if (cached_occluder(ctx, batch->lights[i], &batch->rays[i],
+                        batch->max_t[i], in->obj))
+      continue;
+    batch->rays[count] = batch->rays[i];
+    batch->max_t[count] = batch->max_t[i];
+    batch->colors[count] = batch->colors[i];
+    batch->lights[count] = batch->lights[i];
+    count++;
+  }
+
+  occluded_batch(ctx->scene, count, batch->rays, batch->max_t, in->obj,
+                 occluders, ctx->stats.object_tests);
+  for (int i = 0; i < count; i++) {
+    if (occluders[i])
+      cache_occluder(ctx, batch->lights[i], occluders[i]);
+    else
+      result = clamp(vecadd(result, batch->colors[i]));
+  }
+  batch->len = 0;
+  return result;
+}
+
+Color scene_shade_ray(TraceContext *ctx, Ray *ray, Intersection *in) {
+  return scene_shade_ray_visibility(ctx, ray, in, NULL);
+}
 
-    // Shadow rays
-    float shadow_factor = calc_shadow_factor_smooth(scene, light, in);
-    non_amb_color = vecmul(non_amb_color, shadow_factor);
+Color scene_shade_ray_visibility(TraceContext *ctx, Ray *ray, Intersection *in,
+                                 const float *visibility) {
+  Scene *scene = ctx->scene;
+  Vec3 eye = ctx->camera->eye_pos;
+  Color result;
+  Color diff_color = scene_surface_color(in);
+
+  result = vecmul(diff_color, in->mat->ka);
 
-    // Attenuation
-    if (light->is_attenuated && veclen2(light->att) > 0)
-      non_amb_color =
-        apply_atten(light, non_amb_color, dist2(light->pos, in->pos));
+  // Evaluate the lights unshadowed first and only cast shadow rays for the
+  // ones that can still change the color. Hard shadow rays are collected and
+  // tested against the scene together.
+  ShadowBatch batch;
+  batch.len = 0;
+  LightLoop lights;
+  scene_lights_begin(ctx, in, &lights);
+  Light *light;
+  float light_weight;
+  while ((light = scene_lights_next(ctx, in, &lights, &light_weight))) {
+    Color non_amb_color = vecmul(
+      scene_light_contribution(ctx, in, light, diff_color), light_weight);
+    // Back facing, attenuated away or no diffuse and specular reflection
+    if (!can_brighten(result, non_amb_color)) {
+      ctx->stats.shadow_skipped++;
+      continue;
+    }
+
+    if (visibility) {
+      float shadow_factor = visibility[light - scene->lights];
+      result = clamp(vecadd(result, vecmul(non_amb_color, shadow_factor)));
+      continue;
+    }
+
+    if (light->w && light->radius > 0) {
+      float shadow_factor = scene_shadow_factor(ctx, light, in);
+      result = clamp(vecadd(result, vecmul(non_amb_color, shadow_factor)));
+      continue;
+    }
+
+    int visible = scene_shadow_map_lookup(ctx, light, in);
+    if (visible != SHADOW_MAP_UNKNOWN) {
+      if (visible)
+        result = clamp(vecadd(result, non_amb_color));
+      continue;
+    }
 
-    result = clamp(vecadd(result, non_amb_color));
+    batch.rays[batch.len] = scene_shadow_ray(light, in, &batch.max_t[batch.len]);
+    batch.colors[batch.len] = non_amb_color;
+    batch.lights[batch.len] = light;
+    if (++batch.len == SHADOW_BATCH)
+      result = resolve_shadow_batch(ctx, in, &batch, result);
   }
+  if (batch.len > 0)
+    result = resolve_shadow_batch(ctx, in, &batch, result);
 
   // Depth cueing
   if (scene->depth_cueing_enabled) {
     result = apply_depth_cueing(result, &scene->depth_cueing,
-                                sqrt(dist2(in->pos, scene->camera->eye_pos)));
+                                sqrt(dist2(in->pos, eye)));
   }
 
   // Reflection
-  result = clamp(vecadd(result, sample_specular_reflection(scene, ray, in)));
+  result = sample_specular_reflection(ctx, ray, in, result);
   if (in->mat->opacity < 1)
-    result = clamp(vecadd(result, sample_refraction(scene, ray, in)));
+    result = sample_refraction(ctx, ray, in, result);
 
   return result;
 }
@@ -1,6 +1,9 @@
 #ifndef RAYTRACERPROJ__SCENE_DESC_H
 #define RAYTRACERPROJ__SCENE_DESC_H
 
+#include "light_tree.h"
+#include "sampler.h"
+#include "stats.h"
 #include "vec.h"
 #include <stdint.h>
 #include <stddef.h>
@@ -76,6 +79,7 @@ typedef struct Intersection {
   Vec2 tex_coords;
   int depth; // number of times the ray from this intersection has been reflected
   Material *from_mat; // the material that this intersection is from, NULL if air
+  float throughput; // upper bound on the fraction of this hit's color that reaches the pixel
 } Intersection;
 
 typedef struct Light {
@@ -84,6 +88,9 @@ typedef struct Light {
   Color color;
   int is_attenuated;
   Vec3 att;
+  float radius; // point lights with a radius are area lights and cast soft shadows
+  int samples; // shadow rays per intersection for area lights
+  float reach; // distance beyond which the light is too dim to see, see light_tree.h
 } Light;
 
 typedef struct DepthCue {
@@ -92,6 +99,16 @@ typedef struct DepthCue {
   float dist_min, dist_max;
 } DepthCue;
 
+// A named camera besides the scene's main one (eye, viewdir, updir, hfov)
+#define SCENE_CAMERA_NAME 32
+typedef struct SceneCamera {
+  char name[SCENE_CAMERA_NAME];
+  Vec3 eye;
+  Vec3 viewdir;
+  Vec3 updir;
+  float fov_h;
+} SceneCamera;
+
 typedef struct Scene {
   Vec3 eye;
   Vec3 viewdir;
@@ -99,7 +116,6 @@ typedef struct Scene {
   float fov_h;
   int pixel_width, pixel_height;
   Color bg_color;
-  struct Camera *camera;
 
   Material *palette;
   size_t palette_cap;
@@ -112,6 +128,7 @@ typedef struct Scene {
   Light *lights;
   size_t lights_cap;
   size_t lights_len;
+  LightTree light_tree;
 
   Vec3 *vertices;
   size_t vert_cap;
@@ -131,11 +148,40 @@ typedef struct Scene {
 
   int depth_cueing_enabled;
   DepthCue depth_cueing;
+
+  SceneCamera *cameras;
+  size_t cameras_cap;
+  size_t cameras_len;
+
+  // Wall time scene_create_from_file spent on these, for RunStats
+  double texture_seconds;
+  double light_tree_seconds;
 } Scene;
 
+// The object that last blocked a shadow ray towards a light, direct mapped on
+// the light's index. Neighboring shadow rays towards the same light are
+// usually blocked by the same object, which is tested before the others.
+#define OCCLUDER_CACHE_SIZE 64
+typedef struct OccluderCache {
+  const Light *lights[OCCLUDER_CACHE_SIZE];
+  Object *occluders[OCCLUDER_CACHE_SIZE];
+} OccluderCache;
+
+// Per-render state threaded through shading. Nothing in here is shared, so
+// any number of contexts can shade the same (read-only) Scene concurrently.
+typedef struct TraceContext {
+  Scene *scene;
+  struct Camera *camera;
+  const struct RenderOptions *opts;
+  Sampler sampler; // restarted for every camera sample
+  RenderStats stats;
+  OccluderCache occluders;
+} TraceContext;
+
 Material *scene_add_material(Scene *scene);
 Object *scene_add_object(Scene *scene);
 Light *scene_add_light(Scene *scene);
+SceneCamera *scene_add_camera(Scene *scene);
 Vec3 *scene_add_vertex(Scene *scene);
 Vec3 *scene_add_norm(Scene *scene);
 Vec2 *scene_add_tex(Scene *scene);
@@ -147,7 +193,101 @@ int ray_intersects_cylinder(Scene *scene, Ray *ray, Cylinder *sphere, Intersecti
 int ray_intersects_triangle(Scene  *scene, Ray *ray, Triangle *tri, Intersection *out);
 
 Intersection scene_find_best_inter(Scene *scene, Ray *ray);
-Color scene_shade_ray(Scene *scene, Ray *ray, Intersection *in);
+Intersection scene_find_best_inter_ignore(Scene *scene, Ray *ray, Object *ignore);
+// scene_find_best_inter_ignore counting the intersection tests in ctx->stats
+Intersection scene_closest_hit(TraceContext *ctx, Ray *ray, Object *ignore);
+// Returns the radius of a sphere around obj and sets *center to its center
+float scene_object_bounds(Scene *scene, Object *obj, Vec3 *center);
+// Returns any object but ignore hit by ray between 0.01 and max_t, or NULL
+Object *scene_find_occluder(Scene *scene, Ray *ray, float max_t, Object *ignore);
+// Returns 1 if any object but ignore is hit by ray between 0.01 and max_t
+int scene_occluded(Scene *scene, Ray *ray, float max_t, Object *ignore);
+// scene_find_occluder for count rays at once, setting occluders[i] for each
+void scene_occluded_batch(Scene *scene, int count, const Ray *rays,
+                          const float *max_t, Object *ignore, Object **occluders);
+// scene_occluded for a shadow ray towards light, trying the object that last
+// blocked light first and counting the ray in ctx->stats
+int scene_shadow_occluded(TraceContext *ctx, Light *light, Ray *ray,
+                          float max_t, Object *ignore);
+
+// Hard shadow rays of one hit point waiting to be tested together
+#define SHADOW_BATCH 16
+typedef struct ShadowBatch {
+  Ray rays[SHADOW_BATCH];
+  float max_t[SHADOW_BATCH];
+  Color colors[SHADOW_BATCH]; // unshadowed contribution of each light
+  Light *lights[SHADOW_BATCH];
+  int len;
+} ShadowBatch;
+
+// Shades the intersection, tracing shadow, reflection and refraction rays
+Color scene_shade_ray(TraceContext *ctx, Ray *ray, Intersection *in);
+// scene_shade_ray with the shadow factor of every light at in given by
+// visibility (indexed like scene->lights) instead of tracing shadow rays for
+// it. Secondary hits are shaded as usual. NULL traces shadow rays.
+Color scene_shade_ray_visibility(TraceContext *ctx, Ray *ray, Intersection *in,
+                                 const float *visibility);
+
+// The pieces scene_shade_ray is made of, for renderers that schedule the
+// secondary rays themselves
+
+// Enumerates the lights that reach a hit point. With opts->light_samples set
+// and more lights than that in reach, only light_samples picks are made, in
+// proportion to each light's unshadowed brightness, and the picked lights are
+// weighted so the expected sum stays the same.
+typedef struct LightLoop {
+  LightIter it;
+  float step; // brightness between two picks, 0 to return every light
+  float next_pick;
+  float sum; // brightness of the lights walked so far
+} LightLoop;
+
+void scene_lights_begin(TraceContext *ctx, Intersection *in, LightLoop *loop);
+// Returns the next light and its weight, NULL once done
+Light *scene_lights_next(TraceContext *ctx, Intersection *in, LightLoop *loop,
+                         float *weight);
+
+// Diffuse color at the intersection, from the texture if there is one
+Color scene_surface_color(Intersection *in);
+// Blinn-Phong contribution of light at in (attenuated, but not shadowed)
+Color scene_light_contribution(TraceContext *ctx, Intersection *in,
+                               Light *light, Color diff_color);
+// Specular term of scene_light_contribution for the unit direction L to the light
+Color calc_specular_comp(Vec3 eye, Intersection *in, Vec3 L);
+// c dimmed by the light's attenuation at squared distance dist2, never brightened
+Color apply_atten(Light *l, Color c, float dist2);
+// Fraction of light that reaches in, casting as many shadow rays as needed
+float scene_shadow_factor(TraceContext *ctx, Light *light, Intersection *in);
+// Visibility of light from in according to opts->shadow_maps: SHADOW_MAP_LIT,
+// SHADOW_MAP_OCCLUDED or SHADOW_MAP_UNKNOWN if a shadow ray is needed
+int scene_shadow_map_lookup(TraceContext *ctx, Light *light, Intersection *in);
+// The hard shadow ray from in towards light; anything hit closer than *max_t
+// occludes the light
+Ray scene_shadow_ray(Light *light, Intersection *in, float *max_t);
+// Weight of the scene's color at distance dist, the fog gets 1 - this
+float scene_depth_cue_factor(DepthCue *dc, float dist);
+// c blended with the fog color by scene_depth_cue_factor
+Color apply_depth_cueing(Color c, DepthCue *dc, float dist);
+// Decides whether a secondary ray from in, whose color contributes factor
+// times to in's color, is worth tracing. Rays that can't change the pixel by
+// more than min_throughput are skipped, as are rays towards a color that is
+// already saturated. Past rr_depth the remaining paths are continued with a
+// probability equal to their throughput (Russian roulette).
+// Returns the weight to apply to the secondary ray's color (0 to skip it),
+// sets *throughput to the throughput of the secondary hit and *survival to
+// the 1 / p the surviving paths are scaled by, see scene_add_secondary.
+float scene_secondary_ray_weight(TraceContext *ctx, Intersection *in, Color result,
+                                 float factor, float *throughput, float *survival);
+// Adds the weighted color c of a secondary ray that survived the roulette
+// with probability 1 / survival to result. The sum is clamped as it would be
+// without roulette and only the part c adds is scaled up, so on average the
+// color is the same. result can go above 1 this way, the caller's clamps and
+// the conversion to 8 bits take care of that.
+Color scene_add_secondary(Color result, Color c, float survival);
+// Sets out to the mirror reflection of ray at in and returns its Fresnel weight
+float scene_reflection_ray(Ray *ray, Intersection *in, Ray *out);
+// Sets out to the refraction of ray at in and returns its weight
+float scene_refraction_ray(Ray *ray, Intersection *in, Ray *out);
 
 void scene_destroy(Scene *s);
 
@@ -31,25 +31,43 @@ static ParseLineResult read_color(const char *body, Color *out) {
 static int read_mat(const char *body, Material *out) {
   Material c = {0};
   int end;
-  int rc = sscanf(body, "%f %f %f %f %f %f %f %f %f %d %f %f%n",
+  int rc = sscanf(body, "%f %f %f %f %f %f %f %f %f %d%n",
                   &c.diffuse_color.x, &c.diffuse_color.y, &c.diffuse_color.z,
                   &c.spec_color.x, &c.spec_color.y, &c.spec_color.z, &c.ka,
-                  &c.kd, &c.ks, &c.n, &c.opacity, &c.idx_of_refraction, &end);
-  if (rc == 12 && isend(body[end])) {
-    *out = c;
-    return LINE_OK;
+                  &c.kd, &c.ks, &c.n, &end);
+  if (rc != 10)
+    return INVALID_FORMAT;
+
+  // Opacity and index of refraction are optional, older scenes are opaque
+  c.opacity = 1;
+  c.idx_of_refraction = 1;
+  if (!isend(body[end])) {
+    body += end;
+    rc = sscanf(body, "%f %f%n", &c.opacity, &c.idx_of_refraction, &end);
+    if (rc != 2 || !isend(body[end]))
+      return INVALID_FORMAT;
   }
-  return INVALID_FORMAT;
+  *out = c;
+  return LINE_OK;
+}
+
+// Area light parameters are optional and follow the light's regular ones
+static int read_light_area(Light *light, const char *body) {
+  int end;
+  int rc = sscanf(body, "%f %d%n", &light->radius, &light->samples, &end);
+  if (rc != 2 || !isend(body[end]) || light->radius < 0 || light->samples < 1)
+    return INVALID_FORMAT;
+  return LINE_OK;
 }
 
 static int read_light(Scene *scene, const char *body) {
   Light light = {0};
   int end;
-  int rc = sscanf(body, "%f %f %f %d %f %f %f%n\n", &light.pos.x,
+  int rc = sscanf(body, "%f %f %f %d %f %f %f%n", &light.pos.x,
                   &light.pos.y, &light.pos.z, &light.w, &light.color.x,
                   &light.color.y, &light.color.z, &end);
 
-  if (rc != 7 || !isend(body[end]))
+  if (rc != 7 || (!isend(body[end]) && read_light_area(&light, body + end) != LINE_OK))
     return INVALID_FORMAT;
 
   Light *new_light = scene_add_light(scene);
@@ -62,12 +80,12 @@ static int read_light(Scene *scene, const char *body) {
 static int read_att_light(Scene *scene, const char *body) {
   Light light = {0};
   int end;
-  int rc = sscanf(body, "%f %f %f %d %f %f %f %f %f %f%n\n",
+  int rc = sscanf(body, "%f %f %f %d %f %f %f %f %f %f%n",
                   &light.pos.x, &light.pos.y, &light.pos.z, &light.w,
                   &light.color.x, &light.color.y, &light.color.z, &light.att.x,
                   &light.att.y, &light.att.z, &end);
 
-  if (rc != 10 || !isend(body[end]))
+  if (rc != 10 || (!isend(body[end]) && read_light_area(&light, body + end) != LINE_OK))
     return INVALID_FORMAT;
 
   Light *new_light = scene_add_light(scene);
@@ -88,6 +106,11 @@ static int read_sphere(Scene *scene, const char *body, Material *curr_color) {
   if (rc != 4 || !isend(body[end]))
     return INVALID_FORMAT;
 
+  if (!curr_color) {
+    fprintf(stderr, "must specify material before sphere\n");
+    return INVALID_FORMAT;
+  }
+
   Object *new_obj = scene_add_object(scene);
   new_obj->type = OBJECT_SPHERE;
   Sphere *new_sphere = &new_obj->sphere;
@@ -110,6 +133,11 @@ static int read_cylinder(Scene *scene, const char *body, Material *curr_color) {
   if (rc != 8 || !isend(body[end]))
     return INVALID_FORMAT;
 
+  if (!curr_color) {
+    fprintf(stderr, "must specify material before cylinder\n");
+    return INVALID_FORMAT;
+  }
+
   Object *new_obj = scene_add_object(scene);
   new_obj->type = OBJECT_CYLINDER;
   Cylinder *new_cyl = &new_obj->cyl;
@@ -121,6 +149,30 @@ static int read_cylinder(Scene *scene, const char *body, Material *curr_color) {
   return LINE_OK;
 }
 
+static int read_camera(Scene *scene, const char *body) {
+  SceneCamera camera = {0};
+  int end;
+  int rc = sscanf(body, "%31s %f %f %f %f %f %f %f %f %f %f%n", camera.name,
+                  &camera.eye.x, &camera.eye.y, &camera.eye.z,
+                  &camera.viewdir.x, &camera.viewdir.y, &camera.viewdir.z,
+                  &camera.updir.x, &camera.updir.y, &camera.updir.z,
+                  &camera.fov_h, &end);
+  if (rc != 11 || !isend(body[end]))
+    return INVALID_FORMAT;
+  if (strcmp(camera.name, "main") == 0) {
+    fprintf(stderr, "camera name 'main' is reserved for the eye/viewdir camera\n");
+    return INVALID_FORMAT;
+  }
+  for (size_t i = 0; i < scene->cameras_len; i++) {
+    if (strcmp(scene->cameras[i].name, camera.name) == 0) {
+      fprintf(stderr, "camera '%s' defined twice\n", camera.name);
+      return INVALID_FORMAT;
+    }
+  }
+  *scene_add_camera(scene) = camera;
+  return LINE_OK;
+}
+
 static int read_depth_cue(const char *body, DepthCue *out) {
   DepthCue cue;
   int end;
@@ -277,7 +329,9 @@ static int read_texture(Scene *scene, const char *body, Material *curr_mat)
     return INVALID_FORMAT;
 
   PixelMap *texture;
+  double begin = stats_clock();
   rc = pixel_map_read_from_file(file_path, &texture);
+  scene->texture_seconds += stats_clock() - begin;
   if (rc != 0)
   {
     fprintf(stderr, "failed to load texture '%s' with error %s\n", file_path, strerror(rc));
@@ -305,6 +359,13 @@ typedef struct SceneConfig {
   char object;
 } SceneConfig;
 
+// Everything the parser carries from one line to the next. Lives on the stack
+// of scene_create_from_file so that parsing is re-entrant.
+typedef struct ParseContext {
+  SceneConfig config;
+  Material *curr_mtl_color; // applies to every object until the next mtlcolor
+} ParseContext;
+
 #define VERIFY_CONFIG(cfg, param)                                              \
   do {                                                                         \
     if ((cfg)->param == 0) {                                                   \
@@ -332,9 +393,9 @@ static int scene_verify_valid(Scene *scene, SceneConfig *config) {
   return 1;
 }
 
-static int parse_desc_line(Scene *scene, SceneConfig *config, const char *tag,
+static int parse_desc_line(Scene *scene, ParseContext *pctx, const char *tag,
                            const char *body) {
-  static Material *curr_mtl_color = NULL;
+  SceneConfig *config = &pctx->config;
   int end;
 
   int rc;
@@ -361,13 +422,18 @@ static int parse_desc_line(Scene *scene, SceneConfig *config, const char *tag,
     rc = read_color(body, &scene->bg_color);
     config->bkgcolor = 1;
   } else if (strcmp(tag, "mtlcolor") == 0) {
-    curr_mtl_color = scene_add_material(scene);
-    rc = read_mat(body, curr_mtl_color);
+    pctx->curr_mtl_color = scene_add_material(scene);
+    if (!pctx->curr_mtl_color) {
+      fprintf(stderr, "too many materials, at most %zu are supported\n", scene->palette_cap);
+      rc = INVALID_FORMAT;
+    } else {
+      rc = read_mat(body, pctx->curr_mtl_color);
+    }
   } else if (strcmp(tag, "sphere") == 0) {
-    rc = read_sphere(scene, body, curr_mtl_color);
+    rc = read_sphere(scene, body, pctx->curr_mtl_color);
     config->object = 1;
   } else if (strcmp(tag, "cylinder") == 0) {
-    rc = read_cylinder(scene, body, curr_mtl_color);
+    rc = read_cylinder(scene, body, pctx->curr_mtl_color);
     config->object = 1;
   } else if (strcmp(tag, "light") == 0) {
     rc = read_light(scene, body);
@@ -383,15 +449,28 @@ static int parse_desc_line(Scene *scene, SceneConfig *config, const char *tag,
   } else if (strcmp(tag, "vt") == 0) {
     rc = read_vertex_texture(scene, body);
   } else if (strcmp(tag, "f") == 0) {
-    rc = read_triangle(scene, body, curr_mtl_color);
+    rc = read_triangle(scene, body, pctx->curr_mtl_color);
+  } else if (strcmp(tag, "camera") == 0) {
+    rc = read_camera(scene, body);
   } else if (strcmp(tag, "texture") == 0) {
-    rc = read_texture(scene, body, curr_mtl_color);
+    rc = read_texture(scene, body, pctx->curr_mtl_color);
   } else {
     rc = UNRECOGNIZED_TAG;
   }
   return rc;
 }
 
+static int scene_build_light_tree(Scene *scene) {
+  double begin = stats_clock();
+  for (size_t i = 0; i < scene->lights_len; i++)
+    scene->lights[i].reach = light_reach(&scene->lights[i]);
+  int rc = light_tree_build(&scene->light_tree, scene->lights, scene->lights_len);
+  scene->light_tree_seconds = stats_clock() - begin;
+  if (rc != 0)
+    fprintf(stderr, "failed to build light tree: %s\n", strerror(rc));
+  return rc;
+}
+
 Scene *scene_create_from_file(const char *scene_desc_file_path) {
   FILE *fdesc_file = fopen(scene_desc_file_path, "r");
   if (!fdesc_file) {
@@ -404,7 +483,7 @@ Scene *scene_create_from_file(const char *scene_desc_file_path) {
   Scene *scene = calloc(1, sizeof(Scene));
   size_t line_no = 1;
 
-  SceneConfig config = {0};
+  ParseContext pctx = {0};
   char line[256];
   while (fgets(line, sizeof(line), fdesc_file)) {
     if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
@@ -425,7 +504,7 @@ Scene *scene_create_from_file(const char *scene_desc_file_path) {
       }
 
       const char *args = line + strlen(tag);
-      rc = parse_desc_line(scene, &config, tag, args);
+      rc = parse_desc_line(scene, &pctx, tag, args);
       switch (rc) {
       case UNRECOGNIZED_TAG: {
         fprintf(stderr,
@@ -447,7 +526,9 @@ Scene *scene_create_from_file(const char *scene_desc_file_path) {
     line_no++;
   }
 
-  if (!scene_verify_valid(scene, &config))
+  if (!scene_verify_valid(scene, &pctx.config))
+    rc = INVALID_FORMAT;
+  else if (scene_build_light_tree(scene) != 0)
     rc = INVALID_FORMAT;
 
 cleanup:
@@ -464,12 +545,14 @@ void scene_destroy(Scene *s) {
   free(s->objects);
   free(s->palette);
   free(s->lights);
+  light_tree_destroy(&s->light_tree);
   free(s->vertices);
   free(s->normals);
   free(s->texs);
   for (int i = 0; i < s->texture_maps_len; i++)
     pixel_map_destroy(s->texture_maps[i]);
   free(s->texture_maps);
+  free(s->cameras);
   free(s);
 }
 
@@ -479,6 +562,10 @@ Object *scene_add_object(Scene *scene) {
     scene->objects_cap = 1024;
     scene->objects_len = 0;
     scene->objects = malloc(sizeof(Object) * scene->objects_cap);
+  } else if (scene->objects_len == scene->objects_cap) {
+    // Objects are only referenced by index while parsing
+    scene->objects_cap *= 2;
+    scene->objects = realloc(scene->objects, sizeof(Object) * scene->objects_cap);
   }
   return &scene->objects[scene->objects_len++];
 }
@@ -489,6 +576,8 @@ Material *scene_add_material(Scene *scene) {
     scene->palette_cap = 1024;
     scene->palette_len = 0;
     scene->palette = malloc(sizeof(Material) * scene->palette_cap);
+  } else if (scene->palette_len == scene->palette_cap) {
+    return NULL; // objects point into the palette, it can't move
   }
   return &scene->palette[scene->palette_len++];
 }
@@ -499,16 +588,36 @@ Light *scene_add_light(Scene *scene) {
     scene->lights_cap = 1024;
     scene->lights_len = 0;
     scene->lights = malloc(sizeof(Light) * scene->lights_cap);
+  } else if (scene->lights_len == scene->lights_cap) {
+    // Nothing keeps pointers to lights while parsing, so they can move
+    scene->lights_cap *= 2;
+    scene->lights = realloc(scene->lights, sizeof(Light) * scene->lights_cap);
   }
   return &scene->lights[scene->lights_len++];
 }
 
+SceneCamera *scene_add_camera(Scene *scene) {
+  assert(scene->cameras_len <= scene->cameras_cap);
+  if (!scene->cameras) {
+    scene->cameras_cap = 8;
+    scene->cameras_len = 0;
+    scene->cameras = malloc(sizeof(SceneCamera) * scene->cameras_cap);
+  } else if (scene->cameras_len == scene->cameras_cap) {
+    scene->cameras_cap *= 2;
+    scene->cameras = realloc(scene->cameras, sizeof(SceneCamera) * scene->cameras_cap);
+  }
+  return &scene->cameras[scene->cameras_len++];
+}
+
 Vec3 *scene_add_vertex(Scene *scene) {
   assert(scene->vert_len <= scene->vert_cap);
   if (!scene->vertices) {
     scene->vert_cap = 4096;
     scene->vert_len = 0;
     scene->vertices = malloc(sizeof(Vec3) * scene->vert_cap);
+  } else if (scene->vert_len == scene->vert_cap) {
+    scene->vert_cap *= 2;
+    scene->vertices = realloc(scene->vertices, sizeof(Vec3) * scene->vert_cap);
   }
   return &scene->vertices[scene->vert_len++];
 }
@@ -519,6 +628,9 @@ Vec3 *scene_add_norm(Scene *scene) {
     scene->norm_cap = 4096;
     scene->norm_len = 0;
     scene->normals = malloc(sizeof(Vec3) * scene->norm_cap);
+  } else if (scene->norm_len == scene->norm_cap) {
+    scene->norm_cap *= 2;
+    scene->normals = realloc(scene->normals, sizeof(Vec3) * scene->norm_cap);
   }
   return &scene->normals[scene->norm_len++];
 }
@@ -529,6 +641,9 @@ Vec2 *scene_add_tex(Scene *scene) {
     scene->texs_cap = 4096;
     scene->texs_len = 0;
     scene->texs = malloc(sizeof(Vec2) * scene->texs_cap);
+  } else if (scene->texs_len == scene->texs_cap) {
+    scene->texs_cap *= 2;
+    scene->texs = realloc(scene->texs, sizeof(Vec2) * scene->texs_cap);
   }
   return &scene->texs[scene->texs_len++];
 }
@@ -0,0 +1,415 @@
+#include "scene_diff.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bounding spheres of the changed objects, both where they were and where
+// they are now
+typedef struct Changes {
+  Vec3 centers[2 * DIFF_MAX_CHANGED];
+  float radii[2 * DIFF_MAX_CHANGED];
+  int len;
+} Changes;
+
+static int vec_equal(Vec3 a, Vec3 b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static int texture_equal(const PixelMap *a, const PixelMap *b) {
+  if (!a || !b)
+    return a == b;
+  return a->width == b->width && a->height == b->height &&
+         memcmp(a->data, b->data, sizeof(PpmColor) * a->width * a->height) == 0;
+}
+
+static int material_equal(const Material *a, const Material *b) {
+  return vec_equal(a->diffuse_color, b->diffuse_color) &&
+         vec_equal(a->spec_color, b->spec_color) && a->ka == b->ka &&
+         a->kd == b->kd && a->ks == b->ks && a->n == b->n &&
+         a->opacity == b->opacity && a->idx_of_refraction == b->idx_of_refraction &&
+         texture_equal(a->texture, b->texture);
+}
+
+// Triangle corners are compared by value, their indices may shift when
+// vertices are added
+static int triangle_equal(Scene *sa, const Triangle *a, Scene *sb, const Triangle *b) {
+  for (int i = 0; i < 3; i++) {
+    if (!vec_equal(sa->vertices[a->p[i]], sb->vertices[b->p[i]]))
+      return 0;
+    if ((a->n[i] < 0) != (b->n[i] < 0) || (a->t[i] < 0) != (b->t[i] < 0))
+      return 0;
+    if (a->n[i] >= 0 && !vec_equal(sa->normals[a->n[i]], sb->normals[b->n[i]]))
+      return 0;
+    if (a->t[i] >= 0 && (sa->texs[a->t[i]].x != sb->texs[b->t[i]].x ||
+                         sa->texs[a->t[i]].y != sb->texs[b->t[i]].y))
+      return 0;
+  }
+  return material_equal(a->mat, b->mat);
+}
+
+static int object_equal(Scene *sa, const Object *a, Scene *sb, const Object *b) {
+  if (a->type != b->type)
+    return 0;
+  switch (a->type) {
+  case OBJECT_SPHERE:
+    return vec_equal(a->sphere.center, b->sphere.center) &&
+           a->sphere.radius == b->sphere.radius &&
+           material_equal(a->sphere.color, b->sphere.color);
+  case OBJECT_CYLINDER:
+    return vec_equal(a->cyl.center, b->cyl.center) &&
+           vec_equal(a->cyl.dir, b->cyl.dir) && a->cyl.radius == b->cyl.radius &&
+           a->cyl.height == b->cyl.height &&
+           material_equal(a->cyl.color, b->cyl.color);
+  default:
+    return triangle_equal(sa, &a->tri, sb, &b->tri);
+  }
+}
+
+static int light_equal(const Light *a, const Light *b) {
+  return vec_equal(a->pos, b->pos) && a->w == b->w &&
+         vec_equal(a->color, b->color) && a->is_attenuated == b->is_attenuated &&
+         vec_equal(a->att, b->att) && a->radius == b->radius &&
+         a->samples == b->samples;
+}
+
+// Everything but the objects that affects every pixel
+static int view_equal(Scene *a, Camera *ca, Scene *b, Camera *cb) {
+  if (ca->window_pixel_width != cb->window_pixel_width ||
+      ca->window_pixel_height != cb->window_pixel_height ||
+      !vec_equal(ca->eye_pos, cb->eye_pos) || !vec_equal(ca->vw_ul, cb->vw_ul) ||
+      !vec_equal(ca->vw_ur, cb->vw_ur) || !vec_equal(ca->vw_ll, cb->vw_ll) ||
+      !vec_equal(a->bg_color, b->bg_color))
+    return 0;
+
+  if (a->depth_cueing_enabled != b->depth_cueing_enabled)
+    return 0;
+  if (a->depth_cueing_enabled) {
+    DepthCue *da = &a->depth_cueing, *db = &b->depth_cueing;
+    if (!vec_equal(da->color, db->color) || da->a_min != db->a_min ||
+        da->a_max != db->a_max || da->dist_min != db->dist_min ||
+        da->dist_max != db->dist_max)
+      return 0;
+  }
+
+  if (a->lights_len != b->lights_len)
+    return 0;
+  for (size_t i = 0; i < a->lights_len; i++)
+    if (!light_equal(&a->lights[i], &b->lights[i]))
+      return 0;
+  return 1;
+}
+
+static void add_change(Changes *changes, Scene *scene, Object *obj) {
+  int i = changes->len++;
+  changes->radii[i] = scene_object_bounds(scene, obj, &changes->centers[i]);
+}
+
+// Collects the bounds of every object that differs between old and new.
+// Returns 0 if there are more than DIFF_MAX_CHANGED of them.
+static int find_changes(Scene *old, Scene *new, Changes *changes) {
+  size_t len = MAX(old->objects_len, new->objects_len);
+  int changed = 0;
+  changes->len = 0;
+  for (size_t i = 0; i < len; i++) {
+    Object *a = i < old->objects_len ? &old->objects[i] : NULL;
+    Object *b = i < new->objects_len ? &new->objects[i] : NULL;
+    if (a && b && object_equal(old, a, new, b))
+      continue;
+    if (++changed > DIFF_MAX_CHANGED)
+      return 0;
+    if (a)
+      add_change(changes, old, a);
+    if (b)
+      add_change(changes, new, b);
+  }
+  return 1;
+}
+
+static void mark_pixels(DirtyTiles *tiles, int width, int height, int x0, int y0,
+                        int x1, int y1) {
+  x0 = MAX(x0, 0) / DIFF_TILE;
+  y0 = MAX(y0, 0) / DIFF_TILE;
+  x1 = MIN(x1, width - 1) / DIFF_TILE;
+  y1 = MIN(y1, height - 1) / DIFF_TILE;
+  for (int ty = y0; ty <= y1; ty++)
+    for (int tx = x0; tx <= x1; tx++)
+      tiles->dirty[ty * tiles->tiles_x + tx] = 1;
+}
+
+// Returns 1 if every tile touched by the pixels in [x0, x1] x [y0, y1] is dirty
+static int pixels_dirty(DirtyTiles *tiles, int width, int height, int x0, int y0,
+                        int x1, int y1) {
+  x0 = MAX(x0, 0) / DIFF_TILE;
+  y0 = MAX(y0, 0) / DIFF_TILE;
+  x1 = MIN(x1, width - 1) / DIFF_TILE;
+  y1 = MIN(y1, height - 1) / DIFF_TILE;
+  for (int ty = y0; ty <= y1; ty++)
+    for (int tx = x0; tx <= x1; tx++)
+      if (!tiles->dirty[ty * tiles->tiles_x + tx])
+        return 0;
+  return 1;
+}
+
+// Marks the pixels the sphere around center covers as seen by camera, with a
+// pixel of margin for anti-aliasing samples near the edge. Returns 0 if the
+// sphere reaches behind the eye, where it can't be projected.
+static int mark_projection(DirtyTiles *tiles, Camera *camera, Vec3 center, float r) {
+  int width = camera->window_pixel_width, height = camera->window_pixel_height;
+  float xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+  // The corners of the sphere's bounding box project to a polygon that
+  // contains the projected sphere
+  for (int i = 0; i < 8; i++) {
+    Vec3 corner = {center.x + (i & 1 ? r : -r), center.y + (i & 2 ? r : -r),
+                   center.z + (i & 4 ? r : -r)};
+    Vec3 d = vecsub(corner, camera->eye_pos);
+    float depth = dot(d, camera->viewdir);
+    if (depth <= 1e-4f)
+      return 0;
+    float x = (dot(d, camera->u) / depth / camera->window_width + 0.5f) * width;
+    float y = (0.5f - dot(d, camera->v) / depth / camera->window_height) * height;
+    xmin = MIN(xmin, x);
+    xmax = MAX(xmax, x);
+    ymin = MIN(ymin, y);
+    ymax = MAX(ymax, y);
+  }
+  if (xmax < -1 || ymax < -1 || xmin > width + 1 || ymin > height + 1)
+    return 1;
+  mark_pixels(tiles, width, height, (int) floorf(xmin) - 1, (int) floorf(ymin) - 1,
+              (int) ceilf(xmax) + 1, (int) ceilf(ymax) + 1);
+  return 1;
+}
+
+// The rays of all samples of a pixel, which the probe follows as one cone
+// around the ray through the pixel's center
+typedef struct Cone {
+  float width; // radius at the ray's origin
+  float spread; // growth of the radius per unit of distance
+} Cone;
+
+static float cone_width(Cone cone, Ray *ray, float t) {
+  return cone.width + cone.spread * t * veclen(ray->dir);
+}
+
+// Returns 1 if the cone around ray between 0 and max_t touches a changed
+// object's bounds
+static int segment_hits(const Changes *changes, Ray *ray, float max_t, Cone cone) {
+  float dd = dot(ray->dir, ray->dir);
+  for (int i = 0; i < changes->len; i++) {
+    Vec3 c = changes->centers[i];
+    float t = dot(vecsub(c, ray->pos), ray->dir) / dd;
+    t = MIN(MAX(t, 0), max_t);
+    float r = changes->radii[i] + cone_width(cone, ray, t);
+    if (dist2(ray_pos(ray, t), c) <= r * r)
+      return 1;
+  }
+  return 0;
+}
+
+// Radius of curvature of obj, 0 if it is flat
+static float curvature_radius(Object *obj) {
+  switch (obj->type) {
+  case OBJECT_SPHERE:
+    return obj->sphere.radius;
+  case OBJECT_CYLINDER:
+    return obj->cyl.radius;
+  default:
+    return 0;
+  }
+}
+
+static float segment_dist2(Vec3 p, Vec3 a, Vec3 b) {
+  Vec3 ab = vecsub(b, a);
+  float t = dot(vecsub(p, a), ab) / MAX(dot(ab, ab), 1e-12f);
+  return dist2(p, vecadd(a, vecmul(ab, MIN(MAX(t, 0), 1))));
+}
+
+// Returns 1 if part of a cone of the given width around ray can pass by the
+// object in hits, because the hit is that close to the object's outline
+static int may_pass_by(Scene *scene, Ray *ray, Intersection *in, float width) {
+  Object *obj = in->obj;
+  switch (obj->type) {
+  case OBJECT_SPHERE: {
+    Sphere *sphere = &obj->sphere;
+    Vec3 oc = vecsub(sphere->center, ray->pos);
+    float along = dot(oc, ray->dir) / dot(ray->dir, ray->dir);
+    float miss = sqrt(dist2(ray_pos(ray, along), sphere->center));
+    return miss > sphere->radius - width;
+  }
+  case OBJECT_CYLINDER: {
+    Cylinder *cyl = &obj->cyl;
+    Vec3 rel = vecsub(in->pos, cyl->center);
+    float h = dot(rel, cyl->dir);
+    float r = sqrt(MAX(veclen2(rel) - h * h, 0));
+    if (h < width || h > cyl->height - width || r > cyl->radius - width)
+      return 1;
+    // Distance between the ray and the axis
+    Vec3 n = cross(ray->dir, cyl->dir);
+    float len = veclen(n);
+    return len > 1e-6f &&
+           fabs(dot(vecsub(ray->pos, cyl->center), n)) / len > cyl->radius - width;
+  }
+  default: {
+    Vec3 p[3];
+    for (int i = 0; i < 3; i++)
+      p[i] = scene->vertices[obj->tri.p[i]];
+    float w2 = width * width;
+    return segment_dist2(in->pos, p[0], p[1]) < w2 ||
+           segment_dist2(in->pos, p[1], p[2]) < w2 ||
+           segment_dist2(in->pos, p[2], p[0]) < w2;
+  }
+  }
+}
+
+typedef struct Probe {
+  Scene *scene;
+  const RenderOptions *opts;
+  const Changes *changes;
+} Probe;
+
+static int probe_hit(Probe *p, Ray *ray, Intersection *in, Cone cone);
+
+// probe_hit for the hit of ray, whose cone starts at the ray's origin. Where
+// the cone is wider than what is left of the object around the hit, the
+// samples passing by the object are followed too.
+static int probe_surface(Probe *p, Ray *ray, Intersection *in, Cone cone) {
+  cone.width = cone_width(cone, ray, in->t);
+  if (probe_hit(p, ray, in, cone))
+    return 1;
+  if (!may_pass_by(p->scene, ray, in, cone.width))
+    return 0;
+
+  Ray past = {in->pos, ray->dir};
+  Intersection next = scene_find_best_inter_ignore(p->scene, &past, in->obj);
+  if (segment_hits(p->changes, &past, next.t, cone))
+    return 1;
+  if (next.t == INFINITY)
+    return 0;
+  next.depth = in->depth;
+  next.throughput = in->throughput;
+  next.from_mat = in->from_mat;
+  return probe_surface(p, &past, &next, cone);
+}
+
+// Follows a secondary ray of the old scene, see probe_hit
+static int probe_ray(Probe *p, Ray *ray, Object *ignore, Intersection *from,
+                     float throughput, Material *from_mat, Cone cone) {
+  Intersection in = scene_find_best_inter_ignore(p->scene, ray, ignore);
+  if (segment_hits(p->changes, ray, in.t, cone))
+    return 1;
+  if (in.t == INFINITY)
+    return 0;
+  in.depth = from->depth + 1;
+  in.throughput = throughput;
+  in.from_mat = from_mat;
+  return probe_surface(p, ray, &in, cone);
+}
+
+// Returns 1 if a shadow or secondary ray that shading in casts (however many
+// bounces deep) can pass through a changed object. Mirrors scene_shade_ray,
+// but without the pruning that depends on colors or random numbers. cone is
+// the footprint of the pixel's samples at in.
+static int probe_hit(Probe *p, Ray *ray, Intersection *in, Cone cone) {
+  Scene *scene = p->scene;
+  const RenderOptions *opts = p->opts;
+  LightIter it;
+  light_tree_begin(&scene->light_tree, scene->lights, in->pos, &it);
+  for (int i; (i = light_tree_next(&it)) >= 0;) {
+    Light *light = &scene->lights[i];
+    float max_t;
+    Ray shadow_ray = scene_shadow_ray(light, in, &max_t);
+    // Area light samples stay within the light's radius of the center ray
+    Cone shadow_cone = {cone.width + light->radius, 0};
+    if (segment_hits(p->changes, &shadow_ray, max_t, shadow_cone))
+      return 1;
+  }
+
+  // Curved surfaces fan the secondary rays of the footprint out
+  float curvature = curvature_radius(in->obj);
+  if (curvature > 0)
+    cone.spread += 2 * cone.width / curvature;
+
+  if (in->depth < opts->max_reflect_depth) {
+    Ray refl_ray;
+    float throughput = in->throughput * scene_reflection_ray(ray, in, &refl_ray);
+    if (throughput >= opts->min_throughput &&
+        probe_ray(p, &refl_ray, in->obj, in, throughput, in->from_mat, cone))
+      return 1;
+  }
+  if (in->mat->opacity < 1 && in->depth < opts->max_refract_depth) {
+    Ray refr_ray;
+    float throughput = in->throughput * scene_refraction_ray(ray, in, &refr_ray);
+    if (throughput >= opts->min_throughput &&
+        probe_ray(p, &refr_ray, NULL, in, throughput,
+                  in->from_mat == NULL ? in->mat : NULL, cone))
+      return 1;
+  }
+  return 0;
+}
+
+int scene_diff_tiles(Scene *old, Camera *old_camera, Scene *new, Camera *new_camera,
+                     const RenderOptions *opts, const GBuffer *hits, DirtyTiles *out) {
+  int width = new->pixel_width, height = new->pixel_height;
+  DirtyTiles tiles = {0};
+  tiles.tiles_x = (width + DIFF_TILE - 1) / DIFF_TILE;
+  tiles.tiles_y = (height + DIFF_TILE - 1) / DIFF_TILE;
+  tiles.dirty = calloc((size_t) tiles.tiles_x * tiles.tiles_y, 1);
+  Changes *changes = malloc(sizeof(Changes));
+  if (!tiles.dirty || !changes) {
+    free(tiles.dirty);
+    free(changes);
+    return ENOMEM;
+  }
+
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+
+  tiles.full = !view_equal(old, old_camera, new, new_camera) ||
+               !find_changes(old, new, changes);
+  for (int i = 0; !tiles.full && i < changes->len; i++)
+    tiles.full = !mark_projection(&tiles, new_camera, changes->centers[i],
+                                  changes->radii[i]);
+
+  if (!tiles.full && changes->len > 0) {
+    // Shadows, reflections and refractions of the changed objects can show up
+    // anywhere; follow the rays of each pixel center through the old scene
+    Probe probe = {old, opts, changes};
+    // Samples are at most half a pixel diagonal away from the center
+    Cone pixel_cone = {0, 0.71f * old_camera->window_width / width};
+    if (hits && (hits->width != width || hits->height != height))
+      hits = NULL;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        if (pixels_dirty(&tiles, width, height, x - 1, y - 1, x + 1, y + 1))
+          continue;
+        Ray ray = camera_trace_ray(old_camera, x, y);
+        Intersection in;
+        if (hits)
+          gbuffer_hit(hits, old, x, y, &in);
+        else
+          in = scene_find_best_inter(old, &ray);
+        if (in.t != INFINITY && probe_surface(&probe, &ray, &in, pixel_cone))
+          mark_pixels(&tiles, width, height, x - 1, y - 1, x + 1, y + 1);
+      }
+    }
+  }
+
+  size_t len = (size_t) tiles.tiles_x * tiles.tiles_y;
+  if (tiles.full)
+    memset(tiles.dirty, 1, len);
+  for (size_t i = 0; i < len; i++)
+    tiles.count += tiles.dirty[i];
+  free(changes);
+  *out = tiles;
+  return 0;
+}
+
+void dirty_tiles_destroy(DirtyTiles *tiles) {
+  free(tiles->dirty);
+  tiles->dirty = NULL;
+  tiles->count = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef RAYTRACERPROJ__SCENE_DIFF_H_
+#define RAYTRACERPROJ__SCENE_DIFF_H_
+
+#include "gbuffer.h"
+
+// Side of the square tiles an edit is re-rendered in
+#define DIFF_TILE 16
+
+// Edits changing more objects than this re-render the whole frame
+#define DIFF_MAX_CHANGED 64
+
+// The tiles of a frame that an edit of its scene can change
+typedef struct DirtyTiles {
+  int tiles_x, tiles_y; // tiles along each side, the last ones may be cut off by the image
+  int count; // number of dirty tiles
+  int full; // 1 if the view, lights or background changed, so every tile is dirty
+  uint8_t *dirty; // tiles_x * tiles_y flags, row by row
+} DirtyTiles;
+
+/**
+ * Compares two versions of a scene (typically the same file before and after
+ * an edit) and finds the tiles whose pixels can differ between them.
+ * Objects are matched by their order in the scene. Changes to the camera,
+ * image size, lights, background or depth cueing dirty the whole frame.
+ * Otherwise a tile is dirty if the projected bounds of an object that moved,
+ * changed shape or material, appeared or disappeared overlap it, or if a
+ * shadow, reflection or refraction ray of the pixel centers around it passes
+ * through the bounds in the old scene.
+ *
+ * @param opts The options both versions are rendered with, NULL for the defaults
+ * @param hits The primary hits of old (see gbuffer_capture_hits), NULL to trace them
+ * @return 0 if successful, ENOMEM if out of memory
+ */
+int scene_diff_tiles(Scene *old, Camera *old_camera, Scene *new, Camera *new_camera,
+                     const RenderOptions *opts, const GBuffer *hits, DirtyTiles *out);
+void dirty_tiles_destroy(DirtyTiles *tiles);
+
+#endif //RAYTRACERPROJ__SCENE_DIFF_H_
@@ -1,5 +1,16 @@
+#include "estimate.h"
+#include "gbuffer.h"
+#include "image_diff.h"
+#include "progressive.h"
 #include "scene.h"
 #include "scene_config.h"
+#include "scene_diff.h"
+#include "trace.h"
+#include "views.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <CUnit/Basic.h>
 
 #define ASSERT_COLOR_EQUAL(actual, ex1, ex2, ex3)                              \
@@ -47,6 +58,578 @@ void test_invalid_scene() {
   CU_ASSERT_EQUAL(scene_create_from_file("../scenes/invalid_args.scene"), NULL);
 }
 
+void test_material_not_shared_between_scenes() {
+  Scene *s = scene_create_from_file("../scenes/1d/mirror_sphere.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  scene_destroy(s);
+  CU_ASSERT_EQUAL(scene_create_from_file("../scenes/no_material.scene"), NULL);
+}
+
+void test_area_light() {
+  Scene *s = scene_create_from_file("../scenes/area_light.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  CU_ASSERT_EQUAL_FATAL(s->lights_len, 1);
+  ASSERT_VEC3_EQUAL(s->lights[0].pos, -35, 25, 50);
+  CU_ASSERT_EQUAL(s->lights[0].radius, 3);
+  CU_ASSERT_EQUAL(s->lights[0].samples, 64);
+  scene_destroy(s);
+}
+
+void test_back_facing_light() {
+  // A directional light from behind the sphere, the highlight term alone is
+  // positive at some of the visible points
+  FILE *out = fopen("back_light_test.scene", "w");
+  CU_ASSERT_NOT_EQUAL_FATAL(out, NULL);
+  fprintf(out, "eye 0 0 5\nviewdir 0 0 -1\nupdir 0 1 0\nhfov 45\nimsize 16 12\n"
+               "bkgcolor 0 0 0\nlight 0.1 0 1 0 1 1 1\n"
+               "mtlcolor 1 0 0 1 1 1 0.1 0.6 0.8 20\nsphere 0 0 0 1\n");
+  fclose(out);
+  Scene *s = scene_create_from_file("back_light_test.scene");
+  remove("back_light_test.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  Camera camera;
+  CU_ASSERT_EQUAL_FATAL(camera_create_from_scene(s, &camera), 0);
+  PixelMap *image = pixel_map_new(16, 12);
+  RenderStats stats = {0};
+  CU_ASSERT_EQUAL(tracer_render_region(s, &camera, 0, 0, 16, 12, image, NULL, &stats), 0);
+  // Every hit skips the light without a shadow ray and is only ambient
+  CU_ASSERT(stats.shadow_skipped > 0);
+  CU_ASSERT_EQUAL(stats.shadow_rays, 0);
+  PpmColor center = image->data[6 * 16 + 8];
+  CU_ASSERT(center.r > 0 && center.r < 64 && center.g == 0 && center.b == 0);
+  pixel_map_destroy(image);
+  scene_destroy(s);
+}
+
+void test_progressive() {
+  FILE *out = fopen("progressive_test.scene", "w");
+  CU_ASSERT_NOT_EQUAL_FATAL(out, NULL);
+  fprintf(out, "eye 0 0 5\nviewdir 0 0 -1\nupdir 0 1 0\nhfov 45\nimsize 32 24\n"
+               "bkgcolor 0.1 0.1 0.1\nlight 0 5 5 1 1 1 1\n"
+               "mtlcolor 1 0 0 1 1 1 0.1 0.6 0.3 20 0.5 1.5\nsphere 0 0 0 1\n");
+  fclose(out);
+  Scene *s = scene_create_from_file("progressive_test.scene");
+  remove("progressive_test.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  Camera camera;
+  CU_ASSERT_EQUAL_FATAL(camera_create_from_scene(s, &camera), 0);
+  PixelMap *image = pixel_map_new(32, 24);
+  PixelMap *expected = pixel_map_new(32, 24);
+  RenderOptions opts;
+  render_options_default(&opts);
+  ProgressiveOptions popts;
+  progressive_options_default(&popts);
+  ProgressiveResult result;
+
+  // Without refinement the best image is the full depth pass, one ray
+  // through the center of every pixel
+  popts.max_samples = 1;
+  CU_ASSERT_EQUAL(tracer_render_progressive(s, &camera, image, &opts, &popts, &result), 0);
+  CU_ASSERT_EQUAL(result.full_res, 1);
+  CU_ASSERT_EQUAL(result.samples, 1);
+  tracer_render_region(s, &camera, 0, 0, 32, 24, expected, &opts, NULL);
+  CU_ASSERT(memcmp(image->data, expected->data, sizeof(PpmColor) * 32 * 24) == 0);
+
+  // Cancelled before it starts: no pass, the image is left as it was
+  volatile sig_atomic_t cancel = 1;
+  popts.cancel = &cancel;
+  CU_ASSERT_EQUAL(tracer_render_progressive(s, &camera, image, &opts, &popts, &result), 0);
+  CU_ASSERT_EQUAL(result.passes, 0);
+  CU_ASSERT_EQUAL(result.full_res, 0);
+  CU_ASSERT(memcmp(image->data, expected->data, sizeof(PpmColor) * 32 * 24) == 0);
+  pixel_map_destroy(image);
+  pixel_map_destroy(expected);
+  scene_destroy(s);
+
+  // A deadline far shorter than the render stops it in the preview passes
+  s = scene_create_from_file("../scenes/1d/transparent_sphere.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  CU_ASSERT_EQUAL_FATAL(camera_create_from_scene(s, &camera), 0);
+  image = pixel_map_new(s->pixel_width, s->pixel_height);
+  progressive_options_default(&popts);
+  popts.time_budget_ms = 1;
+  CU_ASSERT_EQUAL(tracer_render_progressive(s, &camera, image, &opts, &popts, &result), 0);
+  CU_ASSERT_EQUAL(result.full_res, 0);
+  CU_ASSERT(result.elapsed_ms < 1000);
+  pixel_map_destroy(image);
+  scene_destroy(s);
+}
+
+void test_occluder_cache() {
+  // A light above two blockers, the first in the way from around the origin
+  // and the second from (5, 0, 0); nothing is in the way from (-5, 0, 0)
+  FILE *out = fopen("occluder_test.scene", "w");
+  CU_ASSERT_NOT_EQUAL_FATAL(out, NULL);
+  fprintf(out, "eye 0 0 20\nviewdir 0 0 -1\nupdir 0 1 0\nhfov 45\nimsize 8 8\n"
+               "bkgcolor 0 0 0\nlight 0 10 0 1 1 1 1\n"
+               "mtlcolor 1 1 1 1 1 1 0.1 0.6 0.3 20\n"
+               "sphere 0 -5 0 1\nsphere 0 5 0 1\nsphere 2.5 5 0 0.5\n");
+  fclose(out);
+  Scene *s = scene_create_from_file("occluder_test.scene");
+  remove("occluder_test.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  RenderOptions opts;
+  render_options_default(&opts);
+  TraceContext ctx;
+  tracer_context_init(&ctx, s, NULL, &opts);
+  Light *light = &s->lights[0];
+  Intersection in = {0};
+  float max_t;
+
+  // The first ray searches every object and caches the blocker
+  in.pos = (Vec3) {0, 0, 0};
+  Ray ray = scene_shadow_ray(light, &in, &max_t);
+  CU_ASSERT_EQUAL(scene_shadow_occluded(&ctx, light, &ray, max_t, NULL), 1);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_cache_hits, 0);
+  CU_ASSERT_EQUAL(ctx.stats.object_tests[OBJECT_SPHERE], 2);
+
+  // Its neighbor is blocked by the cached object, tested alone
+  in.pos = (Vec3) {0.1f, 0, 0};
+  ray = scene_shadow_ray(light, &in, &max_t);
+  CU_ASSERT_EQUAL(scene_shadow_occluded(&ctx, light, &ray, max_t, NULL), 1);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_cache_hits, 1);
+  CU_ASSERT_EQUAL(ctx.stats.object_tests[OBJECT_SPHERE], 3);
+
+  // The cached object no longer blocks: the full search finds the other one
+  in.pos = (Vec3) {5, 0, 0};
+  ray = scene_shadow_ray(light, &in, &max_t);
+  CU_ASSERT_EQUAL(scene_shadow_occluded(&ctx, light, &ray, max_t, NULL), 1);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_cache_hits, 1);
+  CU_ASSERT_EQUAL(ctx.stats.object_tests[OBJECT_SPHERE], 3 + 1 + 3);
+
+  // Neither cached nor any other object blocks
+  in.pos = (Vec3) {-5, 0, 0};
+  ray = scene_shadow_ray(light, &in, &max_t);
+  CU_ASSERT_EQUAL(scene_shadow_occluded(&ctx, light, &ray, max_t, NULL), 0);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_cache_hits, 1);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_rays, 4);
+  CU_ASSERT_EQUAL(ctx.stats.shadow_occluded, 3);
+  scene_destroy(s);
+}
+
+void test_light_tree() {
+  Scene *s = scene_create_from_file("../scenes/many_lights.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  CU_ASSERT_EQUAL_FATAL(s->lights_len, 1024);
+  CU_ASSERT(s->lights[0].reach > 15.9 && s->lights[0].reach < 16.0);
+
+  // The tree returns exactly the lights in reach, each once
+  Vec3 points[] = {{0, 0, 0}, {-60, 0, -98}, {0, 100, 0}, {13.5, 0.5, -41}};
+  for (int p = 0; p < 4; p++) {
+    size_t expected = 0, found = 0;
+    for (size_t i = 0; i < s->lights_len; i++) {
+      Light *l = &s->lights[i];
+      if (dist2(l->pos, points[p]) <= l->reach * l->reach)
+        expected++;
+    }
+    LightIter it;
+    light_tree_begin(&s->light_tree, s->lights, points[p], &it);
+    for (int i; (i = light_tree_next(&it)) >= 0; found++) {
+      Light *l = &s->lights[i];
+      CU_ASSERT(dist2(l->pos, points[p]) <= l->reach * l->reach);
+    }
+    CU_ASSERT_EQUAL(found, expected);
+  }
+  scene_destroy(s);
+}
+
+void test_gbuffer_relight() {
+  Scene *s = scene_create_from_file("../scenes/area_light.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  Camera camera;
+  CU_ASSERT_EQUAL_FATAL(camera_create_from_scene(s, &camera), 0);
+  PixelMap *rendered = pixel_map_new(s->pixel_width, s->pixel_height);
+  PixelMap *relit = pixel_map_new(s->pixel_width, s->pixel_height);
+
+  GBuffer *gb = gbuffer_capture(s, &camera, NULL, rendered);
+  CU_ASSERT_NOT_EQUAL_FATAL(gb, NULL);
+  CU_ASSERT_EQUAL_FATAL(gbuffer_write(gb, "gbuffer_test.gb"), 0);
+  gbuffer_destroy(gb);
+  gb = gbuffer_read("gbuffer_test.gb");
+  CU_ASSERT_NOT_EQUAL_FATAL(gb, NULL);
+  remove("gbuffer_test.gb");
+
+  // Unchanged scene: recorded shadows, same image
+  int reused = 0;
+  CU_ASSERT_EQUAL(gbuffer_relight(gb, s, &camera, NULL, relit, &reused), 0);
+  CU_ASSERT_EQUAL(reused, 1);
+  CU_ASSERT(memcmp(rendered->data, relit->data,
+                   sizeof(PpmColor) * s->pixel_width * s->pixel_height) == 0);
+
+  // An object given another material is shaded with it, like in a capture
+  // of the edited scene
+  s->objects[1].sphere.color = &s->palette[0];
+  CU_ASSERT_EQUAL(gbuffer_relight(gb, s, &camera, NULL, relit, &reused), 0);
+  CU_ASSERT_EQUAL(reused, 1);
+  gbuffer_destroy(gbuffer_capture(s, &camera, NULL, rendered));
+  CU_ASSERT(memcmp(rendered->data, relit->data,
+                   sizeof(PpmColor) * s->pixel_width * s->pixel_height) == 0);
+
+  // A moved light needs new shadow rays
+  s->lights[0].pos.x += 1;
+  CU_ASSERT_EQUAL(gbuffer_relight(gb, s, &camera, NULL, relit, &reused), 0);
+  CU_ASSERT_EQUAL(reused, 0);
+
+  // Moved geometry invalidates the G-buffer
+  s->objects[0].sphere.center.y += 1;
+  CU_ASSERT_EQUAL(gbuffer_relight(gb, s, &camera, NULL, relit, &reused), EINVAL);
+
+  gbuffer_destroy(gb);
+  pixel_map_destroy(rendered);
+  pixel_map_destroy(relit);
+  scene_destroy(s);
+}
+
+void test_scene_diff() {
+  Scene *old = scene_create_from_file("../scenes/area_light.scene");
+  Scene *new = scene_create_from_file("../scenes/area_light.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(old, NULL);
+  CU_ASSERT_NOT_EQUAL_FATAL(new, NULL);
+  Camera camera;
+  CU_ASSERT_EQUAL_FATAL(camera_create_from_scene(old, &camera), 0);
+  int width = old->pixel_width, height = old->pixel_height;
+  PixelMap *frame = pixel_map_new(width, height);
+  PixelMap *expected = pixel_map_new(width, height);
+  tracer_render_region(old, &camera, 0, 0, width, height, frame, NULL, NULL);
+
+  // Nothing changed
+  DirtyTiles tiles;
+  CU_ASSERT_EQUAL_FATAL(scene_diff_tiles(old, &camera, new, &camera, NULL, NULL, &tiles), 0);
+  CU_ASSERT_EQUAL(tiles.count, 0);
+  dirty_tiles_destroy(&tiles);
+
+  // Moving the sphere only dirties the tiles it and its shadow cover, and
+  // re-rendering them gives the same image as rendering the whole frame
+  new->objects[1].sphere.center.x += 2;
+  CU_ASSERT_EQUAL_FATAL(scene_diff_tiles(old, &camera, new, &camera, NULL, NULL, &tiles), 0);
+  CU_ASSERT(tiles.count > 0 && tiles.count < tiles.tiles_x * tiles.tiles_y);
+  CU_ASSERT_EQUAL(tiles.full, 0);
+  for (int ty = 0; ty < tiles.tiles_y; ty++) {
+    for (int tx = 0; tx < tiles.tiles_x; tx++) {
+      if (!tiles.dirty[ty * tiles.tiles_x + tx])
+        continue;
+      int x0 = tx * DIFF_TILE, y0 = ty * DIFF_TILE;
+      tracer_render_region(new, &camera, x0, y0, MIN(x0 + DIFF_TILE, width),
+                           MIN(y0 + DIFF_TILE, height), frame, NULL, NULL);
+    }
+  }
+  dirty_tiles_destroy(&tiles);
+  tracer_render_region(new, &camera, 0, 0, width, height, expected, NULL, NULL);
+  CU_ASSERT(memcmp(frame->data, expected->data, sizeof(PpmColor) * width * height) == 0);
+
+  // Lights affect every pixel
+  new->lights[0].color.x = 0.5f;
+  CU_ASSERT_EQUAL_FATAL(scene_diff_tiles(old, &camera, new, &camera, NULL, NULL, &tiles), 0);
+  CU_ASSERT_EQUAL(tiles.full, 1);
+  CU_ASSERT_EQUAL(tiles.count, tiles.tiles_x * tiles.tiles_y);
+  dirty_tiles_destroy(&tiles);
+
+  pixel_map_destroy(frame);
+  pixel_map_destroy(expected);
+  scene_destroy(old);
+  scene_destroy(new);
+}
+
+void test_views() {
+  Scene *s = scene_create_from_file("../scenes/area_light.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  SceneCamera *top = scene_add_camera(s);
+  *top = (SceneCamera) {"top", {0, 100, 20}, {0, -1, -0.5f}, {0, 1, 0}, 60};
+
+  // A stereo pair plus the scene's camera, rendered by several threads, is
+  // the same as rendering each view on its own
+  CameraRig rig = {RIG_STEREO, 4};
+  View *views;
+  size_t len;
+  CU_ASSERT_EQUAL_FATAL(views_create(s, &rig, &views, &len), 0);
+  CU_ASSERT_EQUAL_FATAL(len, 3);
+  CU_ASSERT_STRING_EQUAL(views[0].name, "left");
+  CU_ASSERT_STRING_EQUAL(views[2].name, "top");
+  RenderStats stats = {0};
+  CU_ASSERT_EQUAL(tracer_render_views(s, views, len, NULL, 3, &stats), 0);
+  // One primary ray per pixel without anti-aliasing, counted by every thread
+  CU_ASSERT_EQUAL(stats.primary_rays, (uint64_t) 3 * s->pixel_width * s->pixel_height);
+  CU_ASSERT(stats.object_tests[OBJECT_SPHERE] >= stats.primary_rays);
+  for (size_t i = 0; i < len; i++) {
+    Camera *camera = &views[i].camera;
+    int width = camera->window_pixel_width, height = camera->window_pixel_height;
+    PixelMap *expected = pixel_map_new(width, height);
+    tracer_render_region(s, camera, 0, 0, width, height, expected, NULL, NULL);
+    CU_ASSERT(memcmp(views[i].image->data, expected->data,
+                     sizeof(PpmColor) * width * height) == 0);
+    pixel_map_destroy(expected);
+  }
+  views_destroy(views, len);
+
+  // Cube faces are square
+  rig.type = RIG_CUBE;
+  CU_ASSERT_EQUAL_FATAL(views_create(s, &rig, &views, &len), 0);
+  CU_ASSERT_EQUAL(len, 7);
+  CU_ASSERT_EQUAL(views[3].camera.window_pixel_height, s->pixel_width);
+  views_destroy(views, len);
+
+  // A cropped view is the same part of the full one
+  CU_ASSERT_EQUAL_FATAL(views_create(s, NULL, &views, &len), 0);
+  CU_ASSERT_EQUAL(view_crop(&views[0], 10, 20, 10, 40), EINVAL);
+  CU_ASSERT_EQUAL_FATAL(view_crop(&views[0], 10, 20, 90, 40), 0);
+  views[0].costs = cost_map_new(10, 20, 80, 20);
+  RenderOptions opts;
+  render_options_default(&opts);
+  opts.trace = trace_new(2);
+  CU_ASSERT_EQUAL(tracer_render_views(s, views, 1, &opts, 2, NULL), 0);
+  // Every pixel of the crop has at least its primary ray recorded
+  CU_ASSERT(views[0].costs->pixels[0].rays >= 1 && views[0].costs->pixels[80 * 20 - 1].rays >= 1);
+  // A span and a queue depth per tile, 3 tiles of 32x32 pixels at most
+  CU_ASSERT_EQUAL(opts.trace->buffers[0].recorded + opts.trace->buffers[1].recorded, 6);
+  trace_destroy(opts.trace);
+  PixelMap *expected = pixel_map_new(80, 20);
+  tracer_render_region(s, &views[0].camera, 10, 20, 90, 40, expected, NULL, NULL);
+  CU_ASSERT(memcmp(views[0].image->data, expected->data, sizeof(PpmColor) * 80 * 20) == 0);
+  pixel_map_destroy(expected);
+  views_destroy(views, len);
+
+  // Scene cameras can't take a rig view's name
+  strcpy(top->name, "right");
+  rig.type = RIG_STEREO;
+  CU_ASSERT_EQUAL(views_create(s, &rig, &views, &len), EEXIST);
+  scene_destroy(s);
+}
+
+void test_trace() {
+  Trace *trace = trace_new(1);
+  CU_ASSERT_NOT_EQUAL_FATAL(trace, NULL);
+  trace_span(trace, "parse", trace->origin, trace->origin + 1);
+  // More tiles than the ring keeps, with a name that needs escaping
+  for (int i = 0; i <= TRACE_BUFFER_EVENTS; i++)
+    trace_tile(trace_buffer(trace, 0), "a\"b\\", i, 0, 2, 3);
+  CU_ASSERT_EQUAL_FATAL(trace_write_json(trace, "trace_test.json"), 0);
+  trace_destroy(trace);
+  FILE *in = fopen("trace_test.json", "r");
+  CU_ASSERT_NOT_EQUAL_FATAL(in, NULL);
+  char line[256];
+  int parse = 0, escaped = 0;
+  while (fgets(line, sizeof(line), in)) {
+    parse += strstr(line, "\"name\": \"parse\"") != NULL;
+    escaped += strstr(line, "\"view\": \"a\\\"b\\\\\"") != NULL;
+  }
+  fclose(in);
+  remove("trace_test.json");
+  // The stage span outlives the tiles that overwrote each other
+  CU_ASSERT_EQUAL(parse, 1);
+  CU_ASSERT_EQUAL(escaped, TRACE_BUFFER_EVENTS);
+}
+
+void test_large_scene() {
+  // More objects and vertices than the initial capacity of the arrays
+  FILE *out = fopen("large_test.scene", "w");
+  CU_ASSERT_NOT_EQUAL_FATAL(out, NULL);
+  fprintf(out, "eye 0 0 5\nviewdir 0 0 -1\nupdir 0 1 0\nhfov 45\nimsize 8 6\n"
+               "bkgcolor 0 0 0\nmtlcolor 1 0 0 1 1 1 0.1 0.6 0.3 20\n");
+  for (int i = 0; i < 3000; i++)
+    fprintf(out, "sphere %d 0 -10 0.5\n", i);
+  for (int i = 0; i < 5000; i++)
+    fprintf(out, "v %d 0 -10\n", i);
+  fprintf(out, "f 1 2 5000\n");
+  fclose(out);
+  Scene *s = scene_create_from_file("large_test.scene");
+  remove("large_test.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  CU_ASSERT_EQUAL(s->objects_len, 3001);
+  CU_ASSERT_EQUAL(s->objects[2999].sphere.center.x, 2999);
+  CU_ASSERT_EQUAL(s->objects[3000].type, OBJECT_TRIANGLE);
+  CU_ASSERT_EQUAL(s->vertices[4999].x, 4999);
+  scene_destroy(s);
+}
+
+void test_cost_map() {
+  CostMap *map = cost_map_new(10, 20, 2, 2);
+  CU_ASSERT_NOT_EQUAL_FATAL(map, NULL);
+  RenderStats before = {0}, after = {0};
+  after.primary_rays = 3;
+  after.object_tests[OBJECT_SPHERE] = (uint64_t) 5 << 32;
+  cost_map_record(map, 11, 21, &before, &after, 5.0);
+  // Too many tests and nanoseconds for 32 bits stay at the maximum
+  PixelCost *cost = cost_map_at(map, 11, 21);
+  CU_ASSERT_EQUAL(cost->rays, 3);
+  CU_ASSERT_EQUAL(cost->tests, UINT32_MAX);
+  CU_ASSERT_EQUAL(cost->nanoseconds, UINT32_MAX);
+  CU_ASSERT_EQUAL(cost_map_at(map, 12, 21), NULL);
+  cost_map_destroy(map);
+}
+
+void test_image_diff() {
+  PixelMap *a = pixel_map_new(4, 2), *b = pixel_map_new(4, 2);
+  ImageDiff diff;
+  PixelMap *heatmap;
+  CU_ASSERT_EQUAL_FATAL(image_diff(a, b, &diff, NULL), 0);
+  CU_ASSERT(isinf(diff.psnr));
+  CU_ASSERT_EQUAL(diff.differing, 0);
+
+  b->data[6].g = 3;
+  CU_ASSERT_EQUAL_FATAL(image_diff(a, b, &diff, &heatmap), 0);
+  CU_ASSERT(fabs(diff.rmse - sqrt(9.0 / 24)) < 1e-9);
+  CU_ASSERT_EQUAL(diff.max_error, 3);
+  CU_ASSERT_EQUAL(diff.max_x, 2);
+  CU_ASSERT_EQUAL(diff.max_y, 1);
+  CU_ASSERT_EQUAL(diff.differing, 1);
+  // White where the error is largest, black where there is none
+  CU_ASSERT_EQUAL(heatmap->data[6].b, 255);
+  CU_ASSERT_EQUAL(heatmap->data[0].r + heatmap->data[0].g + heatmap->data[0].b, 0);
+  pixel_map_destroy(heatmap);
+
+  PixelMap *c = pixel_map_new(2, 4);
+  CU_ASSERT_EQUAL(image_diff(a, c, &diff, NULL), EINVAL);
+  pixel_map_destroy(a);
+  pixel_map_destroy(b);
+  pixel_map_destroy(c);
+}
+
+void test_estimate() {
+  Scene *s = scene_create_from_file("../scenes/1d/mirror_sphere.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  View *views;
+  size_t len;
+  CU_ASSERT_EQUAL_FATAL(views_create(s, NULL, &views, &len), 0);
+  CU_ASSERT_EQUAL_FATAL(view_crop(&views[0], 100, 200, 180, 240), 0);
+  RenderEstimate estimate;
+  CU_ASSERT_EQUAL(tracer_estimate_views(s, views, 1, NULL, 0, 2, &estimate), EINVAL);
+
+  // Sampling every pixel counts exactly the rays of the render
+  CU_ASSERT_EQUAL_FATAL(tracer_estimate_views(s, views, 1, NULL, 1, 2, &estimate), 0);
+  RenderStats stats = {0};
+  CU_ASSERT_EQUAL(tracer_render_views(s, views, 1, NULL, 1, &stats), 0);
+  CU_ASSERT_EQUAL(estimate.pixels, 80 * 40);
+  CU_ASSERT_EQUAL(estimate.sampled, 80 * 40);
+  CU_ASSERT_EQUAL(estimate.rays, render_stats_rays(&stats));
+  CU_ASSERT(estimate.quantiles[ESTIMATE_P50].rays <= estimate.quantiles[ESTIMATE_MAX].rays);
+  // 3 tiles of 32 columns, the last one narrower, in 2 rows on 2 threads
+  CU_ASSERT(estimate.wall_seconds >= estimate.cpu_seconds / 2 - 1e-9);
+  CU_ASSERT(estimate.wall_seconds <= estimate.cpu_seconds + 1e-9);
+
+  // One pixel of every 10x10 block
+  CU_ASSERT_EQUAL_FATAL(tracer_estimate_views(s, views, 1, NULL, 0.01f, 1, &estimate), 0);
+  CU_ASSERT_EQUAL(estimate.sampled, 8 * 4);
+  CU_ASSERT(fabs(estimate.wall_seconds - estimate.cpu_seconds) < 1e-9);
+  views_destroy(views, len);
+  scene_destroy(s);
+}
+
+void test_tile_order() {
+  Scene *s = scene_create_from_file("../scenes/1d/transparent_sphere.scene");
+  CU_ASSERT_NOT_EQUAL_FATAL(s, NULL);
+  View *views;
+  size_t len;
+  CU_ASSERT_EQUAL_FATAL(views_create(s, NULL, &views, &len), 0);
+  // A strip through the sphere, mostly background, so the tiles on the
+  // sphere cost several times the average and are split
+  CU_ASSERT_EQUAL_FATAL(view_crop(&views[0], 0, 340, 600, 380), 0);
+  RenderOptions opts;
+  render_options_default(&opts);
+  opts.tile_order = TILE_ORDER_COST;
+  for (int threads = 1; threads <= 3; threads += 2) {
+    ViewTile *tiles;
+    size_t n;
+    CU_ASSERT_EQUAL_FATAL(views_order_by_cost(s, views, 1, &opts, threads, &tiles, &n), 0);
+    // 19 x 2 tiles, the 4 over the middle of the sphere split in 4 pieces
+    // if there are threads to take them
+    CU_ASSERT_EQUAL(n, threads > 1 ? 38 + 4 * 3 : 38);
+    int area = 0, pieces = 0;
+    for (size_t i = 0; i < n; i++) {
+      ViewTile *tile = &tiles[i];
+      int width = tile->x1 - tile->x0, height = tile->y1 - tile->y0;
+      area += width * height;
+      CU_ASSERT(width <= VIEW_TILE && height <= VIEW_TILE);
+      if (i > 0)
+        CU_ASSERT(tile->cost <= tiles[i - 1].cost);
+      Ray ray = camera_trace_ray(&views[0].camera, (tile->x0 + tile->x1) / 2,
+                                 (tile->y0 + tile->y1) / 2);
+      Intersection hit = scene_find_best_inter(s, &ray);
+      int on_sphere = hit.t != INFINITY && hit.mat->opacity < 1;
+      // Most expensive first: the sphere, and the ground last
+      if (i == 0)
+        CU_ASSERT(on_sphere);
+      if (i == n - 1)
+        CU_ASSERT(!on_sphere);
+      if (width <= VIEW_SUB_TILE && height == VIEW_SUB_TILE) {
+        pieces++;
+        CU_ASSERT(on_sphere);
+      }
+    }
+    CU_ASSERT_EQUAL(area, 600 * 40);
+    CU_ASSERT_EQUAL(pieces, threads > 1 ? 16 : 0);
+    free(tiles);
+  }
+
+  PixelMap *expected = pixel_map_new(600, 40);
+  for (int aa = 0; aa < 2; aa++) {
+    opts.aa_min_samples = aa ? 4 : 1;
+    opts.aa_max_samples = aa ? 16 : 1;
+    RenderStats stats = {0};
+    CU_ASSERT_EQUAL(tracer_render_views(s, views, 1, &opts, 3, &stats), 0);
+    if (!aa)
+      CU_ASSERT_EQUAL(stats.primary_rays, 600 * 40);
+    // The same image as rendering the crop in one piece
+    tracer_render_region(s, &views[0].camera, 0, 340, 600, 380, expected, &opts, NULL);
+    CU_ASSERT(memcmp(views[0].image->data, expected->data, sizeof(PpmColor) * 600 * 40) == 0);
+  }
+  pixel_map_destroy(expected);
+  views_destroy(views, len);
+  scene_destroy(s);
+}
+
+void test_sampler() {
+  Sampler a, b;
+  sampler_start(&a, 7, 3, 4, 5);
+  float first[8];
+  for (int i = 0; i < 8; i++)
+    first[i] = sampler_next_1d(&a);
+  // Only a function of (seed, pixel, sample, dimension): a dimension set
+  // directly, also backwards, gives what drawing up to it gave
+  for (int i = 7; i >= 0; i--) {
+    b = a;
+    b.dimension = (uint32_t) i;
+    CU_ASSERT_EQUAL(sampler_next_1d(&b), first[i]);
+    sampler_start(&b, 7, 3, 4, 5);
+    b.dimension = (uint32_t) i;
+    CU_ASSERT_EQUAL(sampler_next_1d(&b), first[i]);
+  }
+  // 2D draws in between move the 1D ones to later dimensions
+  sampler_start(&b, 7, 3, 4, 5);
+  sampler_next_2d(&b);
+  CU_ASSERT_EQUAL(sampler_next_1d(&b), first[1]);
+  for (int i = 1; i < 8; i++)
+    CU_ASSERT_NOT_EQUAL(first[i], first[0]);
+  sampler_start(&b, 7, 3, 4, 6);
+  CU_ASSERT_NOT_EQUAL(sampler_next_1d(&b), first[0]);
+  sampler_start(&b, 8, 3, 4, 5);
+  CU_ASSERT_NOT_EQUAL(sampler_next_1d(&b), first[0]);
+
+  // Seeking like the wavefront path does for the lights and roulette of
+  // each depth: restarting the sample and setting the dimension
+  RenderOptions opts;
+  render_options_default(&opts);
+  TraceContext ctx;
+  tracer_context_init(&ctx, NULL, NULL, &opts);
+  float seeked[2];
+  for (int i = 0; i < 2; i++) {
+    tracer_seed_sample(&ctx, 3, 4, 5);
+    ctx.sampler.dimension = 3 + 4 * (uint32_t) i;
+    seeked[i] = sampler_next_1d(&ctx.sampler);
+  }
+  CU_ASSERT_NOT_EQUAL(seeked[0], seeked[1]);
+
+  Pcg32 rng, skipped;
+  pcg32_seed(&rng, 1, 2);
+  skipped = rng;
+  for (int i = 0; i < 100; i++)
+    pcg32_next(&rng);
+  pcg32_advance(&skipped, 100);
+  CU_ASSERT_EQUAL(skipped.state, rng.state);
+  pcg32_next(&skipped);
+  pcg32_advance(&skipped, (uint64_t) -1);
+  CU_ASSERT_EQUAL(skipped.state, rng.state);
+}
+
 int main(int argc, char **argv) {
   if (CU_initialize_registry() != CUE_SUCCESS)
     return CU_get_error();
@@ -60,7 +643,24 @@ int main(int argc, char **argv) {
 
   if (NULL == CU_add_test(pSuite, "test_scene", test_scene) ||
       NULL == CU_add_test(pSuite, "test_invalid_scene", test_invalid_scene) ||
-      NULL == CU_add_test(pSuite, "test_empty_scene", test_empty_scene))
+      NULL == CU_add_test(pSuite, "test_empty_scene", test_empty_scene) ||
+      NULL == CU_add_test(pSuite, "test_material_not_shared_between_scenes",
+                          test_material_not_shared_between_scenes) ||
+      NULL == CU_add_test(pSuite, "test_area_light", test_area_light) ||
+      NULL == CU_add_test(pSuite, "test_back_facing_light", test_back_facing_light) ||
+      NULL == CU_add_test(pSuite, "test_progressive", test_progressive) ||
+      NULL == CU_add_test(pSuite, "test_occluder_cache", test_occluder_cache) ||
+      NULL == CU_add_test(pSuite, "test_light_tree", test_light_tree) ||
+      NULL == CU_add_test(pSuite, "test_gbuffer_relight", test_gbuffer_relight) ||
+      NULL == CU_add_test(pSuite, "test_scene_diff", test_scene_diff) ||
+      NULL == CU_add_test(pSuite, "test_views", test_views) ||
+      NULL == CU_add_test(pSuite, "test_trace", test_trace) ||
+      NULL == CU_add_test(pSuite, "test_large_scene", test_large_scene) ||
+      NULL == CU_add_test(pSuite, "test_cost_map", test_cost_map) ||
+      NULL == CU_add_test(pSuite, "test_image_diff", test_image_diff) ||
+      NULL == CU_add_test(pSuite, "test_estimate", test_estimate) ||
+      NULL == CU_add_test(pSuite, "test_tile_order", test_tile_order) ||
+      NULL == CU_add_test(pSuite, "test_sampler", test_sampler))
     goto cleanup;
 
   CU_basic_run_tests();
@@ -0,0 +1,278 @@
+// masptracer-scenegen: writes synthetic scenes of any size for scaling tests
+// and masptracer-bench. The same options and seed always give the same file.
+
+#define _USE_MATH_DEFINES
+#include "sampler.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum { SHAPE_SPHERE, SHAPE_CYLINDER, SHAPE_MESH } Shape;
+typedef enum { LAYOUT_UNIFORM, LAYOUT_CLUSTERED, LAYOUT_THIN } Layout;
+
+// Diffuse materials objects are spread over besides mirrors and glass
+#define DIFFUSE_MATERIALS 8
+#define MATERIALS (DIFFUSE_MATERIALS + 2)
+#define MIRROR DIFFUSE_MATERIALS
+#define GLASS (DIFFUSE_MATERIALS + 1)
+// Centers of the clustered layout
+#define CLUSTERS 16
+// Half the side of the cube objects are placed in
+#define WORLD 50.0f
+// Meshes are spheres of MESH_RINGS x MESH_SEGMENTS quads, split in two
+// triangles except at the poles, where one of them would be empty
+#define MESH_RINGS 8
+#define MESH_SEGMENTS 16
+#define MESH_TRIANGLES (2 * (MESH_RINGS - 1) * MESH_SEGMENTS)
+#define MESH_VERTICES ((MESH_RINGS + 1) * MESH_SEGMENTS)
+
+static long objects = 1000; // primitives, triangles for meshes
+static Shape shape = SHAPE_SPHERE;
+static Layout layout = LAYOUT_UNIFORM;
+static int lights = 4;
+static float mirror_fraction = 0.1f;
+static float glass_fraction = 0.1f;
+static uint32_t seed = 1;
+static int width = 640, height = 480;
+static const char *output_file_name;
+
+static void print_usage(const char *program_name) {
+  fprintf(stderr,
+          "usage: %s [-o file.scene] [--objects n] [--shape sphere|cylinder|mesh]\n"
+          "          [--layout uniform|clustered|thin] [--lights m] [--mirror fraction]\n"
+          "          [--glass fraction] [--seed s] [--imsize width height]\n",
+          program_name);
+  exit(EXIT_FAILURE);
+}
+
+// Uniform in [0, 1), the same for the same stream, index and dimension
+static float random_float(uint32_t stream, uint32_t i, uint32_t dim) {
+  return sampler_hash(seed, stream, i, dim) / 4294967296.0f;
+}
+
+// Standard normal, by Box-Muller
+static float random_normal(uint32_t stream, uint32_t i, uint32_t dim) {
+  float u = 1 - random_float(stream, i, dim), v = random_float(stream, i, dim + 1);
+  return sqrtf(-2 * logf(u)) * cosf(2 * (float) M_PI * v);
+}
+
+// Streams of random numbers, so no two quantities are correlated
+enum { STREAM_POSITION, STREAM_SHAPE, STREAM_MATERIAL, STREAM_LIGHT, STREAM_CLUSTER };
+
+// Size of an object so the objects fill about the same share of the world
+// whatever their number
+static float object_radius(long count) {
+  return 0.5f * WORLD / cbrtf((float) count);
+}
+
+static void object_position(long i, float out[3]) {
+  switch (layout) {
+  case LAYOUT_UNIFORM:
+    for (int k = 0; k < 3; k++)
+      out[k] = WORLD * (2 * random_float(STREAM_POSITION, i, k) - 1);
+    break;
+  case LAYOUT_CLUSTERED: {
+    uint32_t cluster = sampler_hash(seed, STREAM_CLUSTER, i, 0) % CLUSTERS;
+    for (int k = 0; k < 3; k++)
+      out[k] = 0.8f * WORLD * (2 * random_float(STREAM_CLUSTER, cluster, k + 1) - 1) +
+               0.08f * WORLD * random_normal(STREAM_POSITION, i, 2 * k);
+    break;
+  }
+  case LAYOUT_THIN:
+    // A rod ten times the world long and a twentieth of it thick
+    out[0] = 10 * WORLD * (2 * random_float(STREAM_POSITION, i, 0) - 1);
+    out[1] = 0.05f * WORLD * (2 * random_float(STREAM_POSITION, i, 1) - 1);
+    out[2] = 0.05f * WORLD * (2 * random_float(STREAM_POSITION, i, 2) - 1);
+    break;
+  }
+}
+
+static int object_material(long i) {
+  float u = random_float(STREAM_MATERIAL, i, 0);
+  if (u < mirror_fraction)
+    return MIRROR;
+  if (u < mirror_fraction + glass_fraction)
+    return GLASS;
+  return sampler_hash(seed, STREAM_MATERIAL, i, 1) % DIFFUSE_MATERIALS;
+}
+
+static void write_material(FILE *out, int material) {
+  if (material == MIRROR) {
+    fprintf(out, "mtlcolor 0.05 0.05 0.05 1 1 1 0.02 0.1 0.9 200 1 20\n");
+  } else if (material == GLASS) {
+    fprintf(out, "mtlcolor 0.9 0.95 1 1 1 1 0.02 0.1 0.5 100 0.1 1.5\n");
+  } else {
+    // Fully saturated hues around the color wheel
+    float h = 6.0f * material / DIFFUSE_MATERIALS, c[3];
+    for (int k = 0; k < 3; k++) {
+      float d = fabsf(fmodf(h + 4 * k, 6) - 3);
+      c[k] = fminf(fmaxf(d - 1, 0), 1);
+    }
+    fprintf(out, "mtlcolor %.2f %.2f %.2f 1 1 1 0.1 0.7 0.2 20 1 1\n", c[0], c[1], c[2]);
+  }
+}
+
+static void write_object(FILE *out, long i, float radius) {
+  float p[3];
+  object_position(i, p);
+  if (shape == SHAPE_SPHERE) {
+    fprintf(out, "sphere %.3f %.3f %.3f %.3f\n", p[0], p[1], p[2], radius);
+    return;
+  }
+  if (shape == SHAPE_CYLINDER) {
+    // Randomly oriented, as long as a sphere is wide and half as thick
+    float z = 2 * random_float(STREAM_SHAPE, i, 0) - 1;
+    float phi = 2 * (float) M_PI * random_float(STREAM_SHAPE, i, 1);
+    float r = sqrtf(fmaxf(0, 1 - z * z));
+    fprintf(out, "cylinder %.3f %.3f %.3f %.4f %.4f %.4f %.3f %.3f\n", p[0], p[1], p[2],
+            r * cosf(phi), r * sinf(phi), z, radius / 2, 2 * radius);
+    return;
+  }
+  // Triangles of mesh i, whose vertices were written by write_mesh_vertices
+  long base = 1 + i * MESH_VERTICES;
+  for (int ring = 0; ring < MESH_RINGS; ring++) {
+    for (int seg = 0; seg < MESH_SEGMENTS; seg++) {
+      long a = base + ring * MESH_SEGMENTS + seg;
+      long b = base + ring * MESH_SEGMENTS + (seg + 1) % MESH_SEGMENTS;
+      long c = a + MESH_SEGMENTS, d = b + MESH_SEGMENTS;
+      if (ring > 0)
+        fprintf(out, "f %ld %ld %ld\n", a, c, b);
+      if (ring < MESH_RINGS - 1)
+        fprintf(out, "f %ld %ld %ld\n", b, c, d);
+    }
+  }
+}
+
+static void write_mesh_vertices(FILE *out, long meshes, float radius) {
+  for (long i = 0; i < meshes; i++) {
+    float p[3];
+    object_position(i, p);
+    for (int ring = 0; ring <= MESH_RINGS; ring++) {
+      float theta = (float) M_PI * ring / MESH_RINGS;
+      for (int seg = 0; seg < MESH_SEGMENTS; seg++) {
+        float phi = 2 * (float) M_PI * seg / MESH_SEGMENTS;
+        fprintf(out, "v %.3f %.3f %.3f\n", p[0] + radius * sinf(theta) * cosf(phi),
+                p[1] + radius * cosf(theta), p[2] + radius * sinf(theta) * sinf(phi));
+      }
+    }
+  }
+}
+
+static void write_lights(FILE *out) {
+  for (int i = 0; i < lights; i++) {
+    float p[3];
+    for (int k = 0; k < 3; k++)
+      p[k] = 1.5f * WORLD * (2 * random_float(STREAM_LIGHT, i, k) - 1);
+    p[1] = fabsf(p[1]) + WORLD; // above the objects
+    // Few lights light everything, many light their surroundings (see light_tree.h)
+    float intensity = lights <= 8 ? 1.0f / lights : 1;
+    if (lights <= 8)
+      fprintf(out, "light %.2f %.2f %.2f 1 %.3f %.3f %.3f\n", p[0], p[1], p[2], intensity,
+              intensity, intensity);
+    else
+      fprintf(out, "attlight %.2f %.2f %.2f 1 %.3f %.3f %.3f 1 0 %.6f\n", p[0], p[1], p[2],
+              intensity, intensity, intensity, 4.0f * lights / (WORLD * WORLD * 9));
+  }
+}
+
+static int write_scene(FILE *out) {
+  long count = shape == SHAPE_MESH ? (objects + MESH_TRIANGLES - 1) / MESH_TRIANGLES : objects;
+  float radius = object_radius(count);
+  float distance = layout == LAYOUT_THIN ? 12 * WORLD : 3 * WORLD;
+  fprintf(out, "# masptracer-scenegen --objects %ld --shape %s --layout %s --lights %d "
+               "--mirror %g --glass %g --seed %u\n",
+          objects, shape == SHAPE_SPHERE ? "sphere" : shape == SHAPE_CYLINDER ? "cylinder" : "mesh",
+          layout == LAYOUT_UNIFORM ? "uniform" : layout == LAYOUT_CLUSTERED ? "clustered" : "thin",
+          lights, mirror_fraction, glass_fraction, seed);
+  fprintf(out, "eye 0 %.1f %.1f\nviewdir 0 -0.3 -1\nupdir 0 1 0\nhfov 60\n", 0.3f * distance,
+          distance);
+  fprintf(out, "imsize %d %d\nbkgcolor 0.1 0.1 0.15\n\n", width, height);
+  write_lights(out);
+  if (shape == SHAPE_MESH)
+    write_mesh_vertices(out, count, radius);
+  // Grouped by material, so every material is declared once
+  for (int material = 0; material < MATERIALS; material++) {
+    fprintf(out, "\n");
+    write_material(out, material);
+    for (long i = 0; i < count; i++) {
+      if (object_material(i) == material)
+        write_object(out, i, radius);
+    }
+  }
+  return ferror(out) ? EIO : 0;
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      output_file_name = argv[i];
+    } else if (strcmp(argv[i], "--objects") == 0) {
+      if (++i >= argc || (objects = atol(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--shape") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      if (strcmp(argv[i], "sphere") == 0)
+        shape = SHAPE_SPHERE;
+      else if (strcmp(argv[i], "cylinder") == 0)
+        shape = SHAPE_CYLINDER;
+      else if (strcmp(argv[i], "mesh") == 0)
+        shape = SHAPE_MESH;
+      else
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--layout") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      if (strcmp(argv[i], "uniform") == 0)
+        layout = LAYOUT_UNIFORM;
+      else if (strcmp(argv[i], "clustered") == 0)
+        layout = LAYOUT_CLUSTERED;
+      else if (strcmp(argv[i], "thin") == 0)
+        layout = LAYOUT_THIN;
+      else
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--lights") == 0) {
+      if (++i >= argc || (lights = atoi(argv[i])) <= 0)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--mirror") == 0) {
+      if (++i >= argc || (mirror_fraction = atof(argv[i])) < 0 || mirror_fraction > 1)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--glass") == 0) {
+      if (++i >= argc || (glass_fraction = atof(argv[i])) < 0 || glass_fraction > 1)
+        print_usage(argv[0]);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      if (++i >= argc)
+        print_usage(argv[0]);
+      seed = (uint32_t) strtoul(argv[i], NULL, 10);
+    } else if (strcmp(argv[i], "--imsize") == 0) {
+      if (i + 2 >= argc || (width = atoi(argv[i + 1])) <= 0 ||
+          (height = atoi(argv[i + 2])) <= 0)
+        print_usage(argv[0]);
+      i += 2;
+    } else {
+      print_usage(argv[0]);
+    }
+  }
+  if (mirror_fraction + glass_fraction > 1)
+    print_usage(argv[0]);
+
+  FILE *out = output_file_name ? fopen(output_file_name, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "failed to create %s: %s\n", output_file_name, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  // Large buffer, scenes with millions of objects are mostly write calls otherwise
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+  int rc = write_scene(out);
+  if (output_file_name && fclose(out) != 0 && rc == 0)
+    rc = errno;
+  if (rc != 0) {
+    fprintf(stderr, "failed to write the scene: %s\n", strerror(rc));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
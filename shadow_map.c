@@ -0,0 +1,228 @@
+#include "shadow_map.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Primary rays per image side used to find the surfaces the camera sees
+#define FIT_GRID 64
+
+// Cube face f (+x, -x, +y, -y, +z, -z) at face coordinates a, b in [-1, 1]
+static Vec3 cube_dir(int face, float a, float b) {
+  switch (face) {
+  case 0: return (Vec3) {1, a, b};
+  case 1: return (Vec3) {-1, a, b};
+  case 2: return (Vec3) {a, 1, b};
+  case 3: return (Vec3) {a, -1, b};
+  case 4: return (Vec3) {a, b, 1};
+  default: return (Vec3) {a, b, -1};
+  }
+}
+
+// Inverse of cube_dir
+static int cube_face(Vec3 d, float *a, float *b) {
+  float ax = fabs(d.x), ay = fabs(d.y), az = fabs(d.z);
+  if (ax >= ay && ax >= az) {
+    *a = d.y / ax;
+    *b = d.z / ax;
+    return d.x > 0 ? 0 : 1;
+  }
+  if (ay >= az) {
+    *a = d.x / ay;
+    *b = d.z / ay;
+    return d.y > 0 ? 2 : 3;
+  }
+  *a = d.x / az;
+  *b = d.y / az;
+  return d.z > 0 ? 4 : 5;
+}
+
+static ShadowTexel cast_texel(Scene *scene, Ray *ray) {
+  ShadowTexel texel;
+  Intersection in = scene_find_best_inter(scene, ray);
+  texel.depth = in.t;
+  texel.obj = in.t == INFINITY ? -1 : (int) (in.obj - scene->objects);
+  return texel;
+}
+
+static void build_cube_map(Scene *scene, ShadowMap *map) {
+  int size = map->size;
+  for (int face = 0; face < 6; face++) {
+    for (int j = 0; j < size; j++) {
+      for (int i = 0; i < size; i++) {
+        Ray ray;
+        ray.pos = map->pos;
+        ray.dir = norm(cube_dir(face, (i + 0.5f) / size * 2 - 1,
+                                (j + 0.5f) / size * 2 - 1));
+        map->texels[(face * size + j) * size + i] = cast_texel(scene, &ray);
+      }
+    }
+  }
+}
+
+// Fits the map to the surfaces seen by camera, as seen along the light's
+// direction. Returns 0 if the camera sees nothing.
+static int fit_ortho_map(Scene *scene, Camera *camera, ShadowMap *map) {
+  float umin = INFINITY, umax = -INFINITY, vmin = INFINITY, vmax = -INFINITY;
+  for (int j = 0; j < FIT_GRID; j++) {
+    for (int i = 0; i < FIT_GRID; i++) {
+      Ray ray = camera_trace_ray_subpixel(
+        camera, (i + 0.5f) * camera->window_pixel_width / FIT_GRID,
+        (j + 0.5f) * camera->window_pixel_height / FIT_GRID);
+      Intersection in = scene_find_best_inter(scene, &ray);
+      if (in.t == INFINITY)
+        continue;
+      float pu = dot(in.pos, map->u), pv = dot(in.pos, map->v);
+      umin = MIN(umin, pu);
+      umax = MAX(umax, pu);
+      vmin = MIN(vmin, pv);
+      vmax = MAX(vmax, pv);
+    }
+  }
+  if (umin > umax)
+    return 0;
+
+  // Leave a margin for surfaces between the fit samples
+  float extent = MAX(umax - umin, vmax - vmin) * 1.1f + 0.01f;
+  map->texel = extent / map->size;
+  map->u0 = (umin + umax - extent) / 2;
+  map->v0 = (vmin + vmax - extent) / 2;
+
+  Vec3 bmin = {INFINITY, INFINITY, INFINITY};
+  Vec3 bmax = {-INFINITY, -INFINITY, -INFINITY};
+  for (size_t i = 0; i < scene->objects_len; i++) {
+    Vec3 c;
+    float r = scene_object_bounds(scene, &scene->objects[i], &c);
+    bmin.x = MIN(bmin.x, c.x - r);
+    bmin.y = MIN(bmin.y, c.y - r);
+    bmin.z = MIN(bmin.z, c.z - r);
+    bmax.x = MAX(bmax.x, c.x + r);
+    bmax.y = MAX(bmax.y, c.y + r);
+    bmax.z = MAX(bmax.z, c.z + r);
+  }
+  Vec3 center = vecmul(vecadd(bmin, bmax), 0.5f);
+  map->plane = dot(center, map->dir) - veclen(vecsub(bmax, center)) - 1;
+  return 1;
+}
+
+static void build_ortho_map(Scene *scene, ShadowMap *map) {
+  int size = map->size;
+  for (int j = 0; j < size; j++) {
+    for (int i = 0; i < size; i++) {
+      Ray ray;
+      ray.pos = vecadd(vecmul(map->dir, map->plane),
+                       vecadd(vecmul(map->u, map->u0 + (i + 0.5f) * map->texel),
+                              vecmul(map->v, map->v0 + (j + 0.5f) * map->texel)));
+      ray.dir = map->dir;
+      map->texels[j * size + i] = cast_texel(scene, &ray);
+    }
+  }
+}
+
+ShadowMaps *shadow_maps_build(Scene *scene, Camera *camera, int size) {
+  ShadowMaps *maps = calloc(1, sizeof(ShadowMaps));
+  if (!maps)
+    return NULL;
+  maps->objects = scene->objects;
+  maps->len = scene->lights_len;
+  maps->maps = calloc(scene->lights_len ? scene->lights_len : 1, sizeof(ShadowMap));
+  if (!maps->maps) {
+    shadow_maps_destroy(maps);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < scene->lights_len && i < SHADOW_MAP_MAX_LIGHTS; i++) {
+    Light *light = &scene->lights[i];
+    ShadowMap *map = &maps->maps[i];
+    if (light->w && light->radius > 0)
+      continue; // area lights have soft shadows
+
+    map->size = size;
+    if (!light->w) {
+      map->dir = light->pos;
+      Vec3 helper = fabs(map->dir.x) < 0.9 ? (Vec3) {1, 0, 0} : (Vec3) {0, 1, 0};
+      map->u = norm(cross(map->dir, helper));
+      map->v = cross(map->dir, map->u);
+      if (!fit_ortho_map(scene, camera, map))
+        continue;
+    }
+
+    int faces = light->w ? 6 : 1;
+    map->texels = malloc(sizeof(ShadowTexel) * faces * size * size);
+    if (!map->texels) {
+      shadow_maps_destroy(maps);
+      return NULL;
+    }
+    map->pos = light->pos;
+    if (light->w)
+      build_cube_map(scene, map);
+    else
+      build_ortho_map(scene, map);
+    map->faces = faces;
+  }
+  return maps;
+}
+
+void shadow_maps_destroy(ShadowMaps *maps) {
+  if (!maps)
+    return;
+  if (maps->maps)
+    for (size_t i = 0; i < maps->len; i++)
+      free(maps->maps[i].texels);
+  free(maps->maps);
+  free(maps);
+}
+
+// Lower left texel of the 2x2 texels around continuous texel coordinate x
+static int texel_base(float x, int size) {
+  int base = (int) floor(x);
+  return base < 0 ? 0 : base > size - 2 ? size - 2 : base;
+}
+
+int shadow_maps_lookup(const ShadowMaps *maps, int light_index, Vec3 pos,
+                       const Object *self) {
+  if (light_index < 0 || (size_t) light_index >= maps->len)
+    return SHADOW_MAP_UNKNOWN;
+  const ShadowMap *map = &maps->maps[light_index];
+  if (map->faces == 0 || map->size < 2)
+    return SHADOW_MAP_UNKNOWN;
+
+  int size = map->size;
+  const ShadowTexel *face;
+  float x, y, depth, bias;
+  if (map->faces == 6) {
+    Vec3 d = vecsub(pos, map->pos);
+    float a, b;
+    int f = cube_face(d, &a, &b);
+    x = (a + 1) / 2 * size - 0.5f;
+    y = (b + 1) / 2 * size - 0.5f;
+    face = &map->texels[f * size * size];
+    depth = veclen(d);
+    bias = depth * 4 / size + 0.01f;
+  } else {
+    x = (dot(pos, map->u) - map->u0) / map->texel - 0.5f;
+    y = (dot(pos, map->v) - map->v0) / map->texel - 0.5f;
+    if (x < 0 || y < 0 || x > size - 1 || y > size - 1)
+      return SHADOW_MAP_UNKNOWN;
+    face = map->texels;
+    depth = dot(pos, map->dir) - map->plane;
+    bias = 3 * map->texel + 0.01f;
+  }
+
+  int self_index = self ? (int) (self - maps->objects) : -1;
+  int x0 = texel_base(x, size), y0 = texel_base(y, size);
+  int lit = 0, occluded = 0;
+  for (int j = 0; j < 2; j++) {
+    for (int i = 0; i < 2; i++) {
+      const ShadowTexel *texel = &face[(y0 + j) * size + x0 + i];
+      if (texel->depth >= depth - bias)
+        lit++;
+      else if (texel->obj != self_index)
+        occluded++;
+    }
+  }
+  if (lit == 4)
+    return SHADOW_MAP_LIT;
+  if (occluded == 4)
+    return SHADOW_MAP_OCCLUDED;
+  return SHADOW_MAP_UNKNOWN;
+}
@@ -0,0 +1,61 @@
+#ifndef RAYTRACERPROJ__SHADOW_MAP_H_
+#define RAYTRACERPROJ__SHADOW_MAP_H_
+
+#include "camera.h"
+#include "scene.h"
+
+// Results of a shadow map lookup
+#define SHADOW_MAP_UNKNOWN (-1) // trace a shadow ray
+#define SHADOW_MAP_OCCLUDED 0
+#define SHADOW_MAP_LIT 1
+
+// Only the first lights of a scene get maps, which bounds the memory used in
+// scenes with many lights (6 * size^2 texels per point light)
+#define SHADOW_MAP_MAX_LIGHTS 32
+
+// The first surface seen from the light through one texel
+typedef struct ShadowTexel {
+  float depth; // INFINITY if the texel sees nothing
+  int obj; // index into the scene's objects, -1 if the texel sees nothing
+} ShadowTexel;
+
+// Depth map of a single light: a cube map around point lights, an
+// orthographic map covering the visible part of the scene for directional
+// lights
+typedef struct ShadowMap {
+  int faces; // 6 for cube maps, 1 for orthographic maps, 0 if there is no map
+  int size; // texels along each side of a face
+  Vec3 pos; // cube maps: position of the light
+  Vec3 u, v, dir; // orthographic maps: texel axes and direction of the light
+  float u0, v0, texel; // orthographic maps: position of texel (0, 0) and texel size
+  float plane; // orthographic maps: dot(p, dir) where depths start
+  ShadowTexel *texels;
+} ShadowMap;
+
+typedef struct ShadowMaps {
+  const Object *objects; // the scene's objects, which texels refer to
+  ShadowMap *maps; // one per scene light, in the same order
+  size_t len;
+} ShadowMaps;
+
+/**
+ * Ray casts a depth map of size x size texels (per cube face) for each of the
+ * first SHADOW_MAP_MAX_LIGHTS lights of scene that cast hard shadows.
+ * Directional light maps are fit to the surfaces camera sees. Build the maps
+ * once per frame and share them between all threads rendering it through
+ * RenderOptions.shadow_maps.
+ *
+ * @return The maps (free with shadow_maps_destroy), or NULL if out of memory
+ */
+ShadowMaps *shadow_maps_build(Scene *scene, Camera *camera, int size);
+void shadow_maps_destroy(ShadowMaps *maps);
+
+/**
+ * Decides whether the light with index light_index reaches pos on object self
+ * from the 2x2 texels around it. Whenever they disagree (at shadow edges) or
+ * pos is outside the map, the answer is SHADOW_MAP_UNKNOWN.
+ */
+int shadow_maps_lookup(const ShadowMaps *maps, int light_index, Vec3 pos,
+                       const Object *self);
+
+#endif //RAYTRACERPROJ__SHADOW_MAP_H_
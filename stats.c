@@ -0,0 +1,175 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static const char *const stage_names[STAGE_COUNT] = {
+  "parse", "textures", "accel", "render", "write"};
+static const char *const object_names[3] = {"sphere", "cylinder", "triangle"};
+
+void render_stats_merge(RenderStats *dst, const RenderStats *src) {
+  dst->primary_rays += src->primary_rays;
+  dst->reflection_rays += src->reflection_rays;
+  dst->refraction_rays += src->refraction_rays;
+  dst->shadow_rays += src->shadow_rays;
+  dst->shadow_occluded += src->shadow_occluded;
+  dst->shadow_cache_hits += src->shadow_cache_hits;
+  dst->shadow_map_hits += src->shadow_map_hits;
+  dst->shadow_skipped += src->shadow_skipped;
+  dst->shadow_probe_exits += src->shadow_probe_exits;
+  for (int i = 0; i < 3; i++)
+    dst->object_tests[i] += src->object_tests[i];
+  dst->light_nodes += src->light_nodes;
+}
+
+uint64_t render_stats_rays(const RenderStats *stats) {
+  return stats->primary_rays + stats->reflection_rays + stats->refraction_rays +
+         stats->shadow_rays;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? 100.0 * part / total : 0;
+}
+
+void render_stats_print(FILE *out, const RenderStats *stats) {
+  fprintf(out, "Rays: %" PRIu64 " primary, %" PRIu64 " reflection, %" PRIu64
+               " refraction\n",
+          stats->primary_rays, stats->reflection_rays, stats->refraction_rays);
+  fprintf(out, "Shadow rays: %" PRIu64 ", %" PRIu64 " occluded, "
+               "%.1f%% of those by the cached occluder\n",
+          stats->shadow_rays, stats->shadow_occluded,
+          percent(stats->shadow_cache_hits, stats->shadow_occluded));
+  fprintf(out, "Shadow tests skipped: %" PRIu64 " lights that couldn't change the color, "
+               "%" PRIu64 " area lights decided by probes\n",
+          stats->shadow_skipped, stats->shadow_probe_exits);
+  if (stats->shadow_map_hits)
+    fprintf(out, "Shadow map lookups: %" PRIu64 " answered without a ray\n",
+            stats->shadow_map_hits);
+  fprintf(out, "Intersection tests: %" PRIu64 " sphere, %" PRIu64 " cylinder, %" PRIu64
+               " triangle; light tree nodes visited: %" PRIu64 "\n",
+          stats->object_tests[0], stats->object_tests[1], stats->object_tests[2],
+          stats->light_nodes);
+}
+
+double stats_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+long stats_peak_memory_kb(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss; // KiB on Linux
+}
+
+// Millions of rays per second of render time
+static double mrays_per_second(const RunStats *stats) {
+  double seconds = stats->stage_seconds[STAGE_RENDER];
+  return seconds > 0 ? render_stats_rays(&stats->render) / seconds / 1e6 : 0;
+}
+
+static int counted(const PerfSample *sample, PerfEvent event) {
+  return (sample->available >> event) & 1;
+}
+
+// Prints the IPC or misses per 1000 instructions, n/a if not counted
+static void print_perf_ratio(FILE *out, const char *label, const PerfSample *sample,
+                             PerfEvent event, PerfEvent per, double scale) {
+  if (!counted(sample, event) || !counted(sample, per) || !sample->counts[per])
+    fprintf(out, "%s n/a", label);
+  else
+    fprintf(out, "%s %.2lf", label, (double) sample->counts[event] * scale / sample->counts[per]);
+}
+
+static void print_perf(FILE *out, const RunStats *stats) {
+  unsigned available = 0;
+  for (int i = 0; i < STAGE_COUNT; i++)
+    available |= stats->stage_perf[i].available;
+  if (!available) {
+    fprintf(out, "Hardware counters: unavailable\n");
+    return;
+  }
+  fprintf(out, "Hardware counters (misses per 1000 instructions):\n");
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const PerfSample *sample = &stats->stage_perf[i];
+    if (!sample->available)
+      continue; // e.g. textures, which are counted as part of parsing
+    fprintf(out, "  %-8s", stage_names[i]);
+    print_perf_ratio(out, " IPC", sample, PERF_INSTRUCTIONS, PERF_CYCLES, 1);
+    print_perf_ratio(out, ", L1d", sample, PERF_L1D_MISSES, PERF_INSTRUCTIONS, 1000);
+    print_perf_ratio(out, ", LLC", sample, PERF_LLC_MISSES, PERF_INSTRUCTIONS, 1000);
+    print_perf_ratio(out, ", branch", sample, PERF_BRANCH_MISSES, PERF_INSTRUCTIONS, 1000);
+    fprintf(out, "\n");
+  }
+}
+
+void run_stats_print(FILE *out, const RunStats *stats) {
+  fprintf(out, "Stages:");
+  for (int i = 0; i < STAGE_COUNT; i++)
+    fprintf(out, " %s %.3lf s%s", stage_names[i], stats->stage_seconds[i],
+            i + 1 < STAGE_COUNT ? "," : "\n");
+  fprintf(out, "Throughput: %.2lf Mrays/s on %d thread%s, peak memory %.1lf MiB\n",
+          mrays_per_second(stats), stats->threads, stats->threads == 1 ? "" : "s",
+          stats->peak_memory_kb / 1024.0);
+  render_stats_print(out, &stats->render);
+  if (stats->perf)
+    print_perf(out, stats);
+}
+
+// Writes the counts of a stage, null for events that weren't counted
+static void write_perf_json(FILE *out, const PerfSample *sample) {
+  fprintf(out, "{");
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    fprintf(out, "%s\"%s\": ", i ? ", " : "", perf_event_name(i));
+    if (counted(sample, i))
+      fprintf(out, "%" PRIu64, sample->counts[i]);
+    else
+      fprintf(out, "null");
+  }
+  fprintf(out, "}");
+}
+
+int run_stats_write_json(const RunStats *stats, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return errno;
+
+  const RenderStats *r = &stats->render;
+  fprintf(out, "{\n  \"stage_seconds\": {");
+  for (int i = 0; i < STAGE_COUNT; i++)
+    fprintf(out, "%s\"%s\": %.6lf", i ? ", " : "", stage_names[i], stats->stage_seconds[i]);
+  fprintf(out, "},\n");
+  fprintf(out, "  \"threads\": %d,\n", stats->threads);
+  fprintf(out, "  \"mrays_per_second\": %.6lf,\n", mrays_per_second(stats));
+  fprintf(out, "  \"peak_memory_kb\": %ld,\n", stats->peak_memory_kb);
+  fprintf(out, "  \"rays\": {\"primary\": %" PRIu64 ", \"reflection\": %" PRIu64
+               ", \"refraction\": %" PRIu64 ", \"shadow\": %" PRIu64 "},\n",
+          r->primary_rays, r->reflection_rays, r->refraction_rays, r->shadow_rays);
+  fprintf(out, "  \"shadow\": {\"occluded\": %" PRIu64 ", \"cache_hits\": %" PRIu64
+               ", \"map_hits\": %" PRIu64 ", \"skipped\": %" PRIu64
+               ", \"probe_exits\": %" PRIu64 "},\n",
+          r->shadow_occluded, r->shadow_cache_hits, r->shadow_map_hits,
+          r->shadow_skipped, r->shadow_probe_exits);
+  fprintf(out, "  \"object_tests\": {");
+  for (int i = 0; i < 3; i++)
+    fprintf(out, "%s\"%s\": %" PRIu64, i ? ", " : "", object_names[i], r->object_tests[i]);
+  fprintf(out, "},\n");
+  fprintf(out, "  \"light_nodes\": %" PRIu64 "%s\n", r->light_nodes, stats->perf ? "," : "");
+  if (stats->perf) {
+    fprintf(out, "  \"perf\": {");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      fprintf(out, "%s\n    \"%s\": ", i ? "," : "", stage_names[i]);
+      write_perf_json(out, &stats->stage_perf[i]);
+    }
+    fprintf(out, "\n  }\n");
+  }
+  fprintf(out, "}\n");
+
+  if (fclose(out) != 0)
+    return errno;
+  return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef RAYTRACERPROJ__STATS_H_
+#define RAYTRACERPROJ__STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "perf_counters.h"
+
+// Counters of a render. Every TraceContext counts into its own copy, which is
+// merged into the caller's once the context is done, so counting needs no
+// synchronization between threads.
+typedef struct RenderStats {
+  uint64_t primary_rays; // camera rays, including the ones finding edges for anti-aliasing
+  uint64_t reflection_rays;
+  uint64_t refraction_rays;
+  uint64_t shadow_rays; // shadow rays tested against the scene
+  uint64_t shadow_occluded; // shadow rays that hit something
+  uint64_t shadow_cache_hits; // shadow rays blocked by their light's cached occluder
+  uint64_t shadow_map_hits; // shadow queries answered by a shadow map
+  uint64_t shadow_skipped; // lights not shadow tested since they couldn't change the color
+  uint64_t shadow_probe_exits; // area light hits decided by the probe rays alone
+  uint64_t object_tests[3]; // ray-object intersection tests, indexed by ObjectType
+  uint64_t light_nodes; // light tree nodes visited
+} RenderStats;
+
+// The stages of a run, timed separately
+typedef enum {
+  STAGE_PARSE, // reading the scene file, without textures
+  STAGE_TEXTURES, // reading texture files
+  STAGE_ACCEL, // building the light tree and shadow maps
+  STAGE_RENDER,
+  STAGE_WRITE, // writing the images, tiled output is written while rendering
+  STAGE_COUNT
+} RenderStage;
+
+// Everything reported about a run
+typedef struct RunStats {
+  double stage_seconds[STAGE_COUNT]; // wall time
+  long peak_memory_kb; // maximum resident set size
+  int threads;
+  RenderStats render;
+  int perf; // whether hardware counters were requested
+  PerfSample stage_perf[STAGE_COUNT]; // hardware counters of each stage, if requested
+} RunStats;
+
+/**
+ * Adds the counters of src to dst
+ */
+void render_stats_merge(RenderStats *dst, const RenderStats *src);
+
+/**
+ * @return The number of rays of any kind traced
+ */
+uint64_t render_stats_rays(const RenderStats *stats);
+
+/**
+ * Writes a human readable summary of stats to out
+ */
+void render_stats_print(FILE *out, const RenderStats *stats);
+
+/**
+ * @return Seconds on a monotonic wall clock, for timing stages
+ */
+double stats_clock(void);
+
+/**
+ * @return The peak resident memory of the process so far in KiB, 0 if unknown
+ */
+long stats_peak_memory_kb(void);
+
+/**
+ * Writes a human readable report of stage times, throughput, memory, the
+ * render counters and, if requested, IPC and miss rates of each stage to out
+ */
+void run_stats_print(FILE *out, const RunStats *stats);
+
+/**
+ * Writes the report of run_stats_print as a JSON object to path
+ *
+ * @return 0 if successful, errno otherwise
+ */
+int run_stats_write_json(const RunStats *stats, const char *path);
+
+#endif //RAYTRACERPROJ__STATS_H_
@@ -0,0 +1,159 @@
+#include "trace.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Trace *trace_new(int threads) {
+  Trace *trace = malloc(sizeof(Trace));
+  if (!trace)
+    return NULL;
+  trace->origin = stats_clock();
+  trace->threads = threads;
+  trace->spans = NULL;
+  trace->spans_len = trace->spans_cap = 0;
+  trace->buffers = calloc(threads, sizeof(TraceBuffer));
+  if (!trace->buffers) {
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+void trace_destroy(Trace *trace) {
+  if (!trace)
+    return;
+  for (int i = 0; i < trace->threads; i++)
+    free(trace->buffers[i].events);
+  free(trace->buffers);
+  free(trace->spans);
+  free(trace);
+}
+
+TraceBuffer *trace_buffer(Trace *trace, int i) {
+  if (!trace || i < 0 || i >= trace->threads)
+    return NULL;
+  return &trace->buffers[i];
+}
+
+// The slot of the next event, NULL if it can't be recorded
+static TraceEvent *next_event(TraceBuffer *buffer) {
+  if (!buffer)
+    return NULL;
+  // Allocated by the thread itself, so threads that record nothing cost nothing
+  if (!buffer->events && !(buffer->events = malloc(sizeof(TraceEvent) * TRACE_BUFFER_EVENTS)))
+    return NULL;
+  return &buffer->events[buffer->recorded++ % TRACE_BUFFER_EVENTS];
+}
+
+void trace_span(Trace *trace, const char *name, double begin, double end) {
+  if (!trace)
+    return;
+  if (trace->spans_len == trace->spans_cap) {
+    size_t cap = trace->spans_cap ? trace->spans_cap * 2 : 16;
+    TraceEvent *spans = realloc(trace->spans, sizeof(TraceEvent) * cap);
+    if (!spans)
+      return;
+    trace->spans = spans;
+    trace->spans_cap = cap;
+  }
+  trace->spans[trace->spans_len++] = (TraceEvent) {TRACE_SPAN, name, "", 0, 0, begin, end, 0};
+}
+
+void trace_tile(TraceBuffer *buffer, const char *view, int x, int y, double begin, double end) {
+  TraceEvent *event = next_event(buffer);
+  if (!event)
+    return;
+  *event = (TraceEvent) {TRACE_SPAN, "tile", "", x, y, begin, end, 0};
+  strncpy(event->view, view, TRACE_VIEW_NAME - 1);
+}
+
+void trace_counter(TraceBuffer *buffer, const char *name, double time, int64_t value) {
+  TraceEvent *event = next_event(buffer);
+  if (!event)
+    return;
+  *event = (TraceEvent) {TRACE_COUNTER, name, "", 0, 0, time, time, value};
+}
+
+// Writes s as a JSON string, view names come from the scene file
+static void write_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static void write_event(FILE *out, const Trace *trace, int tid, const TraceEvent *event) {
+  // Timestamps are in microseconds
+  double ts = (event->begin - trace->origin) * 1e6;
+  fprintf(out, "{\"name\": ");
+  write_string(out, event->name);
+  if (event->type == TRACE_COUNTER) {
+    fprintf(out, ", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, \"ts\": %.3lf, "
+                 "\"args\": {\"value\": %" PRId64 "}}",
+            tid, ts, event->value);
+    return;
+  }
+  fprintf(out, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3lf, \"dur\": %.3lf",
+          tid, ts, (event->end - event->begin) * 1e6);
+  if (event->view[0]) {
+    fprintf(out, ", \"args\": {\"view\": ");
+    write_string(out, event->view);
+    fprintf(out, ", \"x\": %d, \"y\": %d}", event->x, event->y);
+  }
+  fprintf(out, "}");
+}
+
+int trace_write_json(const Trace *trace, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return errno;
+
+  size_t dropped = 0;
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+               "\"args\": {\"name\": \"masptracer\"}}");
+  for (int tid = 0; tid < trace->threads; tid++) {
+    const TraceBuffer *buffer = &trace->buffers[tid];
+    if (!buffer->events && (tid != 0 || !trace->spans_len))
+      continue;
+    if (tid == 0)
+      fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+                   "\"args\": {\"name\": \"main\"}}");
+    else
+      fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                   "\"args\": {\"name\": \"worker %d\"}}", tid, tid);
+    for (size_t i = 0; tid == 0 && i < trace->spans_len; i++) {
+      fprintf(out, ",\n");
+      write_event(out, trace, tid, &trace->spans[i]);
+    }
+    // Oldest first; a full buffer starts at the slot that would be written next
+    size_t kept = buffer->events ? buffer->recorded : 0, first = 0;
+    if (kept > TRACE_BUFFER_EVENTS) {
+      dropped += kept - TRACE_BUFFER_EVENTS;
+      first = kept % TRACE_BUFFER_EVENTS;
+      kept = TRACE_BUFFER_EVENTS;
+    }
+    for (size_t i = 0; i < kept; i++) {
+      fprintf(out, ",\n");
+      write_event(out, trace, tid, &buffer->events[(first + i) % TRACE_BUFFER_EVENTS]);
+    }
+  }
+  fprintf(out, "\n]}\n");
+  if (dropped)
+    fprintf(stderr, "trace: %zu of the oldest events were overwritten\n", dropped);
+
+  if (fclose(out) != 0)
+    return errno;
+  return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef RAYTRACERPROJ__TRACE_H_
+#define RAYTRACERPROJ__TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events kept per thread, older ones are overwritten once a buffer is full
+#define TRACE_BUFFER_EVENTS 65536
+// Room for a view name, like SCENE_CAMERA_NAME
+#define TRACE_VIEW_NAME 32
+
+typedef enum {
+  TRACE_SPAN, // something that took from begin to end
+  TRACE_COUNTER // value at begin
+} TraceEventType;
+
+// One event of a timeline. Names must outlive the Trace (string literals),
+// view names are copied.
+typedef struct TraceEvent {
+  TraceEventType type;
+  const char *name;
+  char view[TRACE_VIEW_NAME]; // view of a tile span, empty for others
+  int x, y; // top left pixel of a tile span
+  double begin, end; // stats_clock seconds
+  int64_t value; // counters only
+} TraceEvent;
+
+// Ring buffer of the events of one thread. Only that thread writes to it, so
+// recording needs neither locks nor atomics; the buffers are read once all
+// threads are done.
+typedef struct TraceBuffer {
+  TraceEvent *events; // TRACE_BUFFER_EVENTS, allocated on the first event
+  size_t recorded; // events recorded in total, the last TRACE_BUFFER_EVENTS are kept
+} TraceBuffer;
+
+// A timeline of a run with one buffer per thread. Buffer 0 belongs to the
+// thread that created the trace, tracer_render_views gives buffer i to its
+// i-th worker. The spans of that thread's stages are kept apart, so the many
+// tile events of a large render can't overwrite them.
+typedef struct Trace {
+  double origin; // stats_clock at creation, time 0 of the timeline
+  int threads;
+  TraceBuffer *buffers;
+  TraceEvent *spans; // of trace_span, all of them
+  size_t spans_len, spans_cap;
+} Trace;
+
+/**
+ * Creates an empty trace for up to threads threads, starting now
+ *
+ * @return The new trace (free with trace_destroy), or NULL if out of memory
+ */
+Trace *trace_new(int threads);
+void trace_destroy(Trace *trace);
+
+/**
+ * @return The buffer of thread i, NULL if there is no such thread or trace
+ *          is NULL, in which case events are not recorded
+ */
+TraceBuffer *trace_buffer(Trace *trace, int i);
+
+/**
+ * Records a span from begin to end (stats_clock seconds) of the thread that
+ * created the trace, such as a stage of the run. Spans are never overwritten
+ * and only that thread may record them. Does nothing if trace is NULL.
+ */
+void trace_span(Trace *trace, const char *name, double begin, double end);
+
+/**
+ * Records the render of the tile of view with its top left pixel at (x, y)
+ */
+void trace_tile(TraceBuffer *buffer, const char *view, int x, int y, double begin, double end);
+
+/**
+ * Records the value of a counter at time (stats_clock seconds)
+ */
+void trace_counter(TraceBuffer *buffer, const char *name, double time, int64_t value);
+
+/**
+ * Writes all buffers as Chrome trace events (chrome://tracing, Perfetto) to
+ * path. Must not be called while threads are still recording.
+ *
+ * @return 0 if successful, errno otherwise
+ */
+int trace_write_json(const Trace *trace, const char *path);
+
+#endif //RAYTRACERPROJ__TRACE_H_
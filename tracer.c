@@ -0,0 +1,239 @@
+#include "tracer.h"
+#include "cost_map.h"
+#include "scene_config.h"
+#include "wavefront.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+void render_options_default(RenderOptions *opts) {
+  RenderOptions defaults = {0};
+  defaults.seed = 1;
+  defaults.max_reflect_depth = 12;
+  defaults.max_refract_depth = 3;
+  defaults.min_throughput = 1.0f / 512; // half a step of an 8 bit channel
+  defaults.rr_depth = 0;
+  defaults.light_samples = 0;
+  defaults.aa_min_samples = 1;
+  defaults.aa_max_samples = 16;
+  defaults.aa_threshold = 0.05f;
+  *opts = defaults;
+}
+
+Scene *tracer_scene_load(const char *path) {
+  return scene_create_from_file(path);
+}
+
+void tracer_scene_destroy(Scene *scene) {
+  if (scene)
+    scene_destroy(scene);
+}
+
+void tracer_context_init(TraceContext *ctx, Scene *scene, Camera *camera,
+                         const RenderOptions *opts) {
+  TraceContext new_ctx = {0};
+  new_ctx.scene = scene;
+  new_ctx.camera = camera;
+  new_ctx.opts = opts;
+  sampler_start(&new_ctx.sampler, opts->seed, 0, 0, 0);
+  *ctx = new_ctx;
+}
+
+void tracer_seed_sample(TraceContext *ctx, int x, int y, int sample) {
+  sampler_start(&ctx->sampler, ctx->opts->seed, x, y, sample);
+}
+
+static Color trace_ray_hit(TraceContext *ctx, Ray *ray, Intersection *hit) {
+  ctx->stats.primary_rays++;
+  *hit = scene_closest_hit(ctx, ray, NULL);
+  if (hit->t == INFINITY)
+    return ctx->scene->bg_color;
+  return scene_shade_ray(ctx, ray, hit);
+}
+
+Color tracer_trace_ray(TraceContext *ctx, Ray *ray) {
+  Intersection hit;
+  return trace_ray_hit(ctx, ray, &hit);
+}
+
+Color tracer_trace_pixel(TraceContext *ctx, int x, int y) {
+  tracer_seed_sample(ctx, x, y, 0);
+  Ray ray = camera_trace_ray(ctx->camera, x, y);
+  return tracer_trace_ray(ctx, &ray);
+}
+
+static float luminance(Color c) {
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+Ray tracer_sample_ray(TraceContext *ctx, int x, int y, int s) {
+  tracer_seed_sample(ctx, x, y, s);
+  Vec2 offset = sampler_next_2d(&ctx->sampler);
+  return camera_trace_ray_subpixel(ctx->camera, x + offset.x, y + offset.y);
+}
+
+// Only needs the primary intersection, no shading
+Object *tracer_pixel_edge_key(TraceContext *ctx, int x, int y) {
+  Ray ray = tracer_sample_ray(ctx, x, y, 0);
+  ctx->stats.primary_rays++;
+  Intersection hit = scene_closest_hit(ctx, &ray, NULL);
+  return hit.t == INFINITY ? NULL : hit.obj;
+}
+
+void tracer_adaptive_begin(AdaptivePixel *pixel) {
+  AdaptivePixel empty = {0};
+  empty.lum_min = INFINITY;
+  empty.lum_max = -INFINITY;
+  *pixel = empty;
+}
+
+void tracer_adaptive_add(AdaptivePixel *pixel, Color c, Object *obj, Material *mat) {
+  if (pixel->n == 0) {
+    pixel->key = obj;
+    pixel->first_mat = mat;
+  } else if (obj != pixel->key || mat != pixel->first_mat) {
+    pixel->differs = 1;
+  }
+  float lum = luminance(c);
+  pixel->lum_min = MIN(pixel->lum_min, lum);
+  pixel->lum_max = MAX(pixel->lum_max, lum);
+  pixel->lum_sum += lum;
+  pixel->lum_sum2 += lum * lum;
+  pixel->sum = vecadd(pixel->sum, c);
+  pixel->n++;
+}
+
+int tracer_adaptive_next(const RenderOptions *opts, const AdaptivePixel *pixel, int x, int y,
+                         Object *left, Object *up) {
+  int min_samples = opts->aa_min_samples;
+  int max_samples = MAX(opts->aa_max_samples, min_samples);
+  int n = pixel->n;
+  if (n >= max_samples)
+    return 0;
+  if (n == min_samples) {
+    int edge = (x > 0 && pixel->key != left) || (y > 0 && pixel->key != up);
+    if (!pixel->differs && !edge && pixel->lum_max - pixel->lum_min <= opts->aa_threshold)
+      return 0;
+  } else {
+    float mean = pixel->lum_sum / n;
+    float variance = MAX(pixel->lum_sum2 / n - mean * mean, 0);
+    float err = opts->aa_threshold / 4;
+    if (variance / n < err * err)
+      return 0;
+  }
+  return MIN(min_samples, max_samples - n);
+}
+
+Color tracer_adaptive_color(const AdaptivePixel *pixel) {
+  return vecdiv(pixel->sum, pixel->n);
+}
+
+// Adaptive supersampling of one pixel, see tracer_adaptive_next.
+// left and up are the edge keys of the neighbors, key receives this pixel's.
+static Color trace_pixel_adaptive(TraceContext *ctx, int x, int y, Object *left,
+                                  Object *up, Object **key) {
+  AdaptivePixel pixel;
+  tracer_adaptive_begin(&pixel);
+  int batch = ctx->opts->aa_min_samples;
+  while (batch > 0) {
+    for (int i = 0; i < batch; i++) {
+      Ray ray = tracer_sample_ray(ctx, x, y, pixel.n);
+      Intersection hit;
+      Color c = trace_ray_hit(ctx, &ray, &hit);
+      if (hit.t == INFINITY)
+        tracer_adaptive_add(&pixel, c, NULL, NULL);
+      else
+        tracer_adaptive_add(&pixel, c, hit.obj, hit.mat);
+    }
+    batch = tracer_adaptive_next(ctx->opts, &pixel, x, y, left, up);
+  }
+  *key = pixel.key;
+  return tracer_adaptive_color(&pixel);
+}
+
+// Starts measuring the cost of a pixel if the render records costs
+static double cost_begin(TraceContext *ctx, RenderStats *before) {
+  if (!ctx->opts->cost_map)
+    return 0;
+  *before = ctx->stats;
+  return stats_clock();
+}
+
+static void cost_end(TraceContext *ctx, int x, int y, const RenderStats *before,
+                     double start) {
+  if (ctx->opts->cost_map)
+    cost_map_record(ctx->opts->cost_map, x, y, before, &ctx->stats, stats_clock() - start);
+}
+
+int tracer_render_region(Scene *scene, Camera *camera, int x0, int y0, int x1,
+                         int y1, PixelMap *out, const RenderOptions *opts,
+                         RenderStats *stats) {
+  int width = camera->window_pixel_width, height = camera->window_pixel_height;
+  if (x0 < 0 || y0 < 0 || x1 > width || y1 > height || x0 >= x1 || y0 >= y1)
+    return EINVAL;
+
+  int off_x, off_y;
+  if (out->width == width && out->height == height) {
+    off_x = 0;
+    off_y = 0;
+  } else if (out->width == x1 - x0 && out->height == y1 - y0) {
+    off_x = x0;
+    off_y = y0;
+  } else {
+    return EINVAL;
+  }
+
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+
+  TraceContext ctx;
+  tracer_context_init(&ctx, scene, camera, opts);
+  int rc = 0;
+  if (opts->wavefront) {
+    rc = wavefront_render_region(&ctx, x0, y0, x1, y1, out, off_x, off_y);
+    goto done;
+  }
+  if (opts->aa_min_samples <= 1) {
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        RenderStats before;
+        double start = cost_begin(&ctx, &before);
+        Color c = tracer_trace_pixel(&ctx, x, y);
+        cost_end(&ctx, x, y, &before, start);
+        pixel_map_put(out, x - off_x, y - off_y, ppm_color_from_color(c));
+      }
+    }
+    goto done;
+  }
+
+  // Edge keys of the row above. Neighbors outside the region are recomputed
+  // so the result doesn't depend on how the image is split into regions.
+  Object **row_keys = malloc(sizeof(Object *) * (x1 - x0));
+  if (!row_keys)
+    return ENOMEM;
+  for (int x = x0; x < x1; x++)
+    row_keys[x - x0] = y0 > 0 ? tracer_pixel_edge_key(&ctx, x, y0 - 1) : NULL;
+
+  for (int y = y0; y < y1; y++) {
+    Object *left = x0 > 0 ? tracer_pixel_edge_key(&ctx, x0 - 1, y) : NULL;
+    for (int x = x0; x < x1; x++) {
+      Object *key;
+      RenderStats before;
+      double start = cost_begin(&ctx, &before);
+      Color c = trace_pixel_adaptive(&ctx, x, y, left, row_keys[x - x0], &key);
+      cost_end(&ctx, x, y, &before, start);
+      pixel_map_put(out, x - off_x, y - off_y, ppm_color_from_color(c));
+      row_keys[x - x0] = key;
+      left = key;
+    }
+  }
+  free(row_keys);
+
+done:
+  if (stats)
+    render_stats_merge(stats, &ctx.stats);
+  return rc;
+}
@@ -0,0 +1,147 @@
+#ifndef RAYTRACERPROJ__TRACER_H_
+#define RAYTRACERPROJ__TRACER_H_
+
+#include "camera.h"
+#include "ppm_file.h"
+#include "scene.h"
+
+// Order in which tracer_render_views hands out its tiles
+typedef enum {
+  TILE_ORDER_INTERLEAVED, // tile k of every view after tile k - 1 of every view
+  TILE_ORDER_COST // most expensive first by a low resolution pre-pass, see views.h
+} TileOrder;
+
+// Knobs for a single render. A RenderOptions is only ever read by the tracer,
+// so one instance can be shared between concurrent renders.
+typedef struct RenderOptions {
+  uint32_t seed; // base seed of the Sampler, see sampler.h
+  int max_reflect_depth; // number of mirror bounces followed
+  int max_refract_depth; // number of refractions followed
+  float min_throughput; // secondary rays that can't contribute more than this are skipped
+  int rr_depth; // bounce depth after which Russian roulette ends paths, 0 to disable
+  int wavefront; // trace breadth first in sorted batches, see wavefront.h
+  int light_samples; // lights picked per hit when more reach it, 0 shades all, see LightLoop
+  const struct ShadowMaps *shadow_maps; // answers most hard shadow queries, NULL to trace them all
+  struct CostMap *cost_map; // records what each pixel cost if not NULL, see cost_map.h (not in wavefront mode)
+  struct Trace *trace; // timeline of the tiles of tracer_render_views if not NULL, see trace.h
+  TileOrder tile_order; // of tracer_render_views
+
+  // Adaptive anti-aliasing: every pixel gets aa_min_samples stratified
+  // samples, pixels on edges or with noisy samples get up to aa_max_samples
+  int aa_min_samples; // 1 disables anti-aliasing (one ray through the center)
+  int aa_max_samples;
+  float aa_threshold; // luminance difference between samples that counts as an edge
+} RenderOptions;
+
+/**
+ * Fills opts with the defaults used by masptracer
+ */
+void render_options_default(RenderOptions *opts);
+
+/**
+ * Parses a scene description file. The returned scene owns all of its
+ * materials, geometry and textures and holds no references to parser state,
+ * so any number of scenes can be loaded and rendered side by side.
+ *
+ * @return The new scene (free with tracer_scene_destroy), or NULL if the file
+ *          could not be read or is invalid. Errors are reported on stderr.
+ */
+Scene *tracer_scene_load(const char *path);
+void tracer_scene_destroy(Scene *scene);
+
+/**
+ * Initializes a trace context for shading rays of scene as seen by camera.
+ * Each thread needs its own context; scene and camera can be shared.
+ */
+void tracer_context_init(TraceContext *ctx, Scene *scene, Camera *camera,
+                         const RenderOptions *opts);
+
+/**
+ * Restarts the context's sampler for the given sample of pixel (x, y), so
+ * every sample sees the same random numbers however the image is split up
+ */
+void tracer_seed_sample(TraceContext *ctx, int x, int y, int sample);
+
+/**
+ * Starts sample s of pixel (x, y) and returns its camera ray. The sub-pixel
+ * positions of a pixel's samples come from one Sobol sequence, so any prefix
+ * of them is stratified over the pixel.
+ */
+Ray tracer_sample_ray(TraceContext *ctx, int x, int y, int s);
+
+/**
+ * What the first sample of (x, y) hits, NULL for nothing. Anti-aliasing
+ * compares it between neighboring pixels to find edges.
+ */
+Object *tracer_pixel_edge_key(TraceContext *ctx, int x, int y);
+
+// Running sums of the adaptive anti-aliasing of one pixel, so the recursive
+// and the wavefront tracer refine the same pixels with the same samples
+typedef struct AdaptivePixel {
+  Color sum;
+  float lum_sum, lum_sum2;
+  float lum_min, lum_max;
+  Object *key; // what the first sample hit
+  Material *first_mat;
+  int differs; // whether the samples hit different objects or materials
+  int n; // samples taken
+} AdaptivePixel;
+
+void tracer_adaptive_begin(AdaptivePixel *pixel);
+
+/**
+ * Adds sample pixel->n, of color c, whose camera ray hit obj with material
+ * mat (NULL for nothing)
+ */
+void tracer_adaptive_add(AdaptivePixel *pixel, Color c, Object *obj, Material *mat);
+
+/**
+ * Number of samples to take next, after the first opts->aa_min_samples
+ * have been added. Pixels whose samples agree, that are not on an edge
+ * (left or up, the edge keys of the neighbors, differ from the pixel's) and
+ * vary by no more than aa_threshold are done, others get batches of
+ * aa_min_samples until the estimated error of the mean drops below the
+ * threshold or aa_max_samples is reached.
+ *
+ * @return The number of samples, 0 once the pixel is done
+ */
+int tracer_adaptive_next(const RenderOptions *opts, const AdaptivePixel *pixel, int x, int y,
+                         Object *left, Object *up);
+
+/**
+ * The mean of the samples
+ */
+Color tracer_adaptive_color(const AdaptivePixel *pixel);
+
+/**
+ * Finds the closest hit of ray and shades it
+ *
+ * @return The shaded color, or the scene background if nothing was hit
+ */
+Color tracer_trace_ray(TraceContext *ctx, Ray *ray);
+
+/**
+ * Traces the primary ray through pixel (x, y) and shades it
+ *
+ * @return The color of the pixel, or the scene background if nothing was hit
+ */
+Color tracer_trace_pixel(TraceContext *ctx, int x, int y);
+
+/**
+ * Renders the pixels in [x0, x1) x [y0, y1) of camera's image into out. The
+ * scene and camera are only read, so disjoint (or even overlapping) regions
+ * may be rendered from multiple threads at once.
+ *
+ * @param out Either a full image sized PixelMap, in which case pixels are
+ *            written at their image coordinates, or a map exactly the size of
+ *            the region, in which case (x0, y0) is written to (0, 0).
+ * @param opts Render options, NULL for the defaults
+ * @param stats If not NULL, the counters of this render are added to it
+ * @return 0 if successful, EINVAL if the region is empty, outside of the
+ *          image or out has an unsupported size, ENOMEM if out of memory
+ */
+int tracer_render_region(Scene *scene, Camera *camera, int x0, int y0, int x1,
+                         int y1, PixelMap *out, const RenderOptions *opts,
+                         RenderStats *stats);
+
+#endif //RAYTRACERPROJ__TRACER_H_
@@ -0,0 +1,470 @@
+#include "views.h"
+#include "trace.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cube map faces in the usual +x, -x, +y, -y, +z, -z order. Every face is up
+// along +y, except the +y and -y faces, which are up along -z and +z.
+static const char *const cube_names[6] = {"px", "nx", "py", "ny", "pz", "nz"};
+static const Vec3 cube_dirs[6] = {
+  {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+static const Vec3 cube_ups[6] = {
+  {0, 1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}, {0, 1, 0}, {0, 1, 0}};
+
+static int add_view(View *view, const char *name, Vec3 eye, Vec3 viewdir,
+                    Vec3 updir, float fov_h, int width, int height) {
+  snprintf(view->name, sizeof(view->name), "%s", name);
+  if (camera_create(eye, viewdir, updir, fov_h, width, height, &view->camera) != 0)
+    return EINVAL;
+  view->x1 = width;
+  view->y1 = height;
+  return 0;
+}
+
+// Adds the views of rig around main, returning the number added or -errno
+static int add_rig_views(Scene *scene, const CameraRig *rig, Camera *main,
+                         View *views) {
+  int width = scene->pixel_width, height = scene->pixel_height;
+  char name[SCENE_CAMERA_NAME];
+  int n = 0, rc = 0;
+  switch (rig->type) {
+  case RIG_NONE:
+    break;
+  case RIG_STEREO:
+    for (int i = 0; i < 2 && rc == 0; i++) {
+      Vec3 eye = vecadd(main->eye_pos, vecmul(main->u, (i - 0.5f) * rig->spacing));
+      rc = add_view(&views[n++], i ? "right" : "left", eye, scene->viewdir,
+                    scene->updir, scene->fov_h, width, height);
+    }
+    break;
+  case RIG_CUBE:
+    for (int i = 0; i < 6 && rc == 0; i++)
+      rc = add_view(&views[n++], cube_names[i], main->eye_pos, cube_dirs[i],
+                    cube_ups[i], 90, width, width);
+    break;
+  case RIG_ARRAY:
+    for (int r = 0; r < rig->rows && rc == 0; r++) {
+      for (int c = 0; c < rig->cols && rc == 0; c++) {
+        // Row 0 is the top one, like in the image
+        Vec3 eye = vecadd(main->eye_pos,
+                          vecmul(main->u, (c - (rig->cols - 1) / 2.0f) * rig->spacing));
+        eye = vecadd(eye, vecmul(main->v, ((rig->rows - 1) / 2.0f - r) * rig->spacing));
+        snprintf(name, sizeof(name), "r%dc%d", r, c);
+        rc = add_view(&views[n++], name, eye, scene->viewdir, scene->updir,
+                      scene->fov_h, width, height);
+      }
+    }
+    break;
+  }
+  return rc ? -rc : n;
+}
+
+static size_t rig_len(const CameraRig *rig) {
+  if (!rig)
+    return 1;
+  switch (rig->type) {
+  case RIG_STEREO:
+    return 2;
+  case RIG_CUBE:
+    return 6;
+  case RIG_ARRAY:
+    return (size_t) rig->cols * rig->rows;
+  default:
+    return 1;
+  }
+}
+
+int views_create(Scene *scene, const CameraRig *rig, View **out, size_t *len) {
+  if (rig && rig->type == RIG_NONE)
+    rig = NULL;
+  size_t cap = rig_len(rig) + scene->cameras_len;
+  View *views = calloc(cap, sizeof(View));
+  if (!views)
+    return ENOMEM;
+
+  int rc;
+  size_t n = 0;
+  Camera main;
+  if (camera_create_from_scene(scene, &main) != 0) {
+    rc = EINVAL;
+    goto fail;
+  }
+  if (rig) {
+    int added = add_rig_views(scene, rig, &main, views);
+    if (added < 0) {
+      rc = -added;
+      n = cap;
+      goto fail;
+    }
+    n = added;
+  } else {
+    rc = add_view(&views[n++], "main", scene->eye, scene->viewdir, scene->updir,
+                  scene->fov_h, scene->pixel_width, scene->pixel_height);
+    if (rc != 0)
+      goto fail;
+  }
+
+  for (size_t i = 0; i < scene->cameras_len; i++) {
+    SceneCamera *sc = &scene->cameras[i];
+    rc = add_view(&views[n++], sc->name, sc->eye, sc->viewdir, sc->updir,
+                  sc->fov_h, scene->pixel_width, scene->pixel_height);
+    if (rc != 0)
+      goto fail;
+    for (size_t j = 0; j + 1 < n; j++) {
+      if (strcmp(views[j].name, sc->name) == 0) {
+        rc = EEXIST;
+        goto fail;
+      }
+    }
+  }
+  *out = views;
+  *len = n;
+  return 0;
+
+fail:
+  views_destroy(views, n);
+  return rc;
+}
+
+void views_destroy(View *views, size_t len) {
+  if (!views)
+    return;
+  for (size_t i = 0; i < len; i++) {
+    if (views[i].image)
+      pixel_map_destroy(views[i].image);
+    if (views[i].file)
+      ppm_tiled_file_close(views[i].file);
+    cost_map_destroy(views[i].costs);
+  }
+  free(views);
+}
+
+int view_crop(View *view, int x0, int y0, int x1, int y1) {
+  if (x0 < 0 || y0 < 0 || x1 > view->camera.window_pixel_width ||
+      y1 > view->camera.window_pixel_height || x0 >= x1 || y0 >= y1)
+    return EINVAL;
+  view->x0 = x0;
+  view->y0 = y0;
+  view->x1 = x1;
+  view->y1 = y1;
+  return 0;
+}
+
+// Number of tiles of view along x and in total
+static size_t view_tiles(const View *view, int *tiles_x) {
+  *tiles_x = (view->x1 - view->x0 + VIEW_TILE - 1) / VIEW_TILE;
+  return (size_t) *tiles_x * ((view->y1 - view->y0 + VIEW_TILE - 1) / VIEW_TILE);
+}
+
+// Probes per side of a tile in the pre-pass of TILE_ORDER_COST, a quarter of
+// them in each VIEW_SUB_TILE piece
+#define COST_PROBES 4
+// Tiles expected to cost more than this many times the average are split
+#define SPLIT_COST 4
+
+// Expected number of bounces of a chain that goes on with probability p, up
+// to depth of them
+static float expected_bounces(float p, int depth) {
+  float sum = 0, chance = 1;
+  for (int i = 0; i < depth && chance > 0.01f; i++) {
+    chance *= p;
+    sum += chance;
+  }
+  return sum;
+}
+
+// Rough number of rays the pixel (x, y) takes, from its primary hit: a
+// shadow ray per light, and the reflections and refractions its material
+// can lead to, each shading the lights again
+static float probe_cost(Scene *scene, Camera *camera, const RenderOptions *opts, int x, int y) {
+  Ray ray = camera_trace_ray(camera, x, y);
+  Intersection hit = scene_find_best_inter(scene, &ray);
+  if (hit.t == INFINITY)
+    return 1;
+  float lights = scene->lights_len;
+  if (opts->light_samples > 0)
+    lights = MIN(lights, opts->light_samples);
+  Ray reflection;
+  float fresnel = scene_reflection_ray(&ray, &hit, &reflection);
+  float bounces = 0;
+  if (fresnel >= opts->min_throughput)
+    bounces += expected_bounces(fresnel, opts->max_reflect_depth);
+  if (hit.mat->opacity < 1)
+    bounces += expected_bounces(1 - hit.mat->opacity, opts->max_refract_depth);
+  return 1 + (1 + lights) * (1 + bounces);
+}
+
+// Appends the tile [x0, x1) x [y0, y1) of view to tiles, as one or as its
+// VIEW_SUB_TILE pieces with the cost of each from the probes in it
+static void add_cost_tile(ViewTile *tiles, size_t *len, size_t view, int x0, int y0, int x1,
+                          int y1, const float *probes, int split) {
+  int xm = MIN(x0 + VIEW_SUB_TILE, x1), ym = MIN(y0 + VIEW_SUB_TILE, y1);
+  int xs[3] = {x0, xm, x1}, ys[3] = {y0, ym, y1};
+  float cost[2][2] = {{0}}, count[2][2] = {{0}};
+  for (int py = 0; py < COST_PROBES; py++) {
+    for (int px = 0; px < COST_PROBES; px++) {
+      int x = x0 + (2 * px + 1) * (x1 - x0) / (2 * COST_PROBES);
+      int y = y0 + (2 * py + 1) * (y1 - y0) / (2 * COST_PROBES);
+      cost[y >= ym][x >= xm] += probes[py * COST_PROBES + px];
+      count[y >= ym][x >= xm]++;
+    }
+  }
+  float tile_cost = 0;
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 2; j++) {
+      // Pixels of the piece times the average of its probes
+      cost[i][j] = count[i][j] ? cost[i][j] / count[i][j] * (xs[j + 1] - xs[j]) * (ys[i + 1] - ys[i]) : 0;
+      tile_cost += cost[i][j];
+    }
+  }
+  if (!split) {
+    tiles[(*len)++] = (ViewTile) {view, x0, y0, x1, y1, tile_cost};
+    return;
+  }
+  for (int i = 0; i < 2; i++)
+    for (int j = 0; j < 2; j++)
+      if (xs[j] < xs[j + 1] && ys[i] < ys[i + 1])
+        tiles[(*len)++] = (ViewTile) {view, xs[j], ys[i], xs[j + 1], ys[i + 1], cost[i][j]};
+}
+
+// Most expensive first, ties in view and position order so the order is
+// the same on every run
+static int compare_cost_tiles(const void *a, const void *b) {
+  const ViewTile *x = a, *y = b;
+  if (x->cost != y->cost)
+    return x->cost > y->cost ? -1 : 1;
+  if (x->view != y->view)
+    return x->view < y->view ? -1 : 1;
+  if (x->y0 != y->y0)
+    return x->y0 < y->y0 ? -1 : 1;
+  return x->x0 < y->x0 ? -1 : x->x0 > y->x0;
+}
+
+int views_order_by_cost(Scene *scene, View *views, size_t len, const RenderOptions *opts,
+                        int threads, ViewTile **out, size_t *out_len) {
+  size_t tiles_len = 0;
+  for (size_t i = 0; i < len; i++) {
+    int tiles_x;
+    tiles_len += view_tiles(&views[i], &tiles_x);
+  }
+  float *probes = malloc(sizeof(float) * COST_PROBES * COST_PROBES * tiles_len);
+  // Room for every tile split in four
+  ViewTile *tiles = malloc(sizeof(ViewTile) * 4 * tiles_len);
+  if (!probes || !tiles) {
+    free(probes);
+    free(tiles);
+    return ENOMEM;
+  }
+
+  double total = 0;
+  float *p = probes;
+  for (size_t i = 0; i < len; i++) {
+    View *view = &views[i];
+    for (int y0 = view->y0; y0 < view->y1; y0 += VIEW_TILE) {
+      for (int x0 = view->x0; x0 < view->x1; x0 += VIEW_TILE) {
+        int x1 = MIN(x0 + VIEW_TILE, view->x1), y1 = MIN(y0 + VIEW_TILE, view->y1);
+        for (int py = 0; py < COST_PROBES; py++) {
+          for (int px = 0; px < COST_PROBES; px++) {
+            int x = x0 + (2 * px + 1) * (x1 - x0) / (2 * COST_PROBES);
+            int y = y0 + (2 * py + 1) * (y1 - y0) / (2 * COST_PROBES);
+            *p = probe_cost(scene, &view->camera, opts, x, y);
+            total += *p++ * (x1 - x0) * (y1 - y0) / (COST_PROBES * COST_PROBES);
+          }
+        }
+      }
+    }
+  }
+
+  // Splitting only pays off if other threads can take the pieces
+  double split_cost = threads > 1 && tiles_len ? SPLIT_COST * total / tiles_len : INFINITY;
+  size_t n = 0;
+  p = probes;
+  for (size_t i = 0; i < len; i++) {
+    View *view = &views[i];
+    for (int y0 = view->y0; y0 < view->y1; y0 += VIEW_TILE) {
+      for (int x0 = view->x0; x0 < view->x1; x0 += VIEW_TILE) {
+        int x1 = MIN(x0 + VIEW_TILE, view->x1), y1 = MIN(y0 + VIEW_TILE, view->y1);
+        float cost = 0;
+        for (int k = 0; k < COST_PROBES * COST_PROBES; k++)
+          cost += p[k] * (x1 - x0) * (y1 - y0) / (COST_PROBES * COST_PROBES);
+        add_cost_tile(tiles, &n, i, x0, y0, x1, y1, p, cost > split_cost);
+        p += COST_PROBES * COST_PROBES;
+      }
+    }
+  }
+  free(probes);
+  qsort(tiles, n, sizeof(ViewTile), compare_cost_tiles);
+  *out = tiles;
+  *out_len = n;
+  return 0;
+}
+
+// The queue all threads of tracer_render_views take tiles from. Tiles are
+// handed out as round k (tile k of every view that has one) after round k - 1,
+// so views finish together and a thread never waits on a lone large view at
+// the end. They are enumerated as they are taken, a gigapixel image would
+// otherwise need millions of entries. With TILE_ORDER_COST they come from a
+// list sorted by cost instead.
+typedef struct TileQueue {
+  Scene *scene;
+  View *views;
+  size_t len;
+  const RenderOptions *opts;
+  size_t round; // k of the next tile
+  size_t view; // view of the next tile
+  size_t rounds; // tiles of the view with the most
+  size_t remaining; // tiles not taken yet
+  ViewTile *by_cost; // the tiles in order if not NULL, remaining of them from the end
+  size_t by_cost_len;
+  int error; // first error of any tile
+  RenderStats stats;
+  pthread_mutex_t lock;
+} TileQueue;
+
+// A thread working the queue, index 0 is the caller of tracer_render_views
+typedef struct TileWorker {
+  TileQueue *queue;
+  int index;
+} TileWorker;
+
+// Takes the next tile off the queue and records the tiles left on trace,
+// returns 0 once it is empty
+static int next_tile(TileQueue *queue, TraceBuffer *trace, View **view,
+                     int *x0, int *y0, int *x1, int *y1) {
+  int found = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->by_cost && queue->remaining) {
+    ViewTile *tile = &queue->by_cost[queue->by_cost_len - queue->remaining--];
+    *view = &queue->views[tile->view];
+    *x0 = tile->x0;
+    *y0 = tile->y0;
+    *x1 = tile->x1;
+    *y1 = tile->y1;
+    found = 1;
+  }
+  while (!found && !queue->by_cost && queue->round < queue->rounds) {
+    View *v = &queue->views[queue->view];
+    int tiles_x;
+    size_t k = queue->round;
+    if (k < view_tiles(v, &tiles_x)) {
+      *view = v;
+      *x0 = v->x0 + (int) (k % tiles_x) * VIEW_TILE;
+      *y0 = v->y0 + (int) (k / tiles_x) * VIEW_TILE;
+      *x1 = MIN(*x0 + VIEW_TILE, v->x1);
+      *y1 = MIN(*y0 + VIEW_TILE, v->y1);
+      found = 1;
+      queue->remaining--;
+    }
+    if (++queue->view == queue->len) {
+      queue->view = 0;
+      queue->round++;
+    }
+  }
+  size_t remaining = queue->remaining;
+  pthread_mutex_unlock(&queue->lock);
+  if (found)
+    trace_counter(trace, "queue depth", stats_clock(), (int64_t) remaining);
+  return found;
+}
+
+static void *render_tiles(void *arg) {
+  TileWorker *worker = arg;
+  TileQueue *queue = worker->queue;
+  RenderOptions opts = *queue->opts;
+  TraceBuffer *trace = trace_buffer(opts.trace, worker->index);
+  RenderStats stats = {0};
+  int error = 0;
+  PpmColor data[VIEW_TILE * VIEW_TILE];
+  View *view;
+  int x0, y0, x1, y1;
+  while (next_tile(queue, trace, &view, &x0, &y0, &x1, &y1)) {
+    double begin = trace ? stats_clock() : 0;
+    // Rendered into a tile sized map and copied to its place from there
+    PixelMap tile = {x1 - x0, y1 - y0, data};
+    opts.cost_map = view->costs;
+    int rc = tracer_render_region(queue->scene, &view->camera, x0, y0, x1, y1,
+                                  &tile, &opts, &stats);
+    if (rc == 0 && view->file) {
+      rc = ppm_tiled_file_write(view->file, x0 - view->x0, y0 - view->y0, &tile);
+    } else if (rc == 0) {
+      for (int y = 0; y < tile.height; y++)
+        memcpy(&view->image->data[(y0 - view->y0 + y) * view->image->width + x0 - view->x0],
+               &data[y * tile.width], sizeof(PpmColor) * tile.width);
+    }
+    if (rc != 0 && !error)
+      error = rc;
+    if (trace)
+      trace_tile(trace, view->name, x0, y0, begin, stats_clock());
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  render_stats_merge(&queue->stats, &stats);
+  if (error && !queue->error)
+    queue->error = error;
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+int tracer_render_views(Scene *scene, View *views, size_t len,
+                        const RenderOptions *opts, int threads, RenderStats *stats) {
+  if (threads < 1)
+    return EINVAL;
+
+  RenderOptions defaults;
+  if (!opts) {
+    render_options_default(&defaults);
+    opts = &defaults;
+  }
+  TileQueue queue = {.scene = scene, .views = views, .len = len, .opts = opts};
+  for (size_t i = 0; i < len; i++) {
+    View *view = &views[i];
+    int width = view->x1 - view->x0, height = view->y1 - view->y0;
+    if (view->file && (view->file->width != width || view->file->height != height))
+      return EINVAL;
+    if (view->image && (view->image->width != width || view->image->height != height))
+      return EINVAL;
+    if (!view->file && !view->image && !(view->image = pixel_map_new(width, height)))
+      return ENOMEM;
+    int tiles_x;
+    size_t tiles = view_tiles(view, &tiles_x);
+    queue.rounds = MAX(queue.rounds, tiles);
+    queue.remaining += tiles;
+  }
+  if (opts->tile_order == TILE_ORDER_COST) {
+    double begin = stats_clock();
+    int rc = views_order_by_cost(scene, views, len, opts, threads, &queue.by_cost,
+                                 &queue.by_cost_len);
+    if (rc != 0)
+      return rc;
+    queue.remaining = queue.by_cost_len;
+    trace_span(opts->trace, "tile costs", begin, stats_clock());
+  }
+
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+  TileWorker *args = malloc(sizeof(TileWorker) * threads);
+  for (int i = 0; args && i < threads; i++)
+    args[i] = (TileWorker) {&queue, i};
+  int started = 0;
+  // The caller's thread works the queue too, so the render completes even if
+  // not every thread could be started
+  while (workers && args && started < threads - 1 &&
+         pthread_create(&workers[started], NULL, render_tiles, &args[started + 1]) == 0)
+    started++;
+  TileWorker caller = {&queue, 0};
+  render_tiles(&caller);
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  pthread_mutex_destroy(&queue.lock);
+  free(workers);
+  free(args);
+  free(queue.by_cost);
+
+  if (stats)
+    render_stats_merge(stats, &queue.stats);
+  return queue.error;
+}
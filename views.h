@@ -0,0 +1,109 @@
+#ifndef RAYTRACERPROJ__VIEWS_H_
+#define RAYTRACERPROJ__VIEWS_H_
+
+#include "cost_map.h"
+#include "tracer.h"
+
+// Side of the square tiles views are split into for scheduling
+#define VIEW_TILE 32
+// Side of the pieces expensive tiles are split into with TILE_ORDER_COST
+#define VIEW_SUB_TILE (VIEW_TILE / 2)
+
+// One image of a multi-view render
+typedef struct View {
+  char name[SCENE_CAMERA_NAME]; // "main", a scene camera's name or a rig position
+  Camera camera;
+  int x0, y0, x1, y1; // the part of the camera's image that is rendered, all of it by default
+  PixelMap *image; // sized like the rendered part, NULL until rendered or if file is set
+  PpmTiledFile *file; // if not NULL, tiles are written here as they are done instead
+  CostMap *costs; // if not NULL, the cost of every pixel is recorded here
+} View;
+
+// A tile of a view or a piece of one, with its expected cost in rays
+typedef struct ViewTile {
+  size_t view; // index in the views
+  int x0, y0, x1, y1; // in the view camera's image
+  float cost;
+} ViewTile;
+
+typedef enum {
+  RIG_NONE, // only the scene's own cameras
+  RIG_STEREO, // "left" and "right", spacing apart along the main camera's u
+  RIG_CUBE, // "px", "nx", "py", "ny", "pz" and "nz" faces around the main eye
+  RIG_ARRAY // cols x rows cameras "r<row>c<col>" on the main camera's image plane
+} RigType;
+
+// Cameras generated around the scene's main camera, replacing it
+typedef struct CameraRig {
+  RigType type;
+  float spacing; // distance between neighboring eyes (stereo and array)
+  int cols, rows; // array only
+} CameraRig;
+
+/**
+ * Creates the views of scene: its main camera (or the cameras of rig in its
+ * place) followed by the cameras declared in the scene file. Rig and array
+ * views keep the main camera's image size and orientation, cube faces are
+ * square with a 90 degree field of view and as wide as the main image. The
+ * views have no image yet.
+ *
+ * @param rig The rig to generate, NULL for none
+ * @param out Set to the new views (free with views_destroy)
+ * @param len Set to the number of views
+ * @return 0 if successful, EINVAL if a camera has a zero or parallel
+ *          viewdir/updir, EEXIST if a scene camera is named like a rig
+ *          view, ENOMEM if out of memory
+ */
+int views_create(Scene *scene, const CameraRig *rig, View **out, size_t *len);
+void views_destroy(View *views, size_t len);
+
+/**
+ * Restricts a view to the pixels in [x0, x1) x [y0, y1) of its camera's
+ * image. Pixels keep their position in the frame, so a cropped render equals
+ * the same part of the full one.
+ *
+ * @return 0 if successful, EINVAL if the region is empty or outside the image
+ */
+int view_crop(View *view, int x0, int y0, int x1, int y1);
+
+/**
+ * Renders every view of scene into its file, or into its image (allocated if
+ * needed) for views without one. The views are split into VIEW_TILE sized
+ * tiles which are interleaved across views in one queue, so all threads stay
+ * busy until the last tile of any view is done. Each thread renders a tile
+ * at a time, so views written to files need no memory per pixel. The result
+ * is the same as rendering each view with tracer_render_region.
+ *
+ * With opts->tile_order TILE_ORDER_COST a 4x4 grid of primary rays per tile
+ * first estimates the rays each tile will take from what they hit: nothing,
+ * or a material with a number of lights to shade, a chance of reflecting and
+ * of letting light through. Tiles are then handed out most expensive first,
+ * and with more than one thread, those costing several times the average
+ * are split into VIEW_SUB_TILE sized pieces, so no long tile is left running
+ * at the end. This keeps a list of all tiles instead of enumerating them.
+ *
+ * @param opts Render options, NULL for the defaults. Its cost_map is replaced
+ *             by each view's costs.
+ * @param threads Number of threads to render with, 1 renders on the caller's
+ * @param stats If not NULL, the counters of all views are added to it
+ * @return 0 if successful, EINVAL if threads < 1 or an image has the wrong
+ *          size, ENOMEM if out of memory, or the error of writing a file
+ */
+int tracer_render_views(Scene *scene, View *views, size_t len,
+                        const RenderOptions *opts, int threads, RenderStats *stats);
+
+/**
+ * Lists the tiles of the views in the order tracer_render_views renders them
+ * with opts->tile_order TILE_ORDER_COST: most expensive first, with the tiles
+ * costing more than several times the average split into VIEW_SUB_TILE sized
+ * pieces if threads > 1.
+ *
+ * @param opts Render options, the depths and light samples affect the costs
+ * @param out Set to the tiles (free with free)
+ * @param out_len Set to the number of tiles
+ * @return 0 if successful, ENOMEM if out of memory
+ */
+int views_order_by_cost(Scene *scene, View *views, size_t len, const RenderOptions *opts,
+                        int threads, ViewTile **out, size_t *out_len);
+
+#endif //RAYTRACERPROJ__VIEWS_H_
@@ -0,0 +1,517 @@
+#include "wavefront.h"
+#include "shadow_map.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Secondary rays of a hit, in the order scene_shade_ray adds them
+enum { PATH_REFLECTION, PATH_REFRACTION };
+
+typedef struct PathRay {
+  Ray ray;
+  Object *ignore; // the surface the ray leaves, for reflections
+  Material *from_mat;
+  int slot; // sample this ray contributes to, see Slot
+  int parent; // hit record the ray leaves from, -1 for camera rays
+  int kind; // PATH_REFLECTION or PATH_REFRACTION
+  float weight; // Fresnel or transmission weight of the ray's color
+  float survival; // 1 / the probability it survived the roulette with
+  int depth;
+  float throughput;
+} PathRay;
+
+typedef struct ShadowRay {
+  Ray ray;
+  float max_t;
+  Object *ignore;
+  Light *light;
+  int hit; // index into the hit records of the current depth
+  Color color; // added to the hit if the light is visible
+} ShadowRay;
+
+// Shading of one hit. All hits of a sample form the tree scene_shade_ray
+// recurses through, which is resolved from the leaves up once every depth
+// has been traced, clamping each subtree's color the way the recursion does.
+typedef struct HitRecord {
+  int slot;
+  int parent, kind; // of the ray that hit, see PathRay
+  float weight, survival;
+  float cue; // depth cueing factor, 1 if disabled
+  Color local; // ambient and unoccluded light
+  Color secondary[2]; // weighted and clamped colors of the secondary rays
+  float secondary_survival[2];
+} HitRecord;
+
+typedef struct PathQueue {
+  PathRay *rays;
+  size_t len, cap;
+} PathQueue;
+
+typedef struct ShadowQueue {
+  ShadowRay *rays;
+  size_t len, cap;
+} ShadowQueue;
+
+typedef struct HitQueue {
+  HitRecord *hits;
+  size_t len, cap;
+} HitQueue;
+
+// The push functions return NULL if the queue can't grow, keeping its rays
+static PathRay *path_queue_push(PathQueue *q) {
+  if (q->len == q->cap) {
+    size_t cap = q->cap ? q->cap * 2 : 1024;
+    PathRay *rays = realloc(q->rays, sizeof(PathRay) * cap);
+    if (!rays)
+      return NULL;
+    q->rays = rays;
+    q->cap = cap;
+  }
+  return &q->rays[q->len++];
+}
+
+static ShadowRay *shadow_queue_push(ShadowQueue *q) {
+  if (q->len == q->cap) {
+    size_t cap = q->cap ? q->cap * 2 : 1024;
+    ShadowRay *rays = realloc(q->rays, sizeof(ShadowRay) * cap);
+    if (!rays)
+      return NULL;
+    q->rays = rays;
+    q->cap = cap;
+  }
+  return &q->rays[q->len++];
+}
+
+static HitRecord *hit_queue_push(HitQueue *q) {
+  if (q->len == q->cap) {
+    size_t cap = q->cap ? q->cap * 2 : 1024;
+    HitRecord *hits = realloc(q->hits, sizeof(HitRecord) * cap);
+    if (!hits)
+      return NULL;
+    q->hits = hits;
+    q->cap = cap;
+  }
+  return &q->hits[q->len++];
+}
+
+// Spreads the low 9 bits of v so that they occupy every third bit
+static uint32_t spread_bits(uint32_t v) {
+  v &= 0x1ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Sort key of a ray: the direction octant in the top bits, then the Morton
+// code of the ray origin on a 512^3 grid over the bounds of the batch
+static uint32_t ray_sort_key(Ray *ray, Vec3 lo, Vec3 inv_extent) {
+  uint32_t octant = (ray->dir.x < 0) | (ray->dir.y < 0) << 1 | (ray->dir.z < 0) << 2;
+  uint32_t cx = (uint32_t) ((ray->pos.x - lo.x) * inv_extent.x);
+  uint32_t cy = (uint32_t) ((ray->pos.y - lo.y) * inv_extent.y);
+  uint32_t cz = (uint32_t) ((ray->pos.z - lo.z) * inv_extent.z);
+  return octant << 27 | spread_bits(cx) << 2 | spread_bits(cy) << 1 | spread_bits(cz);
+}
+
+static int compare_keys(const void *l, const void *r) {
+  uint64_t a = *(const uint64_t *) l;
+  uint64_t b = *(const uint64_t *) r;
+  return (a > b) - (a < b);
+}
+
+// Fills order with the indices of the rays sorted by ray_sort_key. The rays
+// themselves stay put, sorting (key, index) pairs moves far less memory.
+static void sort_rays(Ray *first, size_t stride, size_t len, uint64_t *order) {
+  Vec3 lo = {INFINITY, INFINITY, INFINITY};
+  Vec3 hi = {-INFINITY, -INFINITY, -INFINITY};
+  for (size_t i = 0; i < len; i++) {
+    Ray *ray = (Ray *) ((char *) first + i * stride);
+    lo.x = MIN(lo.x, ray->pos.x);
+    lo.y = MIN(lo.y, ray->pos.y);
+    lo.z = MIN(lo.z, ray->pos.z);
+    hi.x = MAX(hi.x, ray->pos.x);
+    hi.y = MAX(hi.y, ray->pos.y);
+    hi.z = MAX(hi.z, ray->pos.z);
+  }
+  Vec3 inv_extent;
+  inv_extent.x = 511.0f / MAX(hi.x - lo.x, 1e-6f);
+  inv_extent.y = 511.0f / MAX(hi.y - lo.y, 1e-6f);
+  inv_extent.z = 511.0f / MAX(hi.z - lo.z, 1e-6f);
+
+  for (size_t i = 0; i < len; i++) {
+    Ray *ray = (Ray *) ((char *) first + i * stride);
+    order[i] = (uint64_t) ray_sort_key(ray, lo, inv_extent) << 32 | i;
+  }
+  qsort(order, len, sizeof(uint64_t), compare_keys);
+}
+
+// One sample of a wave
+typedef struct Slot {
+  int pixel; // index in the batch
+  int sample;
+  Object *obj; // hit by the camera ray, NULL for nothing
+  Material *mat;
+  Color color;
+} Slot;
+
+typedef struct Wave {
+  TraceContext *ctx;
+  int x0, width; // of the region
+  int y0; // first row of the batch
+  Slot *slots; // samples of the wave
+  int slots_len;
+  PathQueue paths, next_paths;
+  ShadowQueue shadows;
+  HitQueue hits;
+  uint64_t *order;
+  size_t order_cap;
+  int error; // ENOMEM once a queue couldn't grow, the wave is abandoned
+} Wave;
+
+// Rays of one sample are shaded out of order, so the sampler is restarted at
+// a fixed dimension for each use
+static void seek_sampler(Wave *w, int slot, uint32_t dimension) {
+  Slot *s = &w->slots[slot];
+  tracer_seed_sample(w->ctx, w->x0 + s->pixel % w->width, w->y0 + s->pixel / w->width,
+                     s->sample);
+  w->ctx->sampler.dimension = dimension;
+}
+
+// Queues the secondary ray of in, from path, if scene_secondary_ray_weight
+// lets it through. The sampler is positioned for the roulette past the
+// dimensions shade_hit uses for lights.
+static void queue_secondary(Wave *w, PathRay *path, Intersection *in, int hit_index,
+                            int kind, Ray *ray, float weight) {
+  TraceContext *ctx = w->ctx;
+  const RenderOptions *opts = ctx->opts;
+  if (opts->rr_depth > 0) {
+    int depths = MAX(opts->max_reflect_depth, opts->max_refract_depth) + 1;
+    uint32_t lights = (uint32_t) ctx->scene->lights_len + 1;
+    seek_sampler(w, path->slot, 1 + (uint32_t) depths * lights + 2 * path->depth + kind);
+  }
+  // The hit's color isn't known until its shadow rays are traced, a ray
+  // towards a saturated color adds nothing when the tree is resolved
+  Color unknown = {0};
+  float throughput, survival;
+  if (scene_secondary_ray_weight(ctx, in, unknown, weight, &throughput, &survival) == 0)
+    return;
+  if (kind == PATH_REFLECTION)
+    ctx->stats.reflection_rays++;
+  else
+    ctx->stats.refraction_rays++;
+  PathRay *next = path_queue_push(&w->next_paths);
+  if (!next) {
+    w->error = ENOMEM;
+    return;
+  }
+  next->ray = *ray;
+  next->ignore = kind == PATH_REFLECTION ? in->obj : NULL;
+  // We do a simple alternation between air and the previously intersected material
+  next->from_mat = kind == PATH_REFLECTION ? NULL : in->from_mat == NULL ? in->mat : NULL;
+  next->slot = path->slot;
+  next->parent = hit_index;
+  next->kind = kind;
+  next->weight = weight;
+  next->survival = survival;
+  next->depth = path->depth + 1;
+  next->throughput = throughput;
+}
+
+static uint64_t *wave_order(Wave *w, size_t len) {
+  if (len > w->order_cap) {
+    uint64_t *order = realloc(w->order, sizeof(uint64_t) * len);
+    if (!order) {
+      w->error = ENOMEM;
+      return NULL;
+    }
+    w->order = order;
+    w->order_cap = len;
+  }
+  return w->order;
+}
+
+// Shades the hit of path, queueing its shadow and secondary rays
+static void shade_hit(Wave *w, PathRay *path, Intersection *in) {
+  TraceContext *ctx = w->ctx;
+  Scene *scene = ctx->scene;
+  const RenderOptions *opts = ctx->opts;
+  in->depth = path->depth;
+  in->from_mat = path->from_mat;
+  in->throughput = path->throughput;
+
+  int hit_index = (int) w->hits.len;
+  HitRecord *hit = hit_queue_push(&w->hits);
+  if (!hit) {
+    w->error = ENOMEM;
+    return;
+  }
+  *hit = (HitRecord) {0};
+  hit->slot = path->slot;
+  hit->parent = path->parent;
+  hit->kind = path->kind;
+  hit->weight = path->weight;
+  hit->survival = path->survival;
+  hit->secondary_survival[PATH_REFLECTION] = 1;
+  hit->secondary_survival[PATH_REFRACTION] = 1;
+  hit->cue = 1;
+  if (scene->depth_cueing_enabled)
+    hit->cue = scene_depth_cue_factor(&scene->depth_cueing,
+                                      sqrt(dist2(in->pos, ctx->camera->eye_pos)));
+
+  Color diff_color = scene_surface_color(in);
+  hit->local = vecmul(diff_color, in->mat->ka);
+  // Every depth gets one dimension for the light selection and one per light
+  uint32_t dimension = 1 + path->depth * (uint32_t) (scene->lights_len + 1);
+  if (opts->light_samples > 0)
+    seek_sampler(w, path->slot, dimension);
+  LightLoop lights;
+  scene_lights_begin(ctx, in, &lights);
+  Light *light;
+  float light_weight;
+  while ((light = scene_lights_next(ctx, in, &lights, &light_weight))) {
+    Color c = vecmul(scene_light_contribution(ctx, in, light, diff_color),
+                     light_weight);
+    if (c.x <= 0 && c.y <= 0 && c.z <= 0) {
+      ctx->stats.shadow_skipped++;
+      continue;
+    }
+
+    if (light->w && light->radius > 0) {
+      // Area lights need several correlated rays, so they are sampled right
+      // away with the sampler positioned deterministically for this light
+      seek_sampler(w, path->slot, dimension + 1 + (uint32_t) (light - scene->lights));
+      hit->local = vecadd(hit->local, vecmul(c, scene_shadow_factor(ctx, light, in)));
+      continue;
+    }
+
+    int visible = scene_shadow_map_lookup(ctx, light, in);
+    if (visible != SHADOW_MAP_UNKNOWN) {
+      if (visible)
+        hit->local = vecadd(hit->local, c);
+      continue;
+    }
+
+    ShadowRay *shadow = shadow_queue_push(&w->shadows);
+    if (!shadow) {
+      w->error = ENOMEM;
+      return;
+    }
+    shadow->ray = scene_shadow_ray(light, in, &shadow->max_t);
+    shadow->ignore = in->obj;
+    shadow->light = light;
+    shadow->hit = hit_index;
+    shadow->color = c;
+  }
+
+  if (path->depth < opts->max_reflect_depth) {
+    Ray refl_ray;
+    float fr = scene_reflection_ray(&path->ray, in, &refl_ray);
+    queue_secondary(w, path, in, hit_index, PATH_REFLECTION, &refl_ray, fr);
+  }
+
+  if (in->mat->opacity < 1 && path->depth < opts->max_refract_depth) {
+    Ray refr_ray;
+    float transmission = scene_refraction_ray(&path->ray, in, &refr_ray);
+    queue_secondary(w, path, in, hit_index, PATH_REFRACTION, &refr_ray, transmission);
+  }
+}
+
+static void trace_paths(Wave *w) {
+  TraceContext *ctx = w->ctx;
+  Scene *scene = ctx->scene;
+  PathQueue *q = &w->paths;
+  uint64_t *order = wave_order(w, q->len);
+  if (!order)
+    return;
+  sort_rays(&q->rays[0].ray, sizeof(PathRay), q->len, order);
+
+  for (size_t i = 0; i < q->len && !w->error; i++) {
+    PathRay *path = &q->rays[(uint32_t) order[i]];
+    if (path->depth == 0)
+      ctx->stats.primary_rays++;
+    Intersection in = scene_closest_hit(ctx, &path->ray, path->ignore);
+    if (path->depth == 0) {
+      Slot *slot = &w->slots[path->slot];
+      slot->obj = in.t == INFINITY ? NULL : in.obj;
+      slot->mat = in.t == INFINITY ? NULL : in.mat;
+      slot->color = scene->bg_color;
+    }
+    // Secondary rays that miss add nothing
+    if (in.t != INFINITY)
+      shade_hit(w, path, &in);
+  }
+}
+
+static void trace_shadows(Wave *w) {
+  ShadowQueue *q = &w->shadows;
+  if (q->len == 0)
+    return;
+  uint64_t *order = wave_order(w, q->len);
+  if (!order)
+    return;
+  sort_rays(&q->rays[0].ray, sizeof(ShadowRay), q->len, order);
+
+  for (size_t i = 0; i < q->len; i++) {
+    ShadowRay *shadow = &q->rays[(uint32_t) order[i]];
+    if (!scene_shadow_occluded(w->ctx, shadow->light, &shadow->ray,
+                               shadow->max_t, shadow->ignore)) {
+      HitRecord *hit = &w->hits.hits[shadow->hit];
+      hit->local = vecadd(hit->local, shadow->color);
+    }
+  }
+  q->len = 0;
+}
+
+// Resolves the hit trees of the wave into their samples, children before
+// their parents, in the order and with the clamps of scene_shade_ray
+static void resolve_hits(Wave *w) {
+  Scene *scene = w->ctx->scene;
+  for (size_t i = w->hits.len; i-- > 0;) {
+    HitRecord *hit = &w->hits.hits[i];
+    Color c = clamp(hit->local);
+    if (scene->depth_cueing_enabled)
+      c = clamp(vecadd(vecmul(c, hit->cue),
+                       vecmul(scene->depth_cueing.color, 1 - hit->cue)));
+    for (int kind = PATH_REFLECTION; kind <= PATH_REFRACTION; kind++)
+      c = scene_add_secondary(c, hit->secondary[kind], hit->secondary_survival[kind]);
+    if (hit->parent < 0) {
+      w->slots[hit->slot].color = c;
+    } else {
+      HitRecord *parent = &w->hits.hits[hit->parent];
+      parent->secondary[hit->kind] = clamp(vecmul(c, hit->weight));
+      parent->secondary_survival[hit->kind] = hit->survival;
+    }
+  }
+  w->hits.len = 0;
+}
+
+// Traces the camera rays of the slots of the wave and everything they lead
+// to, returns 0 if successful or ENOMEM
+static int trace_wave(Wave *w) {
+  TraceContext *ctx = w->ctx;
+  int aa = ctx->opts->aa_min_samples > 1;
+  for (int i = 0; i < w->slots_len; i++) {
+    Slot *slot = &w->slots[i];
+    int x = w->x0 + slot->pixel % w->width, y = w->y0 + slot->pixel / w->width;
+    PathRay *path = path_queue_push(&w->paths);
+    if (!path)
+      return ENOMEM;
+    // The same camera rays as tracer_trace_pixel and tracer_sample_ray
+    path->ray = aa ? tracer_sample_ray(ctx, x, y, slot->sample) : camera_trace_ray(ctx->camera, x, y);
+    path->ignore = NULL;
+    path->from_mat = NULL;
+    path->slot = i;
+    path->parent = -1;
+    path->kind = PATH_REFLECTION;
+    path->weight = 1;
+    path->survival = 1;
+    path->depth = 0;
+    path->throughput = 1;
+  }
+
+  // One bounce depth per iteration: trace, shade, resolve shadows, then
+  // continue with the reflection and refraction rays that were queued
+  while (w->paths.len > 0) {
+    trace_paths(w);
+    trace_shadows(w);
+    if (w->error)
+      return w->error;
+    PathQueue done = w->paths;
+    w->paths = w->next_paths;
+    w->next_paths = done;
+    w->next_paths.len = 0;
+  }
+  resolve_hits(w);
+  return 0;
+}
+
+int wavefront_render_region(TraceContext *ctx, int x0, int y0, int x1, int y1,
+                            PixelMap *out, int off_x, int off_y) {
+  const RenderOptions *opts = ctx->opts;
+  int aa = opts->aa_min_samples > 1;
+  int spp = aa ? opts->aa_min_samples : 1;
+  Wave w = {0};
+  w.ctx = ctx;
+  w.x0 = x0;
+  w.width = x1 - x0;
+  int rows = MAX(1, WAVEFRONT_BATCH / (w.width * spp));
+  int pixels = w.width * rows;
+  w.slots = malloc(sizeof(Slot) * (size_t) pixels * spp);
+  AdaptivePixel *state = malloc(sizeof(AdaptivePixel) * pixels);
+  int *todo = malloc(sizeof(int) * pixels);
+  // Edge keys of the row above the batch and of the pixel left of each row,
+  // recomputed at the region's borders like tracer_render_region does
+  Object **above = malloc(sizeof(Object *) * w.width);
+  Object **left = malloc(sizeof(Object *) * rows);
+  int rc = 0;
+  if (!w.slots || !state || !todo || !above || !left) {
+    rc = ENOMEM;
+    goto done;
+  }
+  for (int x = x0; aa && x < x1; x++)
+    above[x - x0] = y0 > 0 ? tracer_pixel_edge_key(ctx, x, y0 - 1) : NULL;
+
+  for (w.y0 = y0; w.y0 < y1; w.y0 += rows) {
+    int batch_rows = MIN(rows, y1 - w.y0);
+    int batch_pixels = w.width * batch_rows;
+    for (int pixel = 0; pixel < batch_pixels; pixel++) {
+      tracer_adaptive_begin(&state[pixel]);
+      todo[pixel] = spp;
+    }
+    for (int row = 0; aa && row < batch_rows; row++)
+      left[row] = x0 > 0 ? tracer_pixel_edge_key(ctx, x0 - 1, w.y0 + row) : NULL;
+
+    // The first samples of every pixel, then more of those that need them
+    for (;;) {
+      w.slots_len = 0;
+      for (int pixel = 0; pixel < batch_pixels; pixel++) {
+        for (int i = 0; i < todo[pixel]; i++) {
+          Slot *slot = &w.slots[w.slots_len++];
+          slot->pixel = pixel;
+          slot->sample = state[pixel].n + i;
+        }
+      }
+      if (w.slots_len == 0)
+        break;
+      if ((rc = trace_wave(&w)) != 0)
+        goto done;
+      for (int i = 0; i < w.slots_len; i++) {
+        Slot *slot = &w.slots[i];
+        tracer_adaptive_add(&state[slot->pixel], slot->color, slot->obj, slot->mat);
+      }
+      for (int pixel = 0; pixel < batch_pixels; pixel++) {
+        if (!aa || !todo[pixel])
+          continue;
+        int x = pixel % w.width, row = pixel / w.width;
+        Object *l = x > 0 ? state[pixel - 1].key : left[row];
+        Object *up = row > 0 ? state[pixel - w.width].key : above[x];
+        todo[pixel] = tracer_adaptive_next(opts, &state[pixel], x0 + x, w.y0 + row, l, up);
+      }
+      if (!aa)
+        break;
+    }
+
+    for (int pixel = 0; pixel < batch_pixels; pixel++) {
+      int x = x0 + pixel % w.width;
+      int y = w.y0 + pixel / w.width;
+      pixel_map_put(out, x - off_x, y - off_y,
+                    ppm_color_from_color(tracer_adaptive_color(&state[pixel])));
+    }
+    for (int x = 0; aa && x < w.width; x++)
+      above[x] = state[(batch_rows - 1) * w.width + x].key;
+  }
+
+done:
+  free(w.paths.rays);
+  free(w.next_paths.rays);
+  free(w.shadows.rays);
+  free(w.hits.hits);
+  free(w.order);
+  free(w.slots);
+  free(state);
+  free(todo);
+  free(above);
+  free(left);
+  return rc;
+}
@@ -0,0 +1,36 @@
+#ifndef RAYTRACERPROJ__WAVEFRONT_H_
+#define RAYTRACERPROJ__WAVEFRONT_H_
+
+#include "tracer.h"
+
+// Rays traced per wave. Primary rays are generated a batch of rows at a time
+// so the queues stay bounded for large regions.
+#define WAVEFRONT_BATCH 65536
+
+/**
+ * Breadth first alternative to the recursive scene_shade_ray. All rays of a
+ * bounce depth are traced as one batch: primary hits are shaded, which queues
+ * shadow rays for every light and reflection/refraction rays for the next
+ * depth. Each queue is sorted by direction octant and origin cell before it
+ * is traced so neighboring rays in a batch take similar paths through the
+ * scene.
+ *
+ * The hits of every sample are kept until all depths are traced and then
+ * resolved into the sample from the leaves up, clamping each subtree's color
+ * like scene_shade_ray, so the colors are the same as the recursive path's.
+ * Adaptive anti-aliasing traces the first aa_min_samples of every pixel of a
+ * batch as one wave and the further samples of the pixels that need them as
+ * the next ones. Light sampling, area lights and Russian roulette seek the
+ * sampler to a fixed dimension per depth instead of drawing in recursion
+ * order, which changes their noise but not what it averages to. Rays towards
+ * colors that turn out to be saturated are traced anyway, they add nothing.
+ *
+ * Called by tracer_render_region when opts->wavefront is set; pixels are
+ * written to out at (x - off_x, y - off_y).
+ *
+ * @return 0 if successful, ENOMEM if out of memory
+ */
+int wavefront_render_region(TraceContext *ctx, int x0, int y0, int x1, int y1,
+                            PixelMap *out, int off_x, int off_y);
+
+#endif //RAYTRACERPROJ__WAVEFRONT_H_